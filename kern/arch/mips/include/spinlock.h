@@ -44,6 +44,13 @@ void spinlock_data_set(volatile spinlock_data_t *sd, unsigned val);
 spinlock_data_t spinlock_data_get(volatile spinlock_data_t *sd);
 spinlock_data_t spinlock_data_testandset(volatile spinlock_data_t *sd);
 
+/* Atomic operations on pointers, for queued spinlocks */
+void *spinlock_ptr_swap(void *volatile *p, void *val);
+bool spinlock_ptr_cas(void *volatile *p, void *oldval, void *newval);
+
+/* Memory barrier, for other lock-free code */
+void spinlock_membar(void);
+
 ////////////////////////////////////////////////////////////
 
 SPINLOCK_INLINE
@@ -93,5 +100,84 @@ spinlock_data_testandset(volatile spinlock_data_t *sd)
 	return x;
 }
 
+SPINLOCK_INLINE
+void *
+spinlock_ptr_swap(void *volatile *p, void *val)
+{
+	void *x;
+	uint32_t y;
+
+	/*
+	 * Atomic exchange using LL/SC.
+	 *
+	 * Load the existing value into X and try to store VAL; Y
+	 * starts out as VAL and after the SC is 1 if the store
+	 * succeeded and 0 if it failed. Retry until it succeeds.
+	 */
+	do {
+		y = (uint32_t)val;
+		__asm volatile(
+			".set push;"		/* save assembler mode */
+			".set mips32;"		/* allow MIPS32 instructions */
+			".set volatile;"	/* avoid unwanted optimization */
+			"ll %0, 0(%2);"		/*   x = *p */
+			"sc %1, 0(%2);"		/*   *p = y; y = success? */
+			".set pop"		/* restore assembler mode */
+			: "=&r" (x), "+r" (y) : "r" (p) : "memory");
+	} while (y == 0);
+	return x;
+}
+
+SPINLOCK_INLINE
+bool
+spinlock_ptr_cas(void *volatile *p, void *oldval, void *newval)
+{
+	void *x;
+	uint32_t y;
+
+	/*
+	 * Compare-and-swap using LL/SC.
+	 *
+	 * Load the existing value into X; if it isn't OLDVAL, skip
+	 * the store and fail. Otherwise try to store NEWVAL, and
+	 * retry if the SC fails.
+	 */
+	do {
+		y = (uint32_t)newval;
+		__asm volatile(
+			".set push;"		/* save assembler mode */
+			".set mips32;"		/* allow MIPS32 instructions */
+			".set noreorder;"	/* we fill the delay slot */
+			".set volatile;"	/* avoid unwanted optimization */
+			"ll %0, 0(%3);"		/*   x = *p */
+			"bne %0, %2, 1f;"	/*   if (x != oldval) fail */
+			"nop;"			/*   (delay slot) */
+			"sc %1, 0(%3);"		/*   *p = y; y = success? */
+			"1:"
+			".set pop"		/* restore assembler mode */
+			: "=&r" (x), "+r" (y) : "r" (oldval), "r" (p)
+			: "memory");
+		if (x != oldval) {
+			return false;
+		}
+	} while (y == 0);
+	return true;
+}
+
+SPINLOCK_INLINE
+void
+spinlock_membar(void)
+{
+	/*
+	 * Complete all loads and stores before any that follow.
+	 * The "memory" clobber stops the compiler moving them too.
+	 */
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		"sync;"
+		".set pop"		/* restore assembler mode */
+		::: "memory");
+}
 
 #endif /* _MIPS_SPINLOCK_H_ */
@@ -96,10 +96,13 @@
  * ram_stealmem can be used before ram_getsize is called to allocate
  * memory that cannot be freed later. This is intended for use early
  * in bootup before VM initialization is complete.
+ *
+ * ram_freepages returns how many pages ram_stealmem has left.
  */
 
 void ram_bootstrap(void);
 paddr_t ram_stealmem(unsigned long npages);
+unsigned long ram_freepages(void);
 void ram_getsize(paddr_t *lo, paddr_t *hi);
 
 /*
@@ -34,6 +34,9 @@
 #include <mips/trapframe.h>
 #include <thread.h>
 #include <current.h>
+#include <addrspace.h>
+#include <copyinout.h>
+#include <endian.h>
 #include <syscall.h>
 
 
@@ -81,6 +84,13 @@ syscall(struct trapframe *tf)
 	int callno;
 	int32_t retval;
 	int err;
+#ifdef UW
+	uint32_t stackargs[2];
+	uint64_t retval64;	/* for calls that return 64 bits */
+	bool is64;
+	uint64_t pos;
+	int whence;
+#endif // UW
 
 	KASSERT(curthread != NULL);
 	KASSERT(curthread->t_curspl == 0);
@@ -98,6 +108,9 @@ syscall(struct trapframe *tf)
 	 */
 
 	retval = 0;
+#ifdef UW
+	is64 = false;
+#endif // UW
 
 	switch (callno) {
 	    case SYS_reboot:
@@ -109,6 +122,101 @@ syscall(struct trapframe *tf)
 				 (userptr_t)tf->tf_a1);
 		break;
 #ifdef UW
+	case SYS_open:
+	  err = sys_open((userptr_t)tf->tf_a0,
+			 (int)tf->tf_a1,
+			 (mode_t)tf->tf_a2,
+			 (int *)(&retval));
+	  break;
+	case SYS_close:
+	  err = sys_close((int)tf->tf_a0);
+	  break;
+	case SYS_pipe:
+	  err = sys_pipe((userptr_t)tf->tf_a0);
+	  break;
+	case SYS_read:
+	  err = sys_read((int)tf->tf_a0,
+			 (userptr_t)tf->tf_a1,
+			 (int)tf->tf_a2,
+			 (int *)(&retval));
+	  break;
+	case SYS_readv:
+	  err = sys_readv((int)tf->tf_a0,
+			  (userptr_t)tf->tf_a1,
+			  (int)tf->tf_a2,
+			  (int *)(&retval));
+	  break;
+	case SYS_writev:
+	  err = sys_writev((int)tf->tf_a0,
+			   (userptr_t)tf->tf_a1,
+			   (int)tf->tf_a2,
+			   (int *)(&retval));
+	  break;
+	case SYS_pread:
+	case SYS_pwrite:
+	case SYS_preadv:
+	case SYS_pwritev:
+	  /* the 64-bit offset is aligned, so it's on the stack, not in a3 */
+	  err = copyin((userptr_t)(tf->tf_sp + 16), &pos, sizeof(pos));
+	  if (err) {
+	    break;
+	  }
+	  if (callno == SYS_pread) {
+	    err = sys_pread((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+			    (unsigned int)tf->tf_a2, (off_t)pos,
+			    (int *)(&retval));
+	  }
+	  else if (callno == SYS_pwrite) {
+	    err = sys_pwrite((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+			     (unsigned int)tf->tf_a2, (off_t)pos,
+			     (int *)(&retval));
+	  }
+	  else if (callno == SYS_preadv) {
+	    err = sys_preadv((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+			     (int)tf->tf_a2, (off_t)pos, (int *)(&retval));
+	  }
+	  else {
+	    err = sys_pwritev((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+			      (int)tf->tf_a2, (off_t)pos, (int *)(&retval));
+	  }
+	  break;
+	case SYS_poll:
+	  err = sys_poll((userptr_t)tf->tf_a0,
+			 (unsigned)tf->tf_a1,
+			 (int)tf->tf_a2,
+			 (int *)(&retval));
+	  break;
+	case SYS_copy_file_range:
+	  /* len and flags are the fifth and sixth args, on the stack */
+	  err = copyin((userptr_t)(tf->tf_sp + 16), stackargs,
+		       sizeof(stackargs));
+	  if (err) {
+	    break;
+	  }
+	  err = sys_copy_file_range((int)tf->tf_a0,
+				    (userptr_t)tf->tf_a1,
+				    (int)tf->tf_a2,
+				    (userptr_t)tf->tf_a3,
+				    (size_t)stackargs[0],
+				    (unsigned)stackargs[1],
+				    (int *)(&retval));
+	  break;
+	case SYS_lseek:
+	  /* the 64-bit offset is in a2/a3; whence is on the stack */
+	  join32to64(tf->tf_a2, tf->tf_a3, &pos);
+	  err = copyin((userptr_t)(tf->tf_sp + 16), &whence, sizeof(int));
+	  if (err) {
+	    break;
+	  }
+	  err = sys_lseek((int)tf->tf_a0, (off_t)pos, whence,
+			  (off_t *)&retval64);
+	  is64 = true;
+	  break;
+	case SYS_dup2:
+	  err = sys_dup2((int)tf->tf_a0,
+			 (int)tf->tf_a1,
+			 (int *)(&retval));
+	  break;
 	case SYS_write:
 	  err = sys_write((int)tf->tf_a0,
 			  (userptr_t)tf->tf_a1,
@@ -129,6 +237,18 @@ syscall(struct trapframe *tf)
 			    (int)tf->tf_a2,
 			    (pid_t *)&retval);
 	  break;
+	case SYS_fork:
+	  err = sys_fork(tf, (pid_t *)&retval);
+	  break;
+	case SYS_execv:
+	  err = sys_execv((userptr_t)tf->tf_a0,
+			  (userptr_t)tf->tf_a1);
+	  break;
+	case SYS_spawn:
+	  err = sys_spawn((userptr_t)tf->tf_a0,
+			  (userptr_t)tf->tf_a1,
+			  (pid_t *)&retval);
+	  break;
 #endif // UW
 
 	    /* Add stuff here */
@@ -149,6 +269,13 @@ syscall(struct trapframe *tf)
 		tf->tf_v0 = err;
 		tf->tf_a3 = 1;      /* signal an error */
 	}
+#ifdef UW
+	else if (is64) {
+		/* Success, with a 64-bit return value in v0/v1. */
+		split64to32(retval64, &tf->tf_v0, &tf->tf_v1);
+		tf->tf_a3 = 0;      /* signal no error */
+	}
+#endif // UW
 	else {
 		/* Success. */
 		tf->tf_v0 = retval;
@@ -171,13 +298,25 @@ syscall(struct trapframe *tf)
 /*
  * Enter user mode for a newly forked process.
  *
- * This function is provided as a reminder. You need to write
- * both it and the code that calls it.
- *
- * Thus, you can trash it and do things another way if you prefer.
+ * TF is a kmalloc'd copy of the parent's trapframe from the fork
+ * call; we take it over and free it. The child sees fork return 0.
  */
 void
 enter_forked_process(struct trapframe *tf)
 {
-	(void)tf;
+	struct trapframe mytf;
+
+	/* mips_usermode wants the trapframe on our own stack. */
+	mytf = *tf;
+	kfree(tf);
+
+	mytf.tf_v0 = 0;		/* child's return value */
+	mytf.tf_a3 = 0;		/* signal no error */
+	mytf.tf_epc += 4;	/* skip the syscall instruction */
+
+	as_activate();
+
+	mips_usermode(&mytf);
+	/* mips_usermode does not return */
+	panic("enter_forked_process: mips_usermode returned\n");
 }
@@ -173,6 +173,25 @@ cpu_irqonoff(void)
         SET_STATUS(xoff);
 }
 
+/*
+ * Read the cycle counter (coprocessor 0 register 9, "count"). It is
+ * 32 bits and wraps, so only differences of nearby readings mean
+ * anything.
+ */
+uint32_t
+cpu_cycles(void)
+{
+	uint32_t x;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		"mfc0 %0,$9;"		/* x = count register */
+		".set pop"		/* restore assembler mode */
+		: "=r" (x));
+	return x;
+}
+
 ////////////////////////////////////////////////////////////
 
 /*
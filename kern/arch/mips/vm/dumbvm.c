@@ -93,6 +93,24 @@ free_kpages(vaddr_t addr)
 	(void)addr;
 }
 
+unsigned long
+vm_freepages(void)
+{
+	unsigned long npages;
+
+	spinlock_acquire(&stealmem_lock);
+	npages = ram_freepages();
+	spinlock_release(&stealmem_lock);
+	return npages;
+}
+
+bool
+vm_kpages_reusable(void)
+{
+	/* free_kpages leaks. */
+	return false;
+}
+
 void
 vm_tlbshootdown_all(void)
 {
@@ -353,6 +371,13 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+size_t
+as_stacksize(struct addrspace *as)
+{
+	(void)as;
+	return DUMBVM_STACKPAGES * PAGE_SIZE;
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
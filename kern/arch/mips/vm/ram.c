@@ -109,6 +109,16 @@ ram_stealmem(unsigned long npages)
 	return paddr;
 }
 
+/*
+ * Number of pages ram_stealmem can still hand out. Not synchronized
+ * either; callers that steal memory concurrently must lock around it.
+ */
+unsigned long
+ram_freepages(void)
+{
+	return (lastpaddr - firstpaddr) / PAGE_SIZE;
+}
+
 /*
  * This function is intended to be called by the VM system when it
  * initializes in order to find out what memory it has available to
@@ -52,6 +52,7 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/poll.h>
 #include <lib.h>
 #include <uio.h>
 #include <thread.h>
@@ -60,6 +61,7 @@
 #include <generic/console.h>
 #include <vfs.h>
 #include <device.h>
+#include <poll.h>
 #include "autoconf.h"
 
 /*
@@ -74,6 +76,11 @@ static struct con_softc *the_console = NULL;
 static struct lock *con_userlock_read = NULL;
 static struct lock *con_userlock_write = NULL;
 
+/*
+ * Pollers waiting for input.
+ */
+static struct pollq con_pollq;
+
 //////////////////////////////////////////////////
 
 /*
@@ -194,6 +201,7 @@ con_input(void *vcs, int ch)
 	cs->cs_gotchars_head = nexthead;
 		
 	V(cs->cs_rsem);
+	pollq_wakeup(&con_pollq);
 }
 
 /*
@@ -360,6 +368,27 @@ con_ioctl(struct device *dev, int op, userptr_t data)
 	return EINVAL;
 }
 
+/*
+ * Input is ready once there's a character in the buffer. Output
+ * is always ready.
+ */
+static
+int
+con_poll(struct device *dev, int events, struct pollentry *pe, int *revents)
+{
+	struct con_softc *cs = dev->d_data;
+
+	if (pe != NULL && (events & POLLIN)) {
+		pollq_add(&con_pollq, pe);
+	}
+
+	*revents = events & POLLOUT;
+	if (cs->cs_gotchars_head != cs->cs_gotchars_tail) {
+		*revents |= events & POLLIN;
+	}
+	return 0;
+}
+
 static
 int
 attach_console_to_vfs(struct con_softc *cs)
@@ -376,6 +405,7 @@ attach_console_to_vfs(struct con_softc *cs)
 	dev->d_close = con_close;
 	dev->d_io = con_io;
 	dev->d_ioctl = con_ioctl;
+	dev->d_poll = con_poll;
 	dev->d_blocks = 0;
 	dev->d_blocksize = 1;
 	dev->d_data = cs;
@@ -442,6 +472,8 @@ config_con(struct con_softc *cs, int unit)
 	cs->cs_gotchars_head = 0;
 	cs->cs_gotchars_tail = 0;
 
+	pollq_init(&con_pollq);
+
 	the_console = cs;
 	con_userlock_read = rlk;
 	con_userlock_write = wlk;
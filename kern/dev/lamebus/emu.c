@@ -43,6 +43,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/fcntl.h>
+#include <kern/poll.h>
 #include <stat.h>
 #include <lib.h>
 #include <array.h>
@@ -835,6 +836,22 @@ emufs_namefile(struct vnode *v, struct uio *uio)
 	return EUNIMP;
 }
 
+/*
+ * VOP_POLL
+ *
+ * I/O to the emulator never waits on anything but the emulator, so
+ * everything is always ready.
+ */
+static
+int
+emufs_poll(struct vnode *v, int events, struct pollentry *pe, int *revents)
+{
+	(void)v;
+	(void)pe;
+	*revents = events & (POLLIN | POLLOUT);
+	return 0;
+}
+
 /*
  * VOP_MMAP
  */
@@ -1092,6 +1109,7 @@ static const struct vnode_ops emufs_fileops = {
 	emufs_mmap,
 	emufs_truncate,
 	emufs_uio_op_notdir, /* namefile */
+	emufs_poll,
 
 	emufs_creat_notdir,
 	emufs_symlink_notdir,
@@ -1127,6 +1145,7 @@ static const struct vnode_ops emufs_dirops = {
 	emufs_void_op_isdir,  /* mmap */
 	emufs_truncate_isdir,
 	emufs_namefile,
+	emufs_poll,
 
 	emufs_creat,
 	emufs_symlink,
@@ -35,7 +35,9 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
-#include <synch.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <clock.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -59,6 +61,12 @@
 /* Buffer (offset within slot)  */
 #define LHD_BUFFER      32768
 
+/* Most lhds we keep statistics for */
+#define LHD_MAXUNITS    8
+
+bool lhd_fifo = false;
+static struct lhd_softc *lhd_units[LHD_MAXUNITS];
+
 /*
  * Shortcut for reading a register.
  */
@@ -95,28 +103,193 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Start the current sector of the current request on the hardware.
+ * Call with lh_lock held.
+ */
+static
+void
+lhd_startsector(struct lhd_softc *lh)
+{
+	struct lhd_request *lr = lh->lh_cur;
+	uint32_t statval = LHD_WORKING;
+
+	KASSERT(lr != NULL);
+	KASSERT(lr->lr_done < lr->lr_count);
+
+	/*
+	 * Are we writing? If so, transfer the data to the on-card
+	 * buffer.
+	 */
+	if (lr->lr_iswrite) {
+		memcpy(lh->lh_buf,
+		       (char *)lr->lr_buf + lr->lr_done * LHD_SECTSIZE,
+		       LHD_SECTSIZE);
+		statval |= LHD_ISWRITE;
+	}
+
+	/* Tell it what sector we want... */
+	lhd_wreg(lh, LHD_REG_SECT, lr->lr_sector + lr->lr_done);
+
+	/* and start the operation. */
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * Current time in milliseconds, for deadlines. Wraps.
+ */
+static
+uint32_t
+lhd_now(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	gettime(&secs, &nsecs);
+	return (uint32_t)secs * 1000 + nsecs / 1000000;
+}
+
+/*
+ * Pick the next run: the oldest if it's past its deadline (or if
+ * we're doing FIFO), else the next one along in C-LOOK order. Takes
+ * it off the queue. Call with lh_lock held and the queue nonempty.
+ */
+static
+struct lhd_request *
+lhd_pick(struct lhd_softc *lh)
+{
+	struct lhd_request *lr, **pp, **oldest, **next;
+	uint32_t now;
+
+	oldest = next = NULL;
+	for (pp = &lh->lh_qhead; *pp != NULL; pp = &(*pp)->lr_next) {
+		lr = *pp;
+		if (oldest == NULL ||
+		    (int32_t)(lr->lr_qtime - (*oldest)->lr_qtime) < 0) {
+			oldest = pp;
+		}
+		if (next == NULL && lr->lr_sector >= lh->lh_headpos) {
+			next = pp;
+		}
+	}
+	if (next == NULL) {
+		/* Nothing further along; go back to the start. */
+		next = &lh->lh_qhead;
+	}
+
+	now = lhd_now();
+	if (lhd_fifo) {
+		pp = oldest;
+	}
+	else if ((int32_t)(now - (*oldest)->lr_qtime) >= LHD_DEADLINE) {
+		if (oldest != next) {
+			lh->lh_ndeadline++;
+		}
+		pp = oldest;
+	}
+	else {
+		pp = next;
+	}
+
+	lr = *pp;
+	*pp = lr->lr_next;
+	lr->lr_next = NULL;
+	return lr;
+}
+
+/*
+ * If the device is idle, start the next run in the queue.
+ * Call with lh_lock held.
+ */
+static
+void
+lhd_start(struct lhd_softc *lh)
+{
+	struct lhd_request *lr;
+	uint32_t dist;
+
+	if (lh->lh_active != NULL || lh->lh_qhead == NULL) {
+		return;
+	}
+
+	lr = lhd_pick(lh);
+
+	dist = (lr->lr_sector > lh->lh_headpos) ?
+		lr->lr_sector - lh->lh_headpos :
+		lh->lh_headpos - lr->lr_sector;
+	lh->lh_nruns++;
+	lh->lh_seeksum += dist;
+	if (dist > lh->lh_maxseek) {
+		lh->lh_maxseek = dist;
+	}
+
+	lh->lh_active = lr;
+	lh->lh_cur = lr;
+	lhd_startsector(lh);
+}
+
+/*
+ * Record that a sector has completed, and start the next one. Any
+ * requests that are now finished are put on *DONELIST, for the
+ * caller to call back once it has dropped lh_lock.
  */
 static
 void
-lhd_iodone(struct lhd_softc *lh, int err)
+lhd_iodone(struct lhd_softc *lh, int err, struct lhd_request **donelist)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct lhd_request *lr = lh->lh_cur;
+
+	if (lr == NULL) {
+		/* Not ours; ignore it. */
+		return;
+	}
+
+	/*
+	 * Are we reading? If so, and if we succeeded, transfer the
+	 * data out of the on-card buffer.
+	 */
+	if (err == 0 && !lr->lr_iswrite) {
+		memcpy((char *)lr->lr_buf + lr->lr_done * LHD_SECTSIZE,
+		       lh->lh_buf, LHD_SECTSIZE);
+	}
+	lr->lr_done++;
+	lh->lh_headpos = lr->lr_sector + lr->lr_done;
+
+	if (err != 0 || lr->lr_done == lr->lr_count) {
+		/* This request is finished; go on to the next in the run. */
+		KASSERT(lh->lh_depth > 0);
+		lh->lh_depth--;
+		lr->lr_result = err;
+		lh->lh_cur = lr->lr_mergenext;
+		lr->lr_mergenext = NULL;
+		lr->lr_next = *donelist;
+		*donelist = lr;
+		if (lh->lh_cur == NULL) {
+			lh->lh_active = NULL;
+		}
+	}
+
+	if (lh->lh_cur != NULL) {
+		lhd_startsector(lh);
+	}
+	else {
+		lhd_start(lh);
+	}
 }
 
 /*
  * Interrupt handler for lhd.
  * Read the status register; if an operation finished, clear the status
- * register and report completion.
+ * register, report completion, and start the next sector. Callbacks
+ * are made after we drop the lock, so they can submit more requests.
  */
 void
 lhd_irq(void *vlh)
 {
 	struct lhd_softc *lh = vlh;
+	struct lhd_request *donelist = NULL, *lr;
 	uint32_t val;
-	
+
+	spinlock_acquire(&lh->lh_lock);
 	val = lhd_rdreg(lh, LHD_REG_STAT);
 
 	switch (val & LHD_STATEMASK) {
@@ -127,11 +300,202 @@ lhd_irq(void *vlh)
 	    case LHD_INVSECT:
 	    case LHD_MEDIA:
 		lhd_wreg(lh, LHD_REG_STAT, 0);
-		lhd_iodone(lh, lhd_code_to_errno(lh, val));
+		lhd_iodone(lh, lhd_code_to_errno(lh, val), &donelist);
 		break;
 	}
+	spinlock_release(&lh->lh_lock);
+
+	while (donelist != NULL) {
+		lr = donelist;
+		donelist = lr->lr_next;
+		lr->lr_next = NULL;
+		lr->lr_callback(lr, lr->lr_result);
+	}
+}
+
+/*
+ * Return the last request of the run starting at LR.
+ */
+static
+struct lhd_request *
+lhd_runtail(struct lhd_request *lr)
+{
+	while (lr->lr_mergenext != NULL) {
+		lr = lr->lr_mergenext;
+	}
+	return lr;
+}
+
+/*
+ * Return true if some run in the queue is past its deadline.
+ */
+static
+bool
+lhd_overdue(struct lhd_softc *lh)
+{
+	struct lhd_request *lr;
+	uint32_t now;
+
+	now = lhd_now();
+	for (lr = lh->lh_qhead; lr != NULL; lr = lr->lr_next) {
+		if ((int32_t)(now - lr->lr_qtime) >= LHD_DEADLINE) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Put LR in the queue: onto the end of a run (or of the one in
+ * progress) that stops where it starts, or onto the front of a
+ * waiting run that starts where it stops, or else in sector order
+ * as a run of its own. Call with lh_lock held.
+ *
+ * The run in progress isn't extended while anything is overdue;
+ * otherwise a steady sequential stream could keep it going forever
+ * and lhd_pick would never get to look at the deadline.
+ */
+static
+void
+lhd_enqueue(struct lhd_softc *lh, struct lhd_request *lr)
+{
+	struct lhd_request *tail, *prev, **pp;
+
+	/* Onto the end of the run in progress? */
+	if (lh->lh_active != NULL && !lhd_overdue(lh)) {
+		tail = lhd_runtail(lh->lh_cur);
+		if (tail->lr_iswrite == lr->lr_iswrite &&
+		    tail->lr_sector + tail->lr_count == lr->lr_sector) {
+			tail->lr_mergenext = lr;
+			lh->lh_nmerged++;
+			return;
+		}
+	}
+
+	/* Find where it goes: after PREV and before *PP. */
+	prev = NULL;
+	for (pp = &lh->lh_qhead; *pp != NULL; pp = &(*pp)->lr_next) {
+		if ((*pp)->lr_sector > lr->lr_sector) {
+			break;
+		}
+		prev = *pp;
+	}
+
+	if (prev != NULL) {
+		tail = lhd_runtail(prev);
+		if (tail->lr_iswrite == lr->lr_iswrite &&
+		    tail->lr_sector + tail->lr_count == lr->lr_sector) {
+			tail->lr_mergenext = lr;
+			lh->lh_nmerged++;
+			return;
+		}
+	}
+
+	if (*pp != NULL && (*pp)->lr_iswrite == lr->lr_iswrite &&
+	    lr->lr_sector + lr->lr_count == (*pp)->lr_sector) {
+		/* LR becomes the head of the run; it's as old as the run. */
+		lr->lr_mergenext = *pp;
+		lr->lr_next = (*pp)->lr_next;
+		lr->lr_qtime = (*pp)->lr_qtime;
+		(*pp)->lr_next = NULL;
+		*pp = lr;
+		lh->lh_nmerged++;
+		return;
+	}
+
+	lr->lr_next = *pp;
+	*pp = lr;
 }
 
+int
+lhd_submit(struct lhd_softc *lh, struct lhd_request *lr)
+{
+	/* Don't allow I/O past the end of the disk. */
+	if (lr->lr_count == 0 || lr->lr_sector >= lh->lh_dev.d_blocks ||
+	    lr->lr_count > lh->lh_dev.d_blocks - lr->lr_sector) {
+		return EINVAL;
+	}
+
+	lr->lr_done = 0;
+	lr->lr_result = 0;
+	lr->lr_next = NULL;
+	lr->lr_mergenext = NULL;
+	lr->lr_qtime = lhd_now();
+
+	spinlock_acquire(&lh->lh_lock);
+	lh->lh_nreqs++;
+	lh->lh_depth++;
+	lh->lh_depthsum += lh->lh_depth;
+	if (lh->lh_depth > lh->lh_maxdepth) {
+		lh->lh_maxdepth = lh->lh_depth;
+	}
+	lhd_enqueue(lh, lr);
+	lhd_start(lh);
+	spinlock_release(&lh->lh_lock);
+
+	return 0;
+}
+
+/*
+ * Statistics.
+ */
+void
+lhd_printstats(bool reset)
+{
+	struct lhd_softc *lh;
+	unsigned i;
+	unsigned nreqs, nmerged, nruns, ndeadline, maxdepth;
+	uint32_t maxseek;
+	uint64_t depthsum, seeksum;
+
+	kprintf("Disk scheduling: %s\n", lhd_fifo ? "FIFO" : "C-LOOK");
+	for (i=0; i<LHD_MAXUNITS; i++) {
+		lh = lhd_units[i];
+		if (lh == NULL) {
+			continue;
+		}
+
+		/* Copy them out, so as not to print with the lock held. */
+		spinlock_acquire(&lh->lh_lock);
+		nreqs = lh->lh_nreqs;
+		nmerged = lh->lh_nmerged;
+		nruns = lh->lh_nruns;
+		ndeadline = lh->lh_ndeadline;
+		maxdepth = lh->lh_maxdepth;
+		depthsum = lh->lh_depthsum;
+		maxseek = lh->lh_maxseek;
+		seeksum = lh->lh_seeksum;
+		if (reset) {
+			lh->lh_nreqs = lh->lh_nmerged = 0;
+			lh->lh_nruns = lh->lh_ndeadline = 0;
+			lh->lh_depthsum = lh->lh_seeksum = 0;
+			lh->lh_maxdepth = lh->lh_depth;
+			lh->lh_maxseek = 0;
+		}
+		spinlock_release(&lh->lh_lock);
+
+		kprintf("lhd%u: %u requests, %u merged, %u runs "
+			"(%u for deadline)\n", i, nreqs, nmerged, nruns,
+			ndeadline);
+		kprintf("lhd%u: queue depth avg %u max %u; "
+			"seek avg %u max %u sectors\n", i,
+			nreqs ? (unsigned)(depthsum / nreqs) : 0, maxdepth,
+			nruns ? (unsigned)(seeksum / nruns) : 0, maxseek);
+	}
+}
+
+static
+void
+lhd_setfifo(bool fifo)
+{
+	lhd_fifo = fifo;
+}
+
+static const struct diskstats_ops lhd_diskstats = {
+	.ds_print = lhd_printstats,
+	.ds_setfifo = lhd_setfifo,
+};
+
 /*
  * Function called when we are open()'d.
  */
@@ -194,7 +558,75 @@ lhd_reset(struct lhd_softc *lh)
 #endif
 
 /*
- * I/O function (for both reads and writes)
+ * Synchronous I/O: a request, and a flag for its callback to set.
+ */
+struct lhd_syncreq {
+	struct lhd_request sr_req;
+	struct lhd_softc *sr_lh;
+	bool sr_done;
+};
+
+/* Sectors lhd_io moves per request. Keep the bounce buffer small. */
+#define LHD_IOCHUNK 2
+
+static
+void
+lhd_syncdone(struct lhd_request *lr, int result)
+{
+	struct lhd_syncreq *sr = lr->lr_data;
+	struct lhd_softc *lh = sr->sr_lh;
+
+	(void)result;
+
+	spinlock_acquire(&lh->lh_lock);
+	sr->sr_done = true;
+	wchan_wakeall(lh->lh_wchan);
+	spinlock_release(&lh->lh_lock);
+}
+
+/*
+ * Do one request and wait for it.
+ */
+static
+int
+lhd_syncio(struct lhd_softc *lh, uint32_t sector, uint32_t count,
+	   void *buf, bool iswrite)
+{
+	struct lhd_syncreq sr;
+	int result;
+
+	sr.sr_req.lr_sector = sector;
+	sr.sr_req.lr_count = count;
+	sr.sr_req.lr_buf = buf;
+	sr.sr_req.lr_iswrite = iswrite;
+	sr.sr_req.lr_callback = lhd_syncdone;
+	sr.sr_req.lr_data = &sr;
+	sr.sr_lh = lh;
+	sr.sr_done = false;
+
+	result = lhd_submit(lh, &sr.sr_req);
+	if (result) {
+		return result;
+	}
+
+	spinlock_acquire(&lh->lh_lock);
+	while (!sr.sr_done) {
+		wchan_lock(lh->lh_wchan);
+		spinlock_release(&lh->lh_lock);
+		wchan_sleep(lh->lh_wchan);
+		spinlock_acquire(&lh->lh_lock);
+	}
+	spinlock_release(&lh->lh_lock);
+
+	return sr.sr_req.lr_result;
+}
+
+/*
+ * I/O function (for both reads and writes). A synchronous wrapper
+ * around lhd_submit. A kernel buffer in one piece (which is what the
+ * buffer cache hands us) is used directly, as a single request.
+ * Anything else goes through a small bounce buffer, because it may
+ * be in user space, which the interrupt handler can't touch.
  */
 static
 int
@@ -206,9 +638,10 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
-	int result;
+	uint32_t i, n;
+	bool iswrite = (uio->uio_rw == UIO_WRITE);
+	char *bounce;
+	int result = 0;
 
 	/* Don't allow I/O that isn't sector-aligned. */
 	if (sectoff != 0 || lenoff != 0) {
@@ -220,59 +653,59 @@ lhd_io(struct device *d, struct uio *uio)
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	if (len == 0) {
+		return 0;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
+	if (uio->uio_segflg == UIO_SYSSPACE && uio->uio_iovcnt == 1) {
+		struct iovec *iov = uio->uio_iov;
 
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
-
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-			if (result) {
-				V(lh->lh_clear);
-				return result;
-			}
+		KASSERT(iov->iov_len >= uio->uio_resid);
+		result = lhd_syncio(lh, sector, len, iov->iov_kbase, iswrite);
+		if (result) {
+			return result;
 		}
+		iov->iov_kbase = (char *)iov->iov_kbase + uio->uio_resid;
+		iov->iov_len -= uio->uio_resid;
+		uio->uio_offset += uio->uio_resid;
+		uio->uio_resid = 0;
+		return 0;
+	}
 
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
+	bounce = kmalloc(LHD_IOCHUNK * LHD_SECTSIZE);
+	if (bounce == NULL) {
+		return ENOMEM;
+	}
 
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+	/* Loop over all the sectors we were asked to do. */
+	for (i=0; i<len; i+=n) {
+		n = len - i;
+		if (n > LHD_IOCHUNK) {
+			n = LHD_IOCHUNK;
 		}
 
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
+		if (iswrite) {
+			result = uiomove(bounce, n * LHD_SECTSIZE, uio);
+			if (result) {
+				break;
+			}
+		}
 
-		/* If we failed, return the error. */
+		result = lhd_syncio(lh, sector+i, n, bounce, iswrite);
 		if (result) {
-			return result;
+			break;
+		}
+
+		if (!iswrite) {
+			result = uiomove(bounce, n * LHD_SECTSIZE, uio);
+			if (result) {
+				break;
+			}
 		}
 	}
 
-	return 0;
+	kfree(bounce);
+	return result;
 }
 
 /*
@@ -289,23 +722,33 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
+	/* Set up the request queue. */
+	lh->lh_wchan = wchan_create("lhd");
+	if (lh->lh_wchan == NULL) {
 		return ENOMEM;
 	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
-		return ENOMEM;
+	spinlock_init(&lh->lh_lock);
+	lh->lh_qhead = NULL;
+	lh->lh_active = lh->lh_cur = NULL;
+	lh->lh_headpos = 0;
+
+	lh->lh_depth = lh->lh_maxdepth = 0;
+	lh->lh_depthsum = 0;
+	lh->lh_nreqs = lh->lh_nmerged = 0;
+	lh->lh_nruns = lh->lh_ndeadline = 0;
+	lh->lh_seeksum = 0;
+	lh->lh_maxseek = 0;
+	if (lhdno >= 0 && lhdno < LHD_MAXUNITS) {
+		lhd_units[lhdno] = lh;
 	}
+	dev_diskstats = &lhd_diskstats;
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_open = lhd_open;
 	lh->lh_dev.d_close = lhd_close;
 	lh->lh_dev.d_io = lhd_io;
 	lh->lh_dev.d_ioctl = lhd_ioctl;
+	lh->lh_dev.d_poll = NULL;
 	lh->lh_dev.d_blocks = bus_read_register(lh->lh_busdata, lh->lh_buspos,
 						LHD_REG_NSECT);
 	lh->lh_dev.d_blocksize = LHD_SECTSIZE;
@@ -30,6 +30,7 @@
 #ifndef _LAMEBUS_LHD_H_
 #define _LAMEBUS_LHD_H_
 
+#include <spinlock.h>
 #include <device.h>
 
 /*
@@ -37,6 +38,41 @@
  */
 #define LHD_SECTSIZE  512
 
+/*
+ * An I/O request. The caller fills in the first group of fields and
+ * passes it to lhd_submit, which returns at once; when the I/O is
+ * done, LR_CALLBACK is called with the result. The callback runs in
+ * interrupt context, so it mustn't sleep. LR_BUF must be kernel
+ * memory and the request must stay put until the callback.
+ *
+ * Requests queued behind one another for consecutive sectors in the
+ * same direction are merged into a run, which the interrupt handler
+ * carries through sector after sector without going back to the
+ * queue.
+ *
+ * The queue is kept sorted by sector and served C-LOOK: the next run
+ * is the first at or past where the head is, wrapping around to the
+ * lowest when there's nothing further out. A run that has waited
+ * LHD_DEADLINE milliseconds goes next regardless, so nothing starves.
+ * Setting lhd_fifo serves the queue in arrival order instead, for
+ * comparison.
+ */
+struct lhd_request {
+	uint32_t lr_sector;		/* first sector */
+	uint32_t lr_count;		/* number of sectors */
+	void *lr_buf;			/* lr_count * LHD_SECTSIZE bytes */
+	bool lr_iswrite;		/* write (else read) */
+	void (*lr_callback)(struct lhd_request *lr, int result);
+	void *lr_data;			/* for the callback's use */
+
+	/* Private to the driver */
+	uint32_t lr_qtime;		/* ms timestamp when queued */
+	uint32_t lr_done;		/* sectors done so far */
+	int lr_result;			/* error, if any */
+	struct lhd_request *lr_next;	/* next run in the queue */
+	struct lhd_request *lr_mergenext; /* next request in this run */
+};
+
 /*
  * Hardware device data associated with lhd (LAMEbus hard disk)
  */
@@ -51,9 +87,23 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct spinlock lh_lock;	/* Protects the queue */
+	struct lhd_request *lh_qhead;	/* Runs waiting, sorted by sector */
+	struct lhd_request *lh_active;	/* Run in progress, or NULL */
+	struct lhd_request *lh_cur;	/* Request of lh_active in progress */
+	uint32_t lh_headpos;		/* Sector after the last one done */
+	struct wchan *lh_wchan;		/* For lhd_io to wait on */
+
+	/* Statistics (under lh_lock) */
+	unsigned lh_depth;		/* Requests queued or in progress */
+	unsigned lh_maxdepth;		/* Largest lh_depth seen */
+	uint64_t lh_depthsum;		/* Sum of lh_depth at each submit */
+	unsigned lh_nreqs;		/* Requests submitted */
+	unsigned lh_nmerged;		/* ...of which merged into a run */
+	unsigned lh_nruns;		/* Runs started */
+	unsigned lh_ndeadline;		/* ...of which for the deadline */
+	uint64_t lh_seeksum;		/* Sum of sectors moved per run */
+	uint32_t lh_maxseek;		/* Longest such move */
 
 	struct device lh_dev;		/* VFS device structure */
 };
@@ -61,4 +111,19 @@ struct lhd_softc {
 /* Functions called by lower-level drivers */
 void lhd_irq(/*struct lhd_softc*/ void *);	/* Interrupt handler */
 
+/*
+ * Queue a request. Returns EINVAL (and doesn't queue it) if it runs
+ * off the end of the disk.
+ */
+int lhd_submit(struct lhd_softc *lh, struct lhd_request *lr);
+
+/* How long a run may wait before it jumps the queue (milliseconds) */
+#define LHD_DEADLINE 500
+
+/* If true, serve requests in arrival order instead of C-LOOK */
+extern bool lhd_fifo;
+
+/* Print (and optionally then clear) the statistics for every lhd */
+void lhd_printstats(bool reset);
+
 #endif /* _LAMEBUS_LHD_H_ */
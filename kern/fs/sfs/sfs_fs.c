@@ -41,12 +41,63 @@
 #include <uio.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 
 /* Shortcuts for the size macros in kern/sfs.h */
 #define SFS_FS_BITMAPSIZE(sfs)  SFS_BITMAPSIZE((sfs)->sfs_super.sp_nblocks)
 #define SFS_FS_BITBLOCKS(sfs)   SFS_BITBLOCKS((sfs)->sfs_super.sp_nblocks)
 
+/*
+ * Check if two blocks' worth of data differ. (There's no memcmp in
+ * the kernel.)
+ */
+static
+bool
+sfs_blockdiffers(const void *a, const void *b)
+{
+	const uint32_t *wa = a, *wb = b;
+	unsigned i;
+
+	for (i=0; i<SFS_BLOCKSIZE/sizeof(uint32_t); i++) {
+		if (wa[i] != wb[i]) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Clear, in DATA (a copy of block MAPBLOCK of the free block bitmap),
+ * the bits for blocks that are only reserved for files being written
+ * and not actually used (see sfs_balloc_data). Those are marked in
+ * the bitmap in memory but mustn't reach the disk, or a crash would
+ * leak them.
+ */
+static
+void
+sfs_mapio_unreserve(struct sfs_fs *sfs, uint32_t mapblock, uint8_t *data)
+{
+	struct sfs_vnode *sv;
+	uint32_t block, first, last;
+	unsigned i, j, num;
+
+	first = mapblock * SFS_BLOCKBITS;
+	last = first + SFS_BLOCKBITS;
+
+	num = vnodearray_num(sfs->sfs_vnodes);
+	for (i=0; i<num; i++) {
+		sv = vnodearray_get(sfs->sfs_vnodes, i)->vn_data;
+		for (j=0; j<sv->sv_pacount; j++) {
+			block = sv->sv_pastart + j;
+			if (block >= first && block < last) {
+				block -= first;
+				data[block / CHAR_BIT] &= ~(1 << (block % CHAR_BIT));
+			}
+		}
+	}
+}
+
 /*
  * Routine for doing I/O (reads or writes) on the free block bitmap.
  * We always do the whole bitmap at once; writing individual sectors
@@ -63,14 +114,22 @@
  *
  * The sectors used by the superblock and the bitmap itself are
  * likewise marked in use by mksfs.
+ *
+ * Writing goes to the buffer cache, and only the sectors that differ
+ * from what's there are marked dirty, so allocating one block costs
+ * one sector of bitmap rather than all of them. Blocks that are only
+ * reserved are written as free.
  */
 
 static
 int
 sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
 {
+	/* Under the biglock; words, for sfs_blockdiffers. */
+	static uint32_t scratch[SFS_BLOCKSIZE / sizeof(uint32_t)];
 	uint32_t j, mapsize;
 	char *bitdata;
+	struct buf *b;
 	int result;
 
 	/* Number of blocks in the bitmap. */
@@ -88,15 +147,44 @@ sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
 		/* and read or write it. The bitmap starts at sector 2. */ 
 		if (rw == UIO_READ) {
 			result = sfs_rblock(sfs, ptr, SFS_MAP_LOCATION+j);
+			if (result) {
+				return result;
+			}
+			continue;
 		}
-		else {
-			result = sfs_wblock(sfs, ptr, SFS_MAP_LOCATION+j);
+
+		result = buffer_read(sfs->sfs_device, SFS_MAP_LOCATION+j, &b);
+		if (result) {
+			return result;
+		}
+		memcpy(scratch, ptr, SFS_BLOCKSIZE);
+		sfs_mapio_unreserve(sfs, j, (uint8_t *)scratch);
+		if (sfs_blockdiffers(buffer_map(b), scratch)) {
+			memcpy(buffer_map(b), scratch, SFS_BLOCKSIZE);
+			buffer_mark_dirty(b);
 		}
+		buffer_release(b);
+	}
+	return 0;
+}
 
-		/* If we failed, stop. */
+/*
+ * Put the free block map in the buffer cache if it has changed.
+ * Called with the biglock held.
+ */
+int
+sfs_sync_freemap(struct sfs_fs *sfs)
+{
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (sfs->sfs_freemapdirty) {
+		result = sfs_mapio(sfs, UIO_WRITE);
 		if (result) {
 			return result;
 		}
+		sfs->sfs_freemapdirty = false;
 	}
 	return 0;
 }
@@ -148,21 +236,23 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
+	/*
+	 * Go over the array of loaded vnodes, putting changed inodes
+	 * in the buffer cache. (Not VOP_FSYNC, which would write each
+	 * file's blocks separately; the buffer_sync below writes all
+	 * of them in one pass.)
+	 */
 	num = vnodearray_num(sfs->sfs_vnodes);
 	for (i=0; i<num; i++) {
 		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+		sfs_sync_inode(v->vn_data);
 	}
 
 	/* If the free block map needs to be written, write it. */
-	if (sfs->sfs_freemapdirty) {
-		result = sfs_mapio(sfs, UIO_WRITE);
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
-		sfs->sfs_freemapdirty = false;
+	result = sfs_sync_freemap(sfs);
+	if (result) {
+		vfs_biglock_release();
+		return result;
 	}
 
 	/* If the superblock needs to be written, write it. */
@@ -175,6 +265,13 @@ sfs_sync(struct fs *fs)
 		sfs->sfs_superdirty = false;
 	}
 
+	/* Write out anything left in the buffer cache. */
+	result = buffer_sync(sfs->sfs_device);
+	if (result) {
+		vfs_biglock_release();
+		return result;
+	}
+
 	vfs_biglock_release();
 	return 0;
 }
@@ -224,6 +321,9 @@ sfs_unmount(struct fs *fs)
 	/* Once we start nuking stuff we can't fail. */
 	vnodearray_destroy(sfs->sfs_vnodes);
 	bitmap_destroy(sfs->sfs_freemap);
+
+	/* Forget our blocks, in case the device is used some other way. */
+	buffer_drop(sfs->sfs_device);
 	
 	/* The vfs layer takes care of the device for us */
 	(void)sfs->sfs_device;
@@ -255,6 +355,7 @@ int
 sfs_domount(void *options, struct device *dev, struct fs **ret)
 {
 	int result;
+	unsigned i;
 	struct sfs_fs *sfs;
 
 	vfs_biglock_acquire();
@@ -268,6 +369,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	KASSERT(sizeof(struct sfs_super)==SFS_BLOCKSIZE);
 	KASSERT(sizeof(struct sfs_inode)==SFS_BLOCKSIZE);
 	KASSERT(SFS_BLOCKSIZE % sizeof(struct sfs_dir) == 0);
+	KASSERT(BUFFER_SIZE == SFS_BLOCKSIZE);
 
 	/*
 	 * We can't mount on devices with the wrong sector size.
@@ -296,6 +398,9 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		vfs_biglock_release();
 		return ENOMEM;
 	}
+	for (i=0; i<SFS_VNHASHSIZE; i++) {
+		sfs->sfs_vnhash[i] = NULL;
+	}
 
 	/* Set the device so we can use sfs_rblock() */
 	sfs->sfs_device = dev;
@@ -305,6 +410,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	if (result) {
 		vnodearray_destroy(sfs->sfs_vnodes);
 		kfree(sfs);
+		buffer_drop(dev);
 		vfs_biglock_release();
 		return result;
 	}
@@ -318,6 +424,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			SFS_MAGIC);
 		vnodearray_destroy(sfs->sfs_vnodes);
 		kfree(sfs);
+		buffer_drop(dev);
 		vfs_biglock_release();
 		return EINVAL;
 	}
@@ -335,6 +442,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	if (sfs->sfs_freemap == NULL) {
 		vnodearray_destroy(sfs->sfs_vnodes);
 		kfree(sfs);
+		buffer_drop(dev);
 		vfs_biglock_release();
 		return ENOMEM;
 	}
@@ -343,6 +451,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		bitmap_destroy(sfs->sfs_freemap);
 		vnodearray_destroy(sfs->sfs_vnodes);
 		kfree(sfs);
+		buffer_drop(dev);
 		vfs_biglock_release();
 		return result;
 	}
@@ -35,6 +35,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/fcntl.h>
+#include <kern/poll.h>
 #include <stat.h>
 #include <lib.h>
 #include <array.h>
@@ -43,11 +44,17 @@
 #include <synch.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 
 /* At bottom of file */
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
 			 struct sfs_vnode **ret);
+static void sfs_vnhash_remove(struct sfs_fs *sfs, struct sfs_vnode *sv);
+static void sfs_dirindex_update(struct sfs_vnode *sv, int slot,
+				const struct sfs_dir *oldsd,
+				const struct sfs_dir *newsd);
+static void sfs_dirindex_destroy(struct sfs_vnode *sv);
 
 ////////////////////////////////////////////////////////////
 //
@@ -58,13 +65,23 @@ static
 int
 sfs_clearblock(struct sfs_fs *sfs, uint32_t block)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
-	return sfs_wblock(sfs, zeros, block);
+	struct buf *b;
+	int result;
+
+	result = buffer_get(sfs->sfs_device, block, &b);
+	if (result) {
+		return result;
+	}
+	bzero(buffer_map(b), SFS_BLOCKSIZE);
+	buffer_mark_dirty(b);
+	buffer_release(b);
+	return 0;
 }
 
-/* Write an on-disk inode structure back out to disk. */
-static
+/*
+ * Write an on-disk inode structure back out. This only puts it in
+ * the buffer cache; it reaches the disk later.
+ */
 int
 sfs_sync_inode(struct sfs_vnode *sv)
 {
@@ -84,15 +101,52 @@ sfs_sync_inode(struct sfs_vnode *sv)
 // Space allocation
 
 /*
- * Allocate a block.
+ * Blocks reserved ahead of a file that's being written in order.
+ */
+#define SFS_PREALLOC 8
+
+/*
+ * Give back the blocks reserved for a file that it didn't use.
+ */
+static
+void
+sfs_prealloc_release(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+	while (sv->sv_pacount > 0) {
+		bitmap_unmark(sfs->sfs_freemap, sv->sv_pastart);
+		sv->sv_pastart++;
+		sv->sv_pacount--;
+	}
+}
+
+/*
+ * Allocate a block: GOAL if it's free, or else the nearest free one
+ * after it. If GOAL is 0, anywhere.
  */
 static
 int
-sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
+sfs_balloc(struct sfs_fs *sfs, uint32_t goal, uint32_t *diskblock)
 {
+	unsigned i, num;
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	if (goal != 0) {
+		result = bitmap_alloc_near(sfs->sfs_freemap, goal, diskblock);
+	}
+	else {
+		result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	}
+	if (result == ENOSPC) {
+		/* Take back everyone's reservations and try again. */
+		num = vnodearray_num(sfs->sfs_vnodes);
+		for (i=0; i<num; i++) {
+			struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
+			sfs_prealloc_release(v->vn_data);
+		}
+		result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	}
 	if (result) {
 		return result;
 	}
@@ -106,6 +160,62 @@ sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
 	return sfs_clearblock(sfs, *diskblock);
 }
 
+/*
+ * Allocate FILEBLOCK of a file, where the block before it is on disk
+ * at PREVBLOCK (0 if there isn't one).
+ *
+ * Files should be contiguous on disk, so the block after PREVBLOCK is
+ * wanted, or for the first block the one after the inode. While a
+ * file is being written in order the next SFS_PREALLOC blocks are
+ * reserved for it too, as far as they're free, by marking them in use;
+ * otherwise two files written at once take turns and end up
+ * interleaved. The reservation is given back when the file is written
+ * out of order or closed. Reserved blocks are written to disk as free
+ * (see sfs_mapio), so a crash doesn't leak them.
+ */
+static
+int
+sfs_balloc_data(struct sfs_vnode *sv, uint32_t fileblock,
+		uint32_t prevblock, uint32_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t block;
+	bool sequential;
+	int result;
+
+	sequential = (fileblock == sv->sv_nextfileblock);
+	sv->sv_nextfileblock = fileblock + 1;
+
+	if (sequential && sv->sv_pacount > 0) {
+		/* Already marked, but on disk it's still free. */
+		*diskblock = sv->sv_pastart;
+		sv->sv_pastart++;
+		sv->sv_pacount--;
+		sfs->sfs_freemapdirty = true;
+		return sfs_clearblock(sfs, *diskblock);
+	}
+	sfs_prealloc_release(sv);
+
+	result = sfs_balloc(sfs, prevblock != 0 ? prevblock + 1 : sv->sv_ino + 1,
+			    diskblock);
+	if (result) {
+		return result;
+	}
+
+	if (sequential) {
+		sv->sv_pastart = *diskblock + 1;
+		for (block = sv->sv_pastart;
+		     sv->sv_pacount < SFS_PREALLOC &&
+			     block < sfs->sfs_super.sp_nblocks &&
+			     !bitmap_isset(sfs->sfs_freemap, block);
+		     block++) {
+			bitmap_mark(sfs->sfs_freemap, block);
+			sv->sv_pacount++;
+		}
+	}
+	return 0;
+}
+
 /*
  * Free a block.
  */
@@ -115,6 +225,9 @@ sfs_bfree(struct sfs_fs *sfs, uint32_t diskblock)
 {
 	bitmap_unmark(sfs->sfs_freemap, diskblock);
 	sfs->sfs_freemapdirty = true;
+
+	/* Don't bother writing out whatever was in it. */
+	buffer_discard(sfs->sfs_device, diskblock);
 }
 
 /*
@@ -146,22 +259,15 @@ int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	 uint32_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-	uint32_t block;
+	struct buf *idbuf;
+	uint32_t *iddata;
+	uint32_t block, prevblock;
 	uint32_t idblock;
 	uint32_t idnum, idoff;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(SFS_DBPERIDB * sizeof(uint32_t) == SFS_BLOCKSIZE);
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -176,7 +282,10 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		 * Do we need to allocate?
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+			prevblock = (fileblock > 0) ?
+				sv->sv_i.sfi_direct[fileblock-1] : 0;
+			result = sfs_balloc_data(sv, fileblock, prevblock,
+						 &block);
 			if (result) {
 				return result;
 			}
@@ -236,7 +345,7 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		 * the indirect block. Thus, we need to allocate an
 		 * indirect block.
 		 */
-		result = sfs_balloc(sfs, &idblock);
+		result = sfs_balloc(sfs, 0, &idblock);
 		if (result) {
 			return result;
 		}
@@ -247,38 +356,37 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		/* Mark the inode dirty */
 		sv->sv_dirty = true;
 
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
+		/* sfs_balloc zeroed it, so it's in the cache now */
 	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_rblock(sfs, idbuf, idblock);
-		if (result) {
-			return result;
-		}
+
+	/* Load the indirect block */
+	result = buffer_read(sfs->sfs_device, idblock, &idbuf);
+	if (result) {
+		return result;
 	}
+	iddata = buffer_map(idbuf);
 
 	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+	block = iddata[idoff];
 
 	/* If there's no block there, allocate one */
 	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
+		prevblock = (idoff > 0) ?
+			iddata[idoff-1] : sv->sv_i.sfi_direct[SFS_NDIRECT-1];
+		result = sfs_balloc_data(sv, SFS_NDIRECT + fileblock,
+					 prevblock, &block);
 		if (result) {
+			buffer_release(idbuf);
 			return result;
 		}
 
 		/* Remember the block we allocated */
-		idbuf[idoff] = block;
+		iddata[idoff] = block;
 
-		/* The indirect block is now dirty; write it back */
-		result = sfs_wblock(sfs, idbuf, idblock);
-		if (result) {
-			return result;
-		}
+		/* The indirect block is now dirty */
+		buffer_mark_dirty(idbuf);
 	}
+	buffer_release(idbuf);
 
 	/* Hand back the result and return. */
 	if (block != 0 && !sfs_bused(sfs, block)) {
@@ -308,16 +416,8 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *iobuf;
 	uint32_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -339,40 +439,35 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * It reads as zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_rblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block from the buffer cache.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = buffer_read(sfs->sfs_device, diskblock, &iobuf);
 	if (result) {
 		return result;
 	}
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * Now perform the requested operation into/out of the buffer.
+	 */
+	result = uiomove((char *)buffer_map(iobuf) + skipstart, len, uio);
+
+	/*
+	 * If it was a write, the buffer is now dirty. (Even if uiomove
+	 * failed, part of it may have been changed.)
 	 */
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_wblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		buffer_mark_dirty(iobuf);
 	}
 
-	return 0;
+	buffer_release(iobuf);
+	return result;
 }
 
 /*
@@ -383,24 +478,30 @@ int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *iobuf;
 	uint32_t diskblock;
 	uint32_t fileblock;
+	bool isnew;
 	int result;
-	int doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
 	/* Look up the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	result = sfs_bmap(sv, fileblock, 0, &diskblock);
 	if (result) {
 		return result;
 	}
 
+	/* Allocate it if it's missing and we're writing */
+	isnew = (diskblock == 0 && uio->uio_rw == UIO_WRITE);
+	if (isnew) {
+		result = sfs_bmap(sv, fileblock, 1, &diskblock);
+		if (result) {
+			return result;
+		}
+	}
+
 	if (diskblock == 0) {
 		/*
 		 * No block - fill with zeros.
@@ -412,31 +513,40 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 		return uiomovezeros(SFS_BLOCKSIZE, uio);
 	}
 
-	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
-
-	/*
-	 * Temporarily set the residue to be one block size.
-	 */
 	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
-	
-	result = sfs_rwblock(sfs, uio);
+
+	if (uio->uio_rw == UIO_READ) {
+		result = buffer_read(sfs->sfs_device, diskblock, &iobuf);
+		if (result) {
+			return result;
+		}
+		result = uiomove(buffer_map(iobuf), SFS_BLOCKSIZE, uio);
+		buffer_release(iobuf);
+		return result;
+	}
 
 	/*
-	 * Now, restore the original uio_offset and uio_resid and update 
-	 * them by the amount of I/O done.
+	 * We're overwriting the whole block. If it was just allocated
+	 * there's no need to read it first. Otherwise read it anyway,
+	 * so that if the copy fails partway the rest of the block
+	 * still holds its old contents and not garbage.
 	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
-
+	if (isnew) {
+		result = buffer_get(sfs->sfs_device, diskblock, &iobuf);
+	}
+	else {
+		result = buffer_read(sfs->sfs_device, diskblock, &iobuf);
+	}
+	if (result) {
+		return result;
+	}
+	result = uiomove(buffer_map(iobuf), SFS_BLOCKSIZE, uio);
+	if (result && isnew) {
+		/* Don't let whatever was in the buffer reach the file. */
+		bzero(buffer_map(iobuf), SFS_BLOCKSIZE);
+	}
+	buffer_mark_dirty(iobuf);
+	buffer_release(iobuf);
 	return result;
 }
 
@@ -589,6 +699,8 @@ sfs_writedir(struct sfs_vnode *sv, struct sfs_dir *sd, int slot)
 {
 	struct iovec iov;
 	struct uio ku;
+	struct sfs_dir oldsd;
+	bool hadold = false;
 	off_t actualpos;
 	int result;
 
@@ -596,12 +708,23 @@ sfs_writedir(struct sfs_vnode *sv, struct sfs_dir *sd, int slot)
 	KASSERT(slot>=0);
 	actualpos = slot * sizeof(struct sfs_dir);
 
+	/* If there's a name index, it needs to know what was here. */
+	if (sv->sv_dirindex != NULL && actualpos < sv->sv_i.sfi_size) {
+		result = sfs_readdir(sv, &oldsd, slot);
+		if (result) {
+			return result;
+		}
+		hadold = true;
+	}
+
 	/* Set up a uio to do the write */ 
 	uio_kinit(&iov, &ku, sd, sizeof(struct sfs_dir), actualpos, UIO_WRITE);
 
 	/* do it */
 	result = sfs_io(sv, &ku);
 	if (result) {
+		/* Who knows what's there now; forget the index. */
+		sfs_dirindex_destroy(sv);
 		return result;
 	}
 
@@ -610,6 +733,8 @@ sfs_writedir(struct sfs_vnode *sv, struct sfs_dir *sd, int slot)
 		panic("sfs: writedir: Short write (ino %u)\n", sv->sv_ino);
 	}
 
+	sfs_dirindex_update(sv, slot, hadold ? &oldsd : NULL, sd);
+
 	/* Done */
 	return 0;
 }
@@ -637,15 +762,250 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 }
 
 /*
- * Search a directory for a particular filename in a directory, and
- * return its inode number, its slot, and/or the slot number of an
- * empty directory slot if one is found.
+ * Directory name index.
+ *
+ * Looking a name up by reading every slot is slow in a big directory,
+ * so the first lookup in a directory reads it once and builds an
+ * index: for each name in use, its hash and its slot, in a hash table
+ * on the hash; and a list of the empty slots, to hand out when a name
+ * is added. The names themselves stay on disk (in the buffer cache),
+ * and a lookup checks the few slots whose hash matches. Everything
+ * that changes a directory goes through sfs_writedir, which keeps the
+ * index up to date. If memory runs out the index is thrown away, and
+ * lookups scan until it can be built again.
  */
 
+struct sfs_dirslot {
+	uint32_t ds_hash;		/* hash of the name, if in use */
+	int ds_slot;			/* slot in the directory */
+	struct sfs_dirslot *ds_next;	/* hash chain, or free list */
+};
+
+struct sfs_dirindex {
+	struct sfs_dirslot **di_buckets;
+	unsigned di_nbuckets;
+	unsigned di_nnames;		/* names in the hash table */
+	struct sfs_dirslot *di_free;	/* empty slots */
+};
+
+/* Bucket counts. The table doubles when chains average over 2. */
+#define SFS_DIRINDEX_MINBUCKETS 16
+#define SFS_DIRINDEX_MAXBUCKETS 256
+
+static
+uint32_t
+sfs_dirindex_hash(const char *name)
+{
+	uint32_t h = 5381;
+
+	while (*name != 0) {
+		h = h*33 + (unsigned char)*name++;
+	}
+	return h;
+}
+
+static
+void
+sfs_dirindex_destroy(struct sfs_vnode *sv)
+{
+	struct sfs_dirindex *di = sv->sv_dirindex;
+	struct sfs_dirslot *ds;
+	unsigned i;
+
+	if (di == NULL) {
+		return;
+	}
+	for (i=0; i<di->di_nbuckets; i++) {
+		while ((ds = di->di_buckets[i]) != NULL) {
+			di->di_buckets[i] = ds->ds_next;
+			kfree(ds);
+		}
+	}
+	while ((ds = di->di_free) != NULL) {
+		di->di_free = ds->ds_next;
+		kfree(ds);
+	}
+	kfree(di->di_buckets);
+	kfree(di);
+	sv->sv_dirindex = NULL;
+}
+
+/*
+ * Double the number of buckets, if it's time. Failing is harmless.
+ */
+static
+void
+sfs_dirindex_grow(struct sfs_dirindex *di)
+{
+	struct sfs_dirslot **newb, *ds;
+	unsigned newn, i;
+
+	if (di->di_nnames <= 2 * di->di_nbuckets ||
+	    di->di_nbuckets >= SFS_DIRINDEX_MAXBUCKETS) {
+		return;
+	}
+	newn = di->di_nbuckets * 2;
+	newb = kmalloc(newn * sizeof(newb[0]));
+	if (newb == NULL) {
+		return;
+	}
+	for (i=0; i<newn; i++) {
+		newb[i] = NULL;
+	}
+	for (i=0; i<di->di_nbuckets; i++) {
+		while ((ds = di->di_buckets[i]) != NULL) {
+			di->di_buckets[i] = ds->ds_next;
+			ds->ds_next = newb[ds->ds_hash % newn];
+			newb[ds->ds_hash % newn] = ds;
+		}
+	}
+	kfree(di->di_buckets);
+	di->di_buckets = newb;
+	di->di_nbuckets = newn;
+}
+
+/*
+ * File DS under the hash of SD's name, or as empty if SD is free.
+ */
+static
+void
+sfs_dirindex_insert(struct sfs_dirindex *di, struct sfs_dirslot *ds,
+		    const struct sfs_dir *sd)
+{
+	unsigned b;
+
+	if (sd->sfd_ino == SFS_NOINO) {
+		ds->ds_next = di->di_free;
+		di->di_free = ds;
+		return;
+	}
+	ds->ds_hash = sfs_dirindex_hash(sd->sfd_name);
+	b = ds->ds_hash % di->di_nbuckets;
+	ds->ds_next = di->di_buckets[b];
+	di->di_buckets[b] = ds;
+	di->di_nnames++;
+	sfs_dirindex_grow(di);
+}
+
+/*
+ * Read the whole directory and build its index.
+ */
 static
 int
-sfs_dir_findname(struct sfs_vnode *sv, const char *name,
-		    uint32_t *ino, int *slot, int *emptyslot)
+sfs_dirindex_build(struct sfs_vnode *sv)
+{
+	struct sfs_dirindex *di;
+	struct sfs_dirslot *ds;
+	struct sfs_dir tsd;
+	int nentries = sfs_dir_nentries(sv);
+	unsigned i;
+	int slot, result;
+
+	KASSERT(sv->sv_dirindex == NULL);
+
+	di = kmalloc(sizeof(*di));
+	if (di == NULL) {
+		return ENOMEM;
+	}
+	di->di_nbuckets = SFS_DIRINDEX_MINBUCKETS;
+	di->di_buckets = kmalloc(di->di_nbuckets * sizeof(di->di_buckets[0]));
+	if (di->di_buckets == NULL) {
+		kfree(di);
+		return ENOMEM;
+	}
+	for (i=0; i<di->di_nbuckets; i++) {
+		di->di_buckets[i] = NULL;
+	}
+	di->di_nnames = 0;
+	di->di_free = NULL;
+	sv->sv_dirindex = di;
+
+	for (slot=0; slot<nentries; slot++) {
+		result = sfs_readdir(sv, &tsd, slot);
+		if (result) {
+			sfs_dirindex_destroy(sv);
+			return result;
+		}
+		tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+
+		ds = kmalloc(sizeof(*ds));
+		if (ds == NULL) {
+			sfs_dirindex_destroy(sv);
+			return ENOMEM;
+		}
+		ds->ds_slot = slot;
+		sfs_dirindex_insert(di, ds, &tsd);
+	}
+	return 0;
+}
+
+/*
+ * Called by sfs_writedir after it changes slot SLOT from OLDSD (NULL
+ * if the slot is new) to NEWSD.
+ */
+static
+void
+sfs_dirindex_update(struct sfs_vnode *sv, int slot,
+		    const struct sfs_dir *oldsd, const struct sfs_dir *newsd)
+{
+	struct sfs_dirindex *di = sv->sv_dirindex;
+	struct sfs_dirslot *ds, **dsp;
+	struct sfs_dir tsd;
+	uint32_t hash;
+
+	if (di == NULL) {
+		return;
+	}
+
+	/* Find the slot's entry and take it out. */
+	ds = NULL;
+	if (oldsd != NULL) {
+		if (oldsd->sfd_ino == SFS_NOINO) {
+			dsp = &di->di_free;
+		}
+		else {
+			tsd = *oldsd;
+			tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+			hash = sfs_dirindex_hash(tsd.sfd_name);
+			dsp = &di->di_buckets[hash % di->di_nbuckets];
+		}
+		for (; *dsp != NULL; dsp = &(*dsp)->ds_next) {
+			if ((*dsp)->ds_slot == slot) {
+				break;
+			}
+		}
+		/* It must be there, or the index is wrong. */
+		KASSERT(*dsp != NULL);
+		ds = *dsp;
+		*dsp = ds->ds_next;
+		if (oldsd->sfd_ino != SFS_NOINO) {
+			di->di_nnames--;
+		}
+	}
+	else {
+		ds = kmalloc(sizeof(*ds));
+		if (ds == NULL) {
+			/* Give up on the index; it'll be rebuilt. */
+			sfs_dirindex_destroy(sv);
+			return;
+		}
+		ds->ds_slot = slot;
+	}
+
+	/* Put it back according to what's there now. */
+	tsd = *newsd;
+	tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+	sfs_dirindex_insert(di, ds, &tsd);
+}
+
+/*
+ * Search a directory for a particular filename by reading every
+ * slot. Used when there's no memory for an index.
+ */
+static
+int
+sfs_dir_scanname(struct sfs_vnode *sv, const char *name,
+		 uint32_t *ino, int *slot, int *emptyslot)
 {
 	struct sfs_dir tsd;
 	int found = 0;
@@ -688,6 +1048,63 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 	return found ? 0 : ENOENT;
 }
 
+/*
+ * Search a directory for a particular filename in a directory, and
+ * return its inode number, its slot, and/or the slot number of an
+ * empty directory slot if one is found.
+ */
+static
+int
+sfs_dir_findname(struct sfs_vnode *sv, const char *name,
+		    uint32_t *ino, int *slot, int *emptyslot)
+{
+	struct sfs_dirindex *di;
+	struct sfs_dirslot *ds;
+	struct sfs_dir tsd;
+	uint32_t hash;
+	int result;
+
+	if (sv->sv_dirindex == NULL) {
+		result = sfs_dirindex_build(sv);
+		if (result == ENOMEM) {
+			return sfs_dir_scanname(sv, name, ino, slot, emptyslot);
+		}
+		if (result) {
+			return result;
+		}
+	}
+	di = sv->sv_dirindex;
+
+	if (emptyslot != NULL && di->di_free != NULL) {
+		*emptyslot = di->di_free->ds_slot;
+	}
+
+	hash = sfs_dirindex_hash(name);
+	for (ds = di->di_buckets[hash % di->di_nbuckets]; ds != NULL;
+	     ds = ds->ds_next) {
+		if (ds->ds_hash != hash) {
+			continue;
+		}
+		result = sfs_readdir(sv, &tsd, ds->ds_slot);
+		if (result) {
+			return result;
+		}
+		tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+		KASSERT(tsd.sfd_ino != SFS_NOINO);
+		if (!strcmp(tsd.sfd_name, name)) {
+			if (slot != NULL) {
+				*slot = ds->ds_slot;
+			}
+			if (ino != NULL) {
+				*ino = tsd.sfd_ino;
+			}
+			return 0;
+		}
+	}
+
+	return ENOENT;
+}
+
 /*
  * Create a link in a directory to the specified inode by number, with
  * the specified name, and optionally hand back the slot.
@@ -801,7 +1218,7 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	 * number is the block number, so just get a block.)
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_balloc(sfs, 0, &ino);
 	if (result) {
 		return result;
 	}
@@ -875,8 +1292,17 @@ static
 int
 sfs_close(struct vnode *v)
 {
-	/* Sync it. */
-	return VOP_FSYNC(v);
+	int result;
+
+	/*
+	 * Put the inode in the buffer cache. The syncer writes it
+	 * later; closing doesn't promise anything is on disk.
+	 */
+	vfs_biglock_acquire();
+	sfs_prealloc_release(v->vn_data);
+	result = sfs_sync_inode(v->vn_data);
+	vfs_biglock_release();
+	return result;
 }
 
 /*
@@ -890,7 +1316,6 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
 	int result;
 
 	vfs_biglock_acquire();
@@ -910,6 +1335,8 @@ sfs_reclaim(struct vnode *v)
 		return EBUSY;
 	}
 
+	sfs_prealloc_release(sv);
+
 	/* If there are no on-disk references to the file either, erase it. */
 	if (sv->sv_i.sfi_linkcount==0) {
 		result = VOP_TRUNCATE(&sv->sv_v, 0);
@@ -931,22 +1358,10 @@ sfs_reclaim(struct vnode *v)
 		sfs_bfree(sfs, sv->sv_ino);
 	}
 
-	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
-		panic("sfs: reclaim vnode %u not in vnode pool\n",
-		      sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	/* Remove the vnode structure from the tables in the struct sfs_fs. */
+	sfs_vnhash_remove(sfs, sv);
+
+	sfs_dirindex_destroy(sv);
 
 	VOP_CLEANUP(&sv->sv_v);
 
@@ -959,6 +1374,63 @@ sfs_reclaim(struct vnode *v)
 	return 0;
 }
 
+/*
+ * Read-ahead. A read that starts in the block where the previous read
+ * of the file ended is sequential; each one doubles the window, from
+ * SFS_RAMIN up to SFS_RAMAX blocks, and anything else shuts it off.
+ * While it's open we keep the blocks up to the end of the window
+ * coming into the buffer cache, so that the reader finds them there.
+ *
+ * The state is in the vnode, since VOP_READ doesn't know which open
+ * file it's for; two readers interleaving in one file look random.
+ */
+#define SFS_RAMIN 4
+#define SFS_RAMAX 32
+
+static
+void
+sfs_readahead(struct sfs_vnode *sv, uint32_t firstblock, off_t endpos)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t endblock, fileblock, lastblock, diskblock;
+
+	endblock = endpos / SFS_BLOCKSIZE;
+
+	if (firstblock == sv->sv_ranext) {
+		if (sv->sv_rawindow == 0) {
+			sv->sv_rawindow = SFS_RAMIN;
+		}
+		else if (sv->sv_rawindow < SFS_RAMAX) {
+			sv->sv_rawindow *= 2;
+		}
+	}
+	else {
+		sv->sv_rawindow = 0;
+		sv->sv_raend = 0;
+	}
+	sv->sv_ranext = endblock;
+
+	if (sv->sv_rawindow == 0) {
+		return;
+	}
+
+	lastblock = endblock + sv->sv_rawindow;
+	if (lastblock > DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE)) {
+		lastblock = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+	}
+	fileblock = (sv->sv_raend > endblock) ? sv->sv_raend : endblock;
+
+	for (; fileblock < lastblock; fileblock++) {
+		if (sfs_bmap(sv, fileblock, 0, &diskblock)) {
+			break;
+		}
+		if (diskblock != 0) {
+			buffer_readahead(sfs->sfs_device, diskblock);
+		}
+	}
+	sv->sv_raend = fileblock;
+}
+
 /*
  * Called for read(). sfs_io() does the work.
  */
@@ -967,12 +1439,17 @@ int
 sfs_read(struct vnode *v, struct uio *uio)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	uint32_t firstblock;
 	int result;
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
 	vfs_biglock_acquire();
+	firstblock = uio->uio_offset / SFS_BLOCKSIZE;
 	result = sfs_io(sv, uio);
+	if (result == 0) {
+		sfs_readahead(sv, firstblock, uio->uio_offset);
+	}
 	vfs_biglock_release();
 
 	return result;
@@ -1092,20 +1569,80 @@ sfs_tryseek(struct vnode *v, off_t pos)
 }
 
 /*
- * Called for fsync(), and also on filesystem unmount, global sync(),
- * and some other cases.
+ * Called for fsync().
+ *
+ * Writes just what this file needs: the free block map, then the
+ * file's own blocks (inode, data, and indirect) that are dirty in the
+ * buffer cache, in ascending order. Everything else waits for the
+ * syncer.
  */
 static
 int
 sfs_fsync(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	struct buf *idbuf;
+	uint32_t *iddata;
+	daddr_t *blocks, mapblock;
+	unsigned num, i;
 	int result;
 
+	/* Inode, direct blocks, indirect block, and what it points to */
+	blocks = kmalloc((1 + SFS_NDIRECT + 1 + SFS_DBPERIDB) *
+			 sizeof(blocks[0]));
+	if (blocks == NULL) {
+		return ENOMEM;
+	}
+
 	vfs_biglock_acquire();
+
 	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+	if (result) {
+		goto out;
+	}
+	result = sfs_sync_freemap(sfs);
+	if (result) {
+		goto out;
+	}
+
+	/* The bitmap comes before any file's blocks on disk. */
+	for (i=0; i<SFS_BITBLOCKS(sfs->sfs_super.sp_nblocks); i++) {
+		mapblock = SFS_MAP_LOCATION + i;
+		result = buffer_flushblocks(sfs->sfs_device, &mapblock, 1);
+		if (result) {
+			goto out;
+		}
+	}
+
+	num = 0;
+	blocks[num++] = sv->sv_ino;
+	for (i=0; i<SFS_NDIRECT; i++) {
+		if (sv->sv_i.sfi_direct[i] != 0) {
+			blocks[num++] = sv->sv_i.sfi_direct[i];
+		}
+	}
+	if (sv->sv_i.sfi_indirect != 0) {
+		blocks[num++] = sv->sv_i.sfi_indirect;
+		result = buffer_read(sfs->sfs_device, sv->sv_i.sfi_indirect,
+				     &idbuf);
+		if (result) {
+			goto out;
+		}
+		iddata = buffer_map(idbuf);
+		for (i=0; i<SFS_DBPERIDB; i++) {
+			if (iddata[i] != 0) {
+				blocks[num++] = iddata[i];
+			}
+		}
+		buffer_release(idbuf);
+	}
+
+	result = buffer_flushblocks(sfs->sfs_device, blocks, num);
 
+ out:
+	vfs_biglock_release();
+	kfree(blocks);
 	return result;
 }
 
@@ -1120,6 +1657,20 @@ sfs_mmap(struct vnode *v   /* add stuff as needed */)
 	return EUNIMP;
 }
 
+/*
+ * Called for poll(). Disk I/O doesn't count as blocking, so files
+ * and directories are always ready.
+ */
+static
+int
+sfs_poll(struct vnode *v, int events, struct pollentry *pe, int *revents)
+{
+	(void)v;
+	(void)pe;
+	*revents = events & (POLLIN | POLLOUT);
+	return 0;
+}
+
 /*
  * Called for ftruncate() and from sfs_reclaim.
  */
@@ -1127,17 +1678,10 @@ static
 int
 sfs_truncate(struct vnode *v, off_t len)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *idbuf;
+	uint32_t *iddata;
 
 	/* Length in blocks (divide rounding up) */
 	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
@@ -1147,8 +1691,6 @@ sfs_truncate(struct vnode *v, off_t len)
 	int result;
 	int hasnonzero, iddirty;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
-
 	vfs_biglock_acquire();
 
 	/*
@@ -1177,41 +1719,39 @@ sfs_truncate(struct vnode *v, off_t len)
 		/* We're past the proposed EOF; may need to free stuff */
 
 		/* Read the indirect block */
-		result = sfs_rblock(sfs, idbuf, idblock);
+		result = buffer_read(sfs->sfs_device, idblock, &idbuf);
 		if (result) {
 			vfs_biglock_release();
 			return result;
 		}
+		iddata = buffer_map(idbuf);
 		
 		hasnonzero = 0;
 		iddirty = 0;
 		for (j=0; j<SFS_DBPERIDB; j++) {
 			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
+			if (blocklen < baseblock+j && iddata[j] != 0) {
+				sfs_bfree(sfs, iddata[j]);
+				iddata[j] = 0;
 				iddirty = 1;
 			}
 			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
+			if (iddata[j]!=0) {
 				hasnonzero=1;
 			}
 		}
 
+		if (iddirty) {
+			buffer_mark_dirty(idbuf);
+		}
+		buffer_release(idbuf);
+
 		if (!hasnonzero) {
 			/* The whole indirect block is empty now; free it */
 			sfs_bfree(sfs, idblock);
 			sv->sv_i.sfi_indirect = 0;
 			sv->sv_dirty = true;
 		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_wblock(sfs, idbuf, idblock);
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
-		}
 	}
 
 	/* Set the file size */
@@ -1594,6 +2134,7 @@ static const struct vnode_ops sfs_fileops = {
 	sfs_mmap,
 	sfs_truncate,
 	NOTDIR,  /* namefile */
+	sfs_poll,
 
 	NOTDIR,  /* creat */
 	NOTDIR,  /* symlink */
@@ -1629,6 +2170,7 @@ static const struct vnode_ops sfs_dirops = {
 	ISDIR,   /* mmap */
 	ISDIR,   /* truncate */
 	sfs_namefile,
+	sfs_poll,
 
 	sfs_creat,
 	UNIMP,   /* symlink */
@@ -1642,6 +2184,70 @@ static const struct vnode_ops sfs_dirops = {
 	sfs_lookparent,
 };
 
+/*
+ * The table of loaded vnodes. Lookups go through the hash table,
+ * sfs_vnhash, keyed by inode number; the array sfs_vnodes is just
+ * for going through them all (at sync and unmount). Each vnode
+ * remembers its index in the array, so removal is constant time too:
+ * the last entry is moved into the hole.
+ */
+static
+struct sfs_vnode *
+sfs_vnhash_find(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+
+	for (sv = sfs->sfs_vnhash[ino % SFS_VNHASHSIZE]; sv != NULL;
+	     sv = sv->sv_hashnext) {
+		if (sv->sv_ino == ino) {
+			return sv;
+		}
+	}
+	return NULL;
+}
+
+/* Add to the hash table; must already be in the array. */
+static
+void
+sfs_vnhash_insert(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	unsigned h = sv->sv_ino % SFS_VNHASHSIZE;
+
+	sv->sv_hashnext = sfs->sfs_vnhash[h];
+	sfs->sfs_vnhash[h] = sv;
+}
+
+/* Remove from both the hash table and the array. */
+static
+void
+sfs_vnhash_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **svp, *last;
+	unsigned num;
+	int result;
+
+	for (svp = &sfs->sfs_vnhash[sv->sv_ino % SFS_VNHASHSIZE];
+	     *svp != sv; svp = &(*svp)->sv_hashnext) {
+		if (*svp == NULL) {
+			panic("sfs: reclaim vnode %u not in vnode pool\n",
+			      sv->sv_ino);
+		}
+	}
+	*svp = sv->sv_hashnext;
+	sv->sv_hashnext = NULL;
+
+	num = vnodearray_num(sfs->sfs_vnodes);
+	KASSERT(sv->sv_index < num);
+	KASSERT(vnodearray_get(sfs->sfs_vnodes, sv->sv_index) == &sv->sv_v);
+	last = vnodearray_get(sfs->sfs_vnodes, num-1)->vn_data;
+	vnodearray_set(sfs->sfs_vnodes, sv->sv_index, &last->sv_v);
+	last->sv_index = sv->sv_index;
+	/* Shrinking never fails */
+	result = vnodearray_setsize(sfs->sfs_vnodes, num-1);
+	KASSERT(result == 0);
+	(void)result;
+}
+
 /*
  * Function to load a inode into memory as a vnode, or dig up one
  * that's already resident.
@@ -1651,36 +2257,24 @@ int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	const struct vnode_ops *ops = NULL;
-	unsigned i, num;
 	int result;
 
 	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
-
-		/* Every inode in memory must be in an allocated block */
-		if (!sfs_bused(sfs, sv->sv_ino)) {
-			panic("sfs: Found inode %u in unallocated block\n",
-			      sv->sv_ino);
-		}
-
-		if (sv->sv_ino==ino) {
-			/* Found */
+	sv = sfs_vnhash_find(sfs, ino);
+	if (sv != NULL) {
+		/*
+		 * Found. (It was checked to be in an allocated block
+		 * when it was loaded, and can't be freed while loaded.)
+		 */
 
-			/* May only be set when creating new objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
+		/* May only be set when creating new objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
 
-			VOP_INCREF(&sv->sv_v);
-			*ret = sv;
-			return 0;
-		}
+		VOP_INCREF(&sv->sv_v);
+		*ret = sv;
+		return 0;
 	}
 
 	/* Didn't have it loaded; load it */
@@ -1706,6 +2300,19 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Not dirty yet */
 	sv->sv_dirty = false;
 
+	/* No directory index until it's wanted */
+	sv->sv_dirindex = NULL;
+
+	/* No reads yet */
+	sv->sv_ranext = 0;
+	sv->sv_raend = 0;
+	sv->sv_rawindow = 0;
+
+	/* Nothing allocated or reserved yet */
+	sv->sv_nextfileblock = 0;
+	sv->sv_pastart = 0;
+	sv->sv_pacount = 0;
+
 	/*
 	 * FORCETYPE is set if we're creating a new file, because the
 	 * block on disk will have been zeroed out and thus the type
@@ -1744,12 +2351,13 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	sv->sv_ino = ino;
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
+	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, &sv->sv_index);
 	if (result) {
 		VOP_CLEANUP(&sv->sv_v);
 		kfree(sv);
 		return result;
 	}
+	sfs_vnhash_insert(sfs, sv);
 
 	/* Hand it back */
 	*ret = sv;
@@ -91,6 +91,9 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_stacksize - return how many bytes of stack the address space
+ *                has below the initial stack pointer.
  */
 
 struct addrspace *as_create(void);
@@ -107,6 +110,7 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+size_t            as_stacksize(struct addrspace *as);
 
 
 /*
@@ -0,0 +1,99 @@
+#ifndef _BUF_H_
+#define _BUF_H_
+
+/*
+ * Buffer cache.
+ *
+ * Caches disk blocks of BUFFER_SIZE bytes, named by device and block
+ * number. A buffer is used by getting a reference to it with
+ * buffer_read (or buffer_get, if the whole block is about to be
+ * overwritten), looking at or changing its contents through
+ * buffer_map, and dropping the reference with buffer_release. A
+ * buffer that has references is never thrown out or reused for
+ * another block, so callers should hold them only briefly.
+ *
+ * The cache keeps its own lists consistent, but callers are
+ * responsible for keeping two threads from changing the same
+ * buffer's contents at once; sfs does this with the vfs biglock.
+ *
+ * Changed buffers are marked dirty and written back later: by
+ * buffer_flush, buffer_flushblocks, or buffer_sync, when they are
+ * chosen for replacement, or by the syncer thread, which syncs all
+ * filesystems every SYNCER_INTERVAL seconds. Writes to disk are made
+ * in ascending block order where there's a choice.
+ *
+ * Replacement is 2Q: a block read in for the first time goes on a
+ * FIFO of recent blocks. When it falls off the end its number is
+ * remembered for a while, and if it is wanted again in that time it
+ * comes back on an LRU list of frequently used blocks. A scan that
+ * touches many blocks once (reading a big file, say) thus pushes out
+ * only other blocks used once, not the inodes and directories that
+ * are used over and over.
+ */
+
+/* Size of each buffer; the same as the sfs block size. */
+#define BUFFER_SIZE 512
+
+/*
+ * Most buffers the cache will hold. Each takes BUFFER_SIZE bytes
+ * plus a small header; memory is allocated as buffers are first
+ * needed and then kept. Change this to resize the cache.
+ */
+#define BUFFER_MAXBUFS 512
+
+/* Seconds between runs of the syncer. */
+#define SYNCER_INTERVAL 5
+
+/* Most read-aheads outstanding at once; more are ignored. */
+#define BUFFER_MAXREADAHEAD 64
+
+struct device;
+struct buf;	/* Opaque */
+
+/*
+ * Functions:
+ *
+ * buffer_read      - Get the buffer for BLOCK of device DEV, reading
+ *                    it from disk if it isn't already in memory.
+ * buffer_get       - Get the buffer for BLOCK of DEV without reading
+ *                    it, for a caller that will overwrite all of it
+ *                    and then mark it dirty. If it wasn't in memory
+ *                    its contents are garbage until then.
+ * buffer_readahead - Start reading BLOCK of DEV into the cache, if it
+ *                    isn't there, and return without waiting. Only a
+ *                    hint: it may do nothing.
+ * buffer_map       - Return a pointer to a buffer's BUFFER_SIZE bytes.
+ * buffer_mark_dirty - Note that a buffer's contents have changed.
+ * buffer_release   - Drop a reference.
+ * buffer_flush     - Write a buffer to disk now if it's dirty.
+ * buffer_flushblocks - Write whichever of the NUM blocks of DEV listed
+ *                    in BLOCKS are in the cache and dirty. Sorts
+ *                    BLOCKS.
+ * buffer_discard   - The contents of BLOCK of DEV no longer matter
+ *                    (it's been freed); don't bother writing them.
+ * buffer_sync      - Write all dirty buffers for DEV.
+ * buffer_drop      - Forget every buffer for DEV, which must have no
+ *                    references or dirty buffers. For unmount, and
+ *                    for devices that might be changed behind the
+ *                    cache's back.
+ * buffer_bootstrap - Initialize the cache and start the syncer.
+ * buffer_readahead_bootstrap - Start the read-ahead threads. Must be
+ *                    called after the secondary cpus are running;
+ *                    until then buffer_readahead does nothing.
+ */
+int buffer_read(struct device *dev, daddr_t block, struct buf **ret);
+int buffer_get(struct device *dev, daddr_t block, struct buf **ret);
+void buffer_readahead(struct device *dev, daddr_t block);
+void *buffer_map(struct buf *b);
+void buffer_mark_dirty(struct buf *b);
+void buffer_release(struct buf *b);
+int buffer_flush(struct buf *b);
+int buffer_flushblocks(struct device *dev, daddr_t *blocks, unsigned num);
+void buffer_discard(struct device *dev, daddr_t block);
+int buffer_sync(struct device *dev);
+void buffer_drop(struct device *dev);
+void buffer_bootstrap(void);
+void buffer_readahead_bootstrap(void);
+
+
+#endif /* _BUF_H_ */
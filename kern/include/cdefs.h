@@ -52,6 +52,16 @@
 #endif
 
 
+/*
+ * Tell GCC that a function doesn't return.
+ */
+#ifdef __GNUC__
+#define __DEAD __attribute__((__noreturn__))
+#else
+#define __DEAD
+#endif
+
+
 /*
  * Material for supporting inline functions.
  *
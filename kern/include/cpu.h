@@ -60,6 +60,16 @@ struct cpu {
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	struct spinlock_qnode c_spinnodes[SPINLOCK_MAXNEST];
+					/* Queue nodes for spinlock waits */
+	unsigned c_spinnodes_used;	/* Bitmask of c_spinnodes in use */
+
+	/*
+	 * Accessed by other cpus (to trim it) as well as this one.
+	 * Protected by c_threadcache_lock.
+	 */
+	struct threadlist c_threadcache; /* Exited threads kept for reuse */
+	struct spinlock c_threadcache_lock;
 
 	/*
 	 * Accessed by other cpus.
@@ -122,6 +132,13 @@ const char *cpu_identify(void);
 void cpu_irqoff(void);
 void cpu_irqon(void);
 
+/*
+ * Return the value of the cycle counter. This is a free-running
+ * 32-bit counter that wraps; subtract two readings (as uint32_t) to
+ * get an interval.
+ */
+uint32_t cpu_cycles(void);
+
 /*
  * Idle or shut down (respectively) the processor.
  *
@@ -36,16 +36,21 @@
 
 
 struct uio;  /* in <uio.h> */
+struct pollentry;  /* in <poll.h> */
 
 /*
  * Filesystem-namespace-accessible device.
  * d_io is for both reads and writes; the uio indicates the direction.
+ * d_poll is as for vop_poll (see vnode.h); if it is NULL the device
+ * never blocks and is always ready.
  */
 struct device {
 	int (*d_open)(struct device *, int flags_from_open);
 	int (*d_close)(struct device *);
 	int (*d_io)(struct device *, struct uio *);
 	int (*d_ioctl)(struct device *, int op, userptr_t data);
+	int (*d_poll)(struct device *, int events, struct pollentry *pe,
+		      int *revents);
 
 	blkcnt_t d_blocks;
 	blksize_t d_blocksize;
@@ -55,6 +60,22 @@ struct device {
 	void *d_data;		/* device-specific data */
 };
 
+/*
+ * Disk scheduling statistics, for the "ds" menu command. A disk
+ * driver that keeps them points dev_diskstats at its functions when
+ * it attaches; otherwise it's NULL.
+ *
+ *   ds_print   - print the statistics, then clear them if RESET.
+ *   ds_setfifo - serve requests in arrival order if FIFO is true,
+ *                else in the driver's usual order.
+ */
+struct diskstats_ops {
+	void (*ds_print)(bool reset);
+	void (*ds_setfifo)(bool fifo);
+};
+
+extern const struct diskstats_ops *dev_diskstats;
+
 /* Create vnode for a vfs-level device. */
 struct vnode *dev_create_vnode(struct device *dev);
 
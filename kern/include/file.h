@@ -0,0 +1,86 @@
+#ifndef _FILE_H_
+#define _FILE_H_
+
+/*
+ * Open files and per-process file tables.
+ *
+ * An openfile is what open() creates: a vnode together with the
+ * access mode and the seek position. File descriptors name openfiles
+ * through a process's filetable. Several descriptors can share one
+ * openfile, in the same process (dup2) or in different ones (fork),
+ * and then they share its seek position, as in Unix.
+ *
+ * Each openfile has its own lock, held across each read, write, or
+ * seek so that those are atomic with respect to the seek position;
+ * I/O through different openfiles never waits on one another here.
+ */
+
+#include <limits.h>
+#include <spinlock.h>
+
+struct vnode;
+struct lock;
+
+struct openfile {
+	struct vnode *of_vnode;		/* the file */
+	int of_flags;			/* O_ACCMODE bits and O_APPEND */
+	struct lock *of_lock;		/* protects of_offset */
+	off_t of_offset;		/* seek position */
+	struct spinlock of_reflock;	/* protects of_refcount */
+	unsigned of_refcount;		/* # of descriptors using us */
+};
+
+/*
+ * A file table. Slots are file descriptors; NULL is a free slot.
+ */
+struct filetable {
+	struct spinlock ft_lock;	/* protects ft_files */
+	struct openfile *ft_files[OPEN_MAX];
+};
+
+/*
+ * Openfile functions.
+ *
+ * openfile_create - Make a new openfile, with one reference, for the
+ *                   already-open vnode VN; the openfile takes over
+ *                   the caller's reference to VN and closes it with
+ *                   vfs_close when done.
+ * openfile_open   - Open PATH (which may be destroyed) with open()'s
+ *                   FLAGS and MODE, returning a new openfile with one
+ *                   reference.
+ * openfile_incref - Add a reference.
+ * openfile_decref - Drop a reference; the last one closes the file.
+ */
+int openfile_create(struct vnode *vn, int flags, struct openfile **ret);
+int openfile_open(char *path, int flags, mode_t mode, struct openfile **ret);
+void openfile_incref(struct openfile *of);
+void openfile_decref(struct openfile *of);
+
+/*
+ * Filetable functions.
+ *
+ * filetable_create  - Create an empty file table.
+ * filetable_destroy - Close everything in a file table and free it.
+ * filetable_copy    - Create a copy of a file table for a child
+ *                     process, sharing the same openfiles.
+ * filetable_place   - Put OF in the lowest free slot, returning the fd.
+ *                   Takes over the caller's reference. Fails with
+ *                   EMFILE if the table is full.
+ * filetable_get     - Get the openfile for FD, with a reference added
+ *                   for the caller. Fails with EBADF.
+ * filetable_setfd   - Put OF at FD (taking over the caller's reference),
+ *                   returning what was there before, or NULL, in OLD.
+ * filetable_remove  - Take FD out of the table, returning its openfile
+ *                   (and its reference) in RET. Fails with EBADF.
+ */
+struct filetable *filetable_create(void);
+void filetable_destroy(struct filetable *ft);
+int filetable_copy(struct filetable *src, struct filetable **ret);
+int filetable_place(struct filetable *ft, struct openfile *of, int *fd);
+int filetable_get(struct filetable *ft, int fd, struct openfile **ret);
+int filetable_setfd(struct filetable *ft, int fd, struct openfile *of,
+                    struct openfile **old);
+int filetable_remove(struct filetable *ft, int fd, struct openfile **ret);
+
+
+#endif /* _FILE_H_ */
@@ -0,0 +1,29 @@
+#ifndef _KERN_POLL_H_
+#define _KERN_POLL_H_
+
+/*
+ * Definitions for poll().
+ *
+ * The caller fills in fd and events for each file of interest; poll
+ * fills in revents. A negative fd is ignored (its revents is 0).
+ * POLLERR, POLLHUP, and POLLNVAL are reported whether asked for or
+ * not.
+ */
+
+struct pollfd {
+	int fd;			/* file descriptor */
+	short events;		/* events to look for */
+	short revents;		/* events that happened */
+};
+
+#define POLLIN    0x0001	/* Reading won't block */
+#define POLLOUT   0x0004	/* Writing won't block */
+#define POLLERR   0x0008	/* Error (e.g. pipe's read end is gone) */
+#define POLLHUP   0x0010	/* Hung up (e.g. pipe's write end is gone) */
+#define POLLNVAL  0x0020	/* fd is not open */
+
+#define POLLRDNORM POLLIN
+#define POLLWRNORM POLLOUT
+
+
+#endif /* _KERN_POLL_H_ */
@@ -178,7 +178,7 @@ void beep(void);
  * threads are created.
  */
 int kprintf(const char *format, ...) __PF(1,2);
-void panic(const char *format, ...) __PF(1,2);
+__DEAD void panic(const char *format, ...) __PF(1,2);
 void badassert(const char *expr, const char *file, int line, const char *func);
 
 void kgets(char *buf, size_t maxbuflen);
@@ -0,0 +1,30 @@
+#ifndef _PIPE_H_
+#define _PIPE_H_
+
+/*
+ * Anonymous pipes.
+ *
+ * A pipe is a pair of vnodes, one for each end, sharing a ring
+ * buffer of PIPE_SIZE bytes. Reading the read end takes data out;
+ * writing the write end puts data in. Each end goes away when its
+ * last reference does: after the write end is gone, reads return end
+ * of file once the buffer is empty, and after the read end is gone,
+ * writes fail with EPIPE.
+ *
+ * Writes of up to PIPE_SIZE bytes are atomic.
+ */
+
+#include <vm.h>
+
+#define PIPE_SIZE PAGE_SIZE
+
+struct vnode;
+
+/*
+ * Create a pipe. Hands back its two ends, each with one reference
+ * and not yet open (use VOP_INCOPEN, as vfs_open would).
+ */
+int pipe_create(struct vnode **readend, struct vnode **writeend);
+
+
+#endif /* _PIPE_H_ */
@@ -0,0 +1,65 @@
+#ifndef _POLL_H_
+#define _POLL_H_
+
+/*
+ * Wait queues for poll().
+ *
+ * Anything that can be polled and can become ready later (the console
+ * when input arrives, a pipe when data or space shows up) keeps a
+ * pollq, and calls pollq_wakeup on it whenever that happens. A
+ * polling thread puts one pollentry per file on the pollq of each
+ * file it is waiting for (see vop_poll in vnode.h). A wakeup marks
+ * just the entries on that queue, so the poller then rechecks only
+ * those files rather than everything it was asked about.
+ *
+ * pollq_wakeup may be called from an interrupt handler. It costs
+ * almost nothing when nobody is polling.
+ */
+
+#include <spinlock.h>
+
+struct pollwaiter;	/* Opaque; private to poll.c */
+
+/*
+ * One file's place on a wait queue. Owned by the polling thread.
+ */
+struct pollentry {
+	struct pollwaiter *pe_waiter;	/* who to wake */
+	struct pollq *pe_q;		/* queue we're on, or NULL */
+	struct pollentry *pe_next;	/* link on pe_q */
+	bool pe_fired;			/* on the waiter's ready list */
+	struct pollentry *pe_readynext;	/* link on the ready list */
+	struct pollentry *pe_checknext;	/* poller's private list */
+};
+
+/*
+ * A wait queue.
+ */
+struct pollq {
+	struct spinlock pq_lock;	/* protects pq_head */
+	struct pollentry *volatile pq_head;
+};
+
+/*
+ * Functions:
+ *
+ * pollq_init    - Set up a wait queue.
+ * pollq_cleanup - Clean up a wait queue, which must be empty.
+ * pollq_add     - Put PE on PQ. Called from vop_poll implementations
+ *                 before they check whether the object is ready, so
+ *                 a wakeup in between isn't missed.
+ * pollq_wakeup  - Tell everyone on PQ to check again. Call after
+ *                 making whatever changed visible.
+ *
+ * poll_bootstrap - Set up poll()'s timeouts. Must be called after the
+ *                  secondary cpus are running.
+ */
+void pollq_init(struct pollq *pq);
+void pollq_cleanup(struct pollq *pq);
+void pollq_add(struct pollq *pq, struct pollentry *pe);
+void pollq_wakeup(struct pollq *pq);
+
+void poll_bootstrap(void);
+
+
+#endif /* _POLL_H_ */
@@ -41,9 +41,11 @@
 
 struct addrspace;
 struct vnode;
+struct filetable;
 #ifdef UW
 struct semaphore;
 #endif // UW
+struct cv;
 
 /*
  * Process structure.
@@ -59,14 +61,17 @@ struct proc {
 	/* VFS */
 	struct vnode *p_cwd;		/* current working directory */
 
-#ifdef UW
-  /* a vnode to refer to the console device */
-  /* this is a quick-and-dirty way to get console writes working */
-  /* you will probably need to change this when implementing file-related
-     system calls, since each process will need to keep track of all files
-     it has opened, not just the console. */
-  struct vnode *console;                /* a vnode for the console device */
-#endif
+	/* Files */
+	struct filetable *p_filetable;	/* open files */
+
+	/* Process table; all protected by the process table lock */
+	pid_t p_pid;			/* our pid */
+	struct proc *p_parent;		/* parent, or NULL if none */
+	struct proc *p_children;	/* children not yet reaped */
+	struct proc *p_sibling;		/* next on parent's p_children */
+	bool p_exited;			/* true once we've called _exit */
+	int p_exitstatus;		/* wait status, once exited */
+	struct cv *p_waitcv;		/* signaled when a child exits */
 
 	/* add more material here as needed */
 };
@@ -88,6 +93,24 @@ struct proc *proc_create_runprogram(const char *name);
 /* Destroy a process. */
 void proc_destroy(struct proc *proc);
 
+/* Make CHILD a child of PARENT, so PARENT can wait for it. */
+void proc_addchild(struct proc *parent, struct proc *child);
+
+/*
+ * Exit: record wait status STATUS for PROC, whose last thread has
+ * already been detached, and release what it no longer needs. The
+ * rest is kept until its parent waits for it.
+ */
+void proc_exit(struct proc *proc, int status);
+
+/*
+ * Wait for child PID (or WAIT_ANY) of the current process to exit
+ * and reap it, returning its pid in RET and its wait status in
+ * STATUS. With WNOHANG in OPTIONS, return 0 in RET if no child is
+ * ready rather than waiting.
+ */
+int proc_wait(pid_t pid, int options, int *status, pid_t *ret);
+
 /* Attach a thread to a process. Must not already have a process. */
 int proc_addthread(struct proc *proc, struct thread *t);
 
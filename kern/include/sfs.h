@@ -53,14 +53,29 @@ struct sfs_vnode {
 	struct sfs_inode sv_i;		/* on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	uint32_t sv_ranext;             /* block where last read ended */
+	uint32_t sv_raend;              /* first block not read ahead */
+	unsigned sv_rawindow;           /* blocks to read ahead */
+	uint32_t sv_nextfileblock;      /* block after last one allocated */
+	uint32_t sv_pastart;            /* first block reserved for us */
+	unsigned sv_pacount;            /* number of blocks reserved */
+	struct sfs_vnode *sv_hashnext;  /* chain in sfs_vnhash */
+	unsigned sv_index;              /* our slot in sfs_vnodes */
+	struct sfs_dirindex *sv_dirindex; /* directory name index or NULL */
 };
 
+struct sfs_dirindex;	/* Opaque; private to sfs_vnode.c */
+
+/* Buckets in the table of loaded vnodes; prime. */
+#define SFS_VNHASHSIZE 127
+
 struct sfs_fs {
 	struct fs sfs_absfs;            /* abstract filesystem structure */
 	struct sfs_super sfs_super;	/* on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
 	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct sfs_vnode *sfs_vnhash[SFS_VNHASHSIZE]; /* same, by inode */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
 };
@@ -75,15 +90,14 @@ int sfs_mount(const char *device);
  * Internal functions
  */
 
-/* Initialize uio structure */
-#define SFSUIO(iov, uio, ptr, block, rw) \
-    uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
-
-/* Convenience functions for block I/O */
-int sfs_rwblock(struct sfs_fs *sfs, struct uio *uio);
+/* Convenience functions for block I/O, through the buffer cache */
 int sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block);
 int sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block);
 
+/* Put an inode or the free block map into the buffer cache, if changed */
+int sfs_sync_inode(struct sfs_vnode *sv);
+int sfs_sync_freemap(struct sfs_fs *sfs);
+
 /* Get root vnode */
 struct vnode *sfs_getroot(struct fs *fs);
 
@@ -45,6 +45,23 @@
 /* Get the machine-dependent bits. */
 #include <machine/spinlock.h>
 
+/*
+ * Queue node for waiting on a spinlock.
+ *
+ * Spinlocks are MCS-style queued locks: each waiting CPU links a
+ * node onto the end of the lock's queue and then spins on its own
+ * node's sq_waiting flag, so waiters don't all hammer the same cache
+ * line and the lock is handed out in FIFO order. Each cpu has
+ * SPINLOCK_MAXNEST nodes (in struct cpu), one per spinlock it can
+ * hold or wait for at once.
+ */
+struct spinlock_qnode {
+	struct spinlock_qnode *volatile sq_next; /* Next waiter in queue */
+	volatile bool sq_waiting;	/* True until the lock is handed over */
+};
+
+#define SPINLOCK_MAXNEST	8	/* Spinlocks one cpu can hold at once */
+
 /*
  * Basic spinlock.
  *
@@ -53,16 +70,30 @@
  * This structure is made public so spinlocks do not have to be
  * malloc'd; however, code that uses spinlocks should not look inside
  * the structure directly but always use the spinlock API functions.
+ *
+ * The statistics fields are updated only by the holder. Locks that
+ * have ever been contended are also put on a global list so that
+ * spinlock_printstats can find them; lk_site is the caller that first
+ * had to wait, to help identify the lock.
  */
 struct spinlock {
-	volatile spinlock_data_t lk_lock; /* The memory word where we spin. */
+	struct spinlock_qnode *volatile lk_tail; /* Last waiter, or NULL. */
+	struct spinlock_qnode *lk_node;	/* Queue node of the holder. */
 	struct cpu *lk_holder;		/* CPU holding this lock. */
+
+	/* Contention statistics */
+	unsigned lk_acquires;		/* Times acquired */
+	unsigned lk_contended;		/* Times we had to wait */
+	uint64_t lk_spincycles;		/* Total cycles spent waiting */
+	const void *lk_site;		/* First caller that waited */
+	struct spinlock *lk_statnext;	/* Link on contended-lock list */
+	struct spinlock **lk_statprev;	/* NULL if not on the list */
 };
 
 /*
  * Initializer for cases where a spinlock needs to be static or global.
  */
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#define SPINLOCK_INITIALIZER	{ NULL, NULL, NULL, 0, 0, 0, NULL, NULL, NULL }
 
 /*
  * Spinlock functions.
@@ -74,6 +105,9 @@ struct spinlock {
  * release	Release the lock. May re-enable interrupts.
  *
  * do_i_hold	Check if the current CPU holds the lock.
+ *
+ * printstats	Print the N contended spinlocks with the most cycles
+ *		spent waiting.
  */
 
 void spinlock_init(struct spinlock *lk);
@@ -84,5 +118,7 @@ void spinlock_release(struct spinlock *lk);
 
 bool spinlock_do_i_hold(struct spinlock *lk);
 
+void spinlock_printstats(unsigned n);
+
 
 #endif /* _SPINLOCK_H_ */
@@ -36,6 +36,7 @@
 
 
 #include <spinlock.h>
+#include "opt-lockprof.h"
 
 /*
  * Dijkstra-style semaphore.
@@ -63,6 +64,27 @@ void P(struct semaphore *);
 void V(struct semaphore *);
 
 
+#if OPT_LOCKPROF
+/*
+ * Per-lock contention statistics, kept when the kernel is built with
+ * "options lockprof". Times are in cycles (see cpu_cycles()); waits
+ * are from calling lock_acquire to getting the lock, holds are from
+ * getting it to lock_release. Updated only by the lock holder.
+ */
+struct lockprof {
+        unsigned lp_acquires;		/* # of acquisitions */
+        unsigned lp_contended;		/* # that had to sleep */
+        unsigned lp_cvwaits;		/* # of cv_waits using the lock */
+        uint64_t lp_waitcycles;		/* total wait */
+        uint32_t lp_maxwait;		/* longest wait */
+        uint64_t lp_holdcycles;		/* total hold */
+        uint32_t lp_maxhold;		/* longest hold */
+        uint32_t lp_acquiredat;		/* when the holder got it */
+        struct lock *lp_next;		/* link on list of all locks */
+        struct lock **lp_prev;
+};
+#endif
+
 /*
  * Simple lock for mutual exclusion.
  *
@@ -79,6 +101,9 @@ struct lock {
         struct spinlock spin_lock;
         struct thread *lk_holder;
         volatile int lock_count;
+#if OPT_LOCKPROF
+        struct lockprof lk_prof;
+#endif
         // add what you need here
         // (don't forget to mark things volatile as needed)
 };
@@ -101,6 +126,17 @@ void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
 void lock_destroy(struct lock *);
 
+#if OPT_LOCKPROF
+/*
+ * Lock statistics:
+ *    lockprof_printstats - print the N locks with the most total wait.
+ *    lockprof_reset      - zero all statistics, to start a new
+ *                          measurement window.
+ */
+void lockprof_printstats(unsigned n);
+void lockprof_reset(void);
+#endif
+
 
 /*
  * Condition variable.
@@ -143,5 +179,60 @@ void cv_wait(struct cv *cv, struct lock *lock);
 void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers may hold the lock at once, or one writer.
+ * Writers are preferred: once a writer is waiting, new readers wait
+ * behind it, so a steady stream of readers can't starve writers.
+ *
+ * The name field is for easier debugging. A copy of the name is made
+ * internally.
+ */
+struct rwlock {
+        char *rw_name;
+        struct wchan *rw_readwchan;	/* readers waiting */
+        struct wchan *rw_writewchan;	/* writers waiting */
+        struct wchan *rw_upgradewchan;	/* upgrader waiting */
+        struct spinlock rw_lock;	/* protects the fields below */
+        volatile unsigned rw_readers;	/* # of threads holding for read */
+        volatile unsigned rw_writerswaiting; /* # of writers waiting */
+        struct thread *rw_writer;	/* thread holding for write */
+        struct thread *rw_upgrader;	/* reader waiting to upgrade */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock for reading. Blocks while a
+ *                           writer holds the lock or is waiting for it.
+ *    rwlock_release_read  - Give up a read hold.
+ *    rwlock_acquire_write - Get the lock for writing (exclusively).
+ *    rwlock_release_write - Give up a write hold.
+ *    rwlock_upgrade       - Turn a read hold into a write hold, waiting
+ *                           for other readers to leave. Only one
+ *                           reader can be upgrading at a time; if
+ *                           another already is, returns false and the
+ *                           caller still holds the lock for reading.
+ *                           (It should then release and reacquire for
+ *                           writing, and recheck whatever it read.)
+ *    rwlock_downgrade     - Turn a write hold into a read hold without
+ *                           letting any writer in between.
+ *    rwlock_do_i_hold_write - Return true if the current thread holds
+ *                           the lock for writing.
+ *
+ * These operations are atomic. The lock is sleep-based, so none of
+ * them may be called from an interrupt handler.
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_upgrade(struct rwlock *);
+void rwlock_downgrade(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+
 
 #endif /* _SYNCH_H_ */
@@ -59,10 +59,31 @@ int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
 
 #ifdef UW
+int sys_open(userptr_t path, int flags, mode_t mode, int *retval);
+int sys_close(int fdesc);
+int sys_pipe(userptr_t fds);
+int sys_read(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval);
 int sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval);
+int sys_pread(int fdesc, userptr_t ubuf, unsigned int nbytes, off_t pos,
+              int *retval);
+int sys_pwrite(int fdesc, userptr_t ubuf, unsigned int nbytes, off_t pos,
+               int *retval);
+int sys_readv(int fdesc, userptr_t iov, int iovcnt, int *retval);
+int sys_writev(int fdesc, userptr_t iov, int iovcnt, int *retval);
+int sys_preadv(int fdesc, userptr_t iov, int iovcnt, off_t pos, int *retval);
+int sys_pwritev(int fdesc, userptr_t iov, int iovcnt, off_t pos, int *retval);
+int sys_copy_file_range(int infd, userptr_t inpos, int outfd,
+                        userptr_t outpos, size_t len, unsigned flags,
+                        int *retval);
+int sys_poll(userptr_t fds, unsigned nfds, int timeout, int *retval);
+int sys_lseek(int fdesc, off_t pos, int whence, off_t *retval);
+int sys_dup2(int oldfd, int newfd, int *retval);
 void sys__exit(int exitcode);
 int sys_getpid(pid_t *retval);
 int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *retval);
+int sys_fork(struct trapframe *tf, pid_t *retval);
+int sys_spawn(userptr_t path, userptr_t argv, pid_t *retval);
+int sys_execv(userptr_t path, userptr_t argv);
 
 #endif // UW
 
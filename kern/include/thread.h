@@ -83,6 +83,7 @@ struct thread {
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
+	bool t_pinned;			/* Never migrate to another CPU */
 
 	/*
 	 * Interrupt state fields.
@@ -144,11 +145,23 @@ int thread_fork(const char *name, struct proc *proc,
                 void (*func)(void *, unsigned long),
                 void *data1, unsigned long data2);
 
+/*
+ * Like thread_fork, but the new thread runs on cpu number CPUNUM
+ * (counting from 0 up to thread_numcpus()-1) and is never migrated.
+ * Used for per-cpu service threads.
+ */
+int thread_fork_oncpu(const char *name, struct proc *proc, unsigned cpunum,
+                      void (*func)(void *, unsigned long),
+                      void *data1, unsigned long data2);
+
+/* Return the number of cpus in the system. */
+unsigned thread_numcpus(void);
+
 /*
  * Cause the current thread to exit.
  * Interrupts need not be disabled.
  */
-void thread_exit(void);
+__DEAD void thread_exit(void);
 
 /*
  * Cause the current thread to yield to the next runnable thread, but
@@ -75,11 +75,18 @@ const char *vfs_getdevname(struct fs *fs);
  *    vfs_lookparent - Likewise, for VOP_LOOKPARENT.
  *
  * Both of these may destroy the path passed in.
+ *
+ *    vfs_namecache_purge - Forget cached vfs_lookup results for FS (all
+ *                     filesystems if NULL); only failed ones if NEGONLY.
+ *                     Call after changing a filesystem's names.
+ *    vfs_namecache_printstats - Print the cache's hit and miss counts.
  */
 
 int vfs_lookup(char *path, struct vnode **result);
 int vfs_lookparent(char *path, struct vnode **result,
 		   char *buf, size_t buflen);
+void vfs_namecache_purge(struct fs *fs, bool negonly);
+void vfs_namecache_printstats(void);
 
 /*
  * VFS layer high-level operations on pathnames
@@ -55,6 +55,18 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 vaddr_t alloc_kpages(int npages);
 void free_kpages(vaddr_t addr);
 
+/*
+ * For caches that hold on to kernel memory and should let it go when
+ * memory runs short:
+ *    vm_freepages        - about how many pages alloc_kpages could
+ *                          still hand out.
+ *    vm_kpages_reusable  - whether free_kpages makes pages available
+ *                          again. If not, freeing a cached page only
+ *                          loses it.
+ */
+unsigned long vm_freepages(void);
+bool vm_kpages_reusable(void);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
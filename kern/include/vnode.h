@@ -33,6 +33,7 @@
 
 struct uio;
 struct stat;
+struct pollentry;
 
 /*
  * A struct vnode is an abstract representation of a file.
@@ -147,6 +148,13 @@ struct vnode {
  *                      uio. Need not work on objects that are not
  *                      directories.
  *
+ *    vop_poll        - Set REVENTS to those poll events in EVENTS (see
+ *                      kern/poll.h) that hold now, plus POLLERR or
+ *                      POLLHUP if they apply. If PE is not NULL, first
+ *                      put PE on the wait queue that will be woken
+ *                      when that might change (see poll.h); objects
+ *                      that are always ready can ignore PE.
+ *
  *****************************************
  *
  *    vop_creat       - Create a regular file named NAME in the passed
@@ -212,6 +220,8 @@ struct vnode_ops {
 	int (*vop_mmap)(struct vnode *file /* add stuff */);
 	int (*vop_truncate)(struct vnode *file, off_t len);
 	int (*vop_namefile)(struct vnode *file, struct uio *uio);
+	int (*vop_poll)(struct vnode *object, int events,
+			struct pollentry *pe, int *revents);
 
 
 	int (*vop_creat)(struct vnode *dir, 
@@ -257,6 +267,7 @@ struct vnode_ops {
 #define VOP_MMAP(vn /*add stuff */)     (__VOP(vn, mmap)(vn /*add stuff */))
 #define VOP_TRUNCATE(vn, pos)           (__VOP(vn, truncate)(vn, pos))
 #define VOP_NAMEFILE(vn, uio)           (__VOP(vn, namefile)(vn, uio))
+#define VOP_POLL(vn, ev, pe, rev)       (__VOP(vn, poll)(vn, ev, pe, rev))
 
 #define VOP_CREAT(vn,nm,excl,mode,res)  (__VOP(vn, creat)(vn,nm,excl,mode,res))
 #define VOP_SYMLINK(vn, name, content)  (__VOP(vn, symlink)(vn, name, content))
@@ -0,0 +1,80 @@
+#ifndef _WORKQUEUE_H_
+#define _WORKQUEUE_H_
+
+/*
+ * Kernel work queues: deferred work run by kernel worker threads.
+ *
+ * A workqueue has one worker thread per cpu, each with its own queue.
+ * Work added on a cpu is run by that cpu's worker, so interrupt
+ * handlers (and other code that can't or shouldn't sleep) can hand
+ * off the bulk of their work and return quickly.
+ *
+ * The caller supplies the storage for each work item (struct work),
+ * usually embedded in some other structure, so adding work never
+ * allocates memory and is safe in an interrupt handler. A work item
+ * can be on only one queue at a time; adding it again while it is
+ * still pending does nothing. Once it starts running it is no longer
+ * pending and may be added again, even by its own function.
+ *
+ * Each per-cpu queue holds at most the depth given to
+ * workqueue_create (delayed items included); when it is full,
+ * workqueue_add fails with EAGAIN rather than blocking.
+ */
+
+struct workqueue;	/* Opaque */
+
+/*
+ * A unit of work. Set it up with work_init; the rest of the fields
+ * are private to the workqueue code.
+ */
+struct work {
+	void (*wk_func)(void *data1, unsigned long data2);
+	void *wk_data1;
+	unsigned long wk_data2;
+
+	void *volatile wk_owner;	/* per-cpu queue, or NULL if idle */
+	struct work *wk_next;		/* link on queue */
+	unsigned wk_due;		/* hardclock to run at, if delayed */
+};
+
+/*
+ * Functions:
+ *
+ * work_init           - Set up a work item to call FUNC(DATA1, DATA2).
+ * workqueue_create    - Create a workqueue, starting its worker threads.
+ *                       Must be called after the secondary cpus are
+ *                       running. MAXDEPTH bounds each per-cpu queue.
+ * workqueue_destroy   - Stop the worker threads, after they run any
+ *                       work still queued. There must be no delayed
+ *                       work left.
+ * workqueue_add       - Queue work to run as soon as possible on the
+ *                       current cpu's worker. Returns 0 (also if the
+ *                       work was already pending) or EAGAIN if the
+ *                       queue is full.
+ * workqueue_add_delayed - Like workqueue_add, but the work isn't run
+ *                       until TICKS hardclocks (HZ per second) from
+ *                       now.
+ * workqueue_cancel    - Take work that is still pending off its queue.
+ *                       Returns true if it was pending and now won't
+ *                       run; false if it wasn't pending or has
+ *                       already been taken by its worker (and may be
+ *                       running now).
+ * workqueue_hardclock - Called from hardclock() to start delayed work
+ *                       whose time has come.
+ */
+void work_init(struct work *wk,
+               void (*func)(void *data1, unsigned long data2),
+               void *data1, unsigned long data2);
+
+struct workqueue *workqueue_create(const char *name, unsigned maxdepth);
+void workqueue_destroy(struct workqueue *wq);
+
+int workqueue_add(struct workqueue *wq, struct work *wk);
+int workqueue_add_delayed(struct workqueue *wq, struct work *wk,
+                          unsigned ticks);
+bool workqueue_cancel(struct workqueue *wq, struct work *wk);
+
+void workqueue_hardclock(void);
+
+
+#endif /* _WORKQUEUE_H_ */
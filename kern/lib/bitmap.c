@@ -47,9 +47,33 @@
 #define WORD_TYPE       unsigned char
 #define WORD_ALLBITS    (0xff)
 
+/*
+ * For searching, though, the words are taken a chunk of four at a
+ * time: whether all 32 bits are set doesn't depend on byte order.
+ * The data is padded with set bits to a whole number of chunks.
+ *
+ * Each chunk has a bit in the summary map, "full", which is set when
+ * every bit in the chunk is known to be set; bitmap_alloc skips those
+ * chunks 32 at a time. A summary bit is only a hint in one direction:
+ * if it's set the chunk is full, but if it's clear the chunk may be
+ * full too, and gets marked when a search finds it so. That way bits
+ * set behind our back through bitmap_getdata (as sfs does when it
+ * reads the free map in) can't make us miss a free bit. Clearing bits
+ * that way is not allowed once allocation has begun.
+ *
+ * Searching starts from a rotor, the chunk where the last bit was
+ * allocated, rather than from the beginning, so that a map that is
+ * full at the front doesn't have to be passed over every time.
+ */
+#define WORDS_PER_CHUNK 4
+#define BITS_PER_CHUNK  (WORDS_PER_CHUNK * BITS_PER_WORD)
+
 struct bitmap {
         unsigned nbits;
         WORD_TYPE *v;
+        unsigned nchunks;
+        uint32_t *full;         /* one bit per chunk; set if chunk full */
+        unsigned rotor;         /* chunk to start searching at */
 };
 
 
@@ -57,21 +81,34 @@ struct bitmap *
 bitmap_create(unsigned nbits)
 {
         struct bitmap *b; 
-        unsigned words;
+        unsigned words, nchunks, i;
 
         words = DIVROUNDUP(nbits, BITS_PER_WORD);
+        nchunks = DIVROUNDUP(nbits, BITS_PER_CHUNK);
         b = kmalloc(sizeof(struct bitmap));
         if (b == NULL) {
                 return NULL;
         }
-        b->v = kmalloc(words*sizeof(WORD_TYPE));
+        b->v = kmalloc(nchunks*WORDS_PER_CHUNK*sizeof(WORD_TYPE));
         if (b->v == NULL) {
                 kfree(b);
                 return NULL;
         }
+        b->full = kmalloc(DIVROUNDUP(nchunks, 32)*sizeof(uint32_t));
+        if (b->full == NULL) {
+                kfree(b->v);
+                kfree(b);
+                return NULL;
+        }
 
         bzero(b->v, words*sizeof(WORD_TYPE));
+        for (i=words; i<nchunks*WORDS_PER_CHUNK; i++) {
+                b->v[i] = WORD_ALLBITS;
+        }
+        bzero(b->full, DIVROUNDUP(nchunks, 32)*sizeof(uint32_t));
         b->nbits = nbits;
+        b->nchunks = nchunks;
+        b->rotor = 0;
 
         /* Mark any leftover bits at the end in use */
         if (words > nbits / BITS_PER_WORD) {
@@ -95,29 +132,180 @@ bitmap_getdata(struct bitmap *b)
         return b->v;
 }
 
+/*
+ * Number of trailing zero bits in X, which must not be 0. (There's no
+ * instruction for this on mips1, and no libgcc to call.)
+ */
+static
+inline
+unsigned
+bitmap_ctz(uint32_t x)
+{
+        unsigned n = 0;
+
+        KASSERT(x != 0);
+        if ((x & 0xffff) == 0) {
+                n += 16;
+                x >>= 16;
+        }
+        if ((x & 0xff) == 0) {
+                n += 8;
+                x >>= 8;
+        }
+        if ((x & 0xf) == 0) {
+                n += 4;
+                x >>= 4;
+        }
+        if ((x & 0x3) == 0) {
+                n += 2;
+                x >>= 2;
+        }
+        if ((x & 0x1) == 0) {
+                n += 1;
+        }
+        return n;
+}
+
+static
+inline
+bool
+bitmap_chunkfull(struct bitmap *b, unsigned chunk)
+{
+        WORD_TYPE *w = &b->v[chunk*WORDS_PER_CHUNK];
+
+        return (w[0] & w[1] & w[2] & w[3]) == WORD_ALLBITS;
+}
+
+static
+inline
+void
+bitmap_setfull(struct bitmap *b, unsigned chunk, bool full)
+{
+        uint32_t mask = (uint32_t)1 << (chunk % 32);
+
+        if (full) {
+                b->full[chunk / 32] |= mask;
+        }
+        else {
+                b->full[chunk / 32] &= ~mask;
+        }
+}
+
+/*
+ * Find a clear bit in a chunk that has one, set it, and return its
+ * index.
+ */
+static
+unsigned
+bitmap_allocinchunk(struct bitmap *b, unsigned chunk)
+{
+        unsigned ix, offset;
+
+        for (ix = chunk*WORDS_PER_CHUNK; b->v[ix] == WORD_ALLBITS; ix++) {
+                KASSERT(ix + 1 < (chunk+1)*WORDS_PER_CHUNK);
+        }
+        offset = bitmap_ctz((WORD_TYPE)~b->v[ix]);
+        b->v[ix] |= ((WORD_TYPE)1) << offset;
+        if (bitmap_chunkfull(b, chunk)) {
+                bitmap_setfull(b, chunk, true);
+        }
+        return ix*BITS_PER_WORD + offset;
+}
+
+/*
+ * Find the first chunk at or after START, and before LIMIT, that has
+ * a clear bit. Returns LIMIT if there isn't one.
+ */
+static
+unsigned
+bitmap_findchunk(struct bitmap *b, unsigned start, unsigned limit)
+{
+        unsigned chunk, i;
+        uint32_t notfull;
+
+        chunk = start;
+        while (chunk < limit) {
+                /* Skip chunks known to be full, a summary word at a time. */
+                i = chunk / 32;
+                notfull = ~b->full[i] & ~(((uint32_t)1 << (chunk % 32)) - 1);
+                if (notfull == 0) {
+                        chunk = (i+1) * 32;
+                        continue;
+                }
+                chunk = i*32 + bitmap_ctz(notfull);
+                if (chunk >= limit) {
+                        break;
+                }
+                if (!bitmap_chunkfull(b, chunk)) {
+                        return chunk;
+                }
+                /* Filled in behind our back; remember that. */
+                bitmap_setfull(b, chunk, true);
+                chunk++;
+        }
+        return limit;
+}
+
 int
 bitmap_alloc(struct bitmap *b, unsigned *index)
 {
-        unsigned ix;
-        unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
-        unsigned offset;
+        unsigned chunk;
+
+        /* Next fit: look from the rotor to the end, then wrap around. */
+        chunk = bitmap_findchunk(b, b->rotor, b->nchunks);
+        if (chunk == b->nchunks) {
+                chunk = bitmap_findchunk(b, 0, b->rotor);
+                if (chunk == b->rotor) {
+                        return ENOSPC;
+                }
+        }
+
+        b->rotor = chunk;
+        *index = bitmap_allocinchunk(b, chunk);
+        KASSERT(*index < b->nbits);
+        return 0;
+}
+
+int
+bitmap_alloc_near(struct bitmap *b, unsigned hint, unsigned *index)
+{
+        unsigned ix, chunk, offset;
+        WORD_TYPE clear;
 
-        for (ix=0; ix<maxix; ix++) {
-                if (b->v[ix]!=WORD_ALLBITS) {
-                        for (offset = 0; offset < BITS_PER_WORD; offset++) {
-                                WORD_TYPE mask = ((WORD_TYPE)1) << offset;
-
-                                if ((b->v[ix] & mask)==0) {
-                                        b->v[ix] |= mask;
-                                        *index = (ix*BITS_PER_WORD)+offset;
-                                        KASSERT(*index < b->nbits);
-                                        return 0;
-                                }
-                        }
-                        KASSERT(0);
+        if (hint >= b->nbits) {
+                return bitmap_alloc(b, index);
+        }
+
+        /* Look at HINT and the rest of its chunk first. */
+        chunk = hint / BITS_PER_CHUNK;
+        ix = hint / BITS_PER_WORD;
+        clear = ~b->v[ix] & ~(((WORD_TYPE)1 << (hint % BITS_PER_WORD)) - 1);
+        while (clear == 0 && ix + 1 < (chunk+1)*WORDS_PER_CHUNK) {
+                ix++;
+                clear = ~b->v[ix];
+        }
+        if (clear != 0) {
+                offset = bitmap_ctz(clear);
+                b->v[ix] |= ((WORD_TYPE)1) << offset;
+                if (bitmap_chunkfull(b, chunk)) {
+                        bitmap_setfull(b, chunk, true);
                 }
+                *index = ix*BITS_PER_WORD + offset;
+                KASSERT(*index < b->nbits);
+                return 0;
         }
-        return ENOSPC;
+
+        /* Then onward from there, wrapping around. The rotor stays put. */
+        chunk = bitmap_findchunk(b, chunk+1, b->nchunks);
+        if (chunk == b->nchunks) {
+                chunk = bitmap_findchunk(b, 0, hint / BITS_PER_CHUNK + 1);
+                if (chunk == hint / BITS_PER_CHUNK + 1) {
+                        return ENOSPC;
+                }
+        }
+        *index = bitmap_allocinchunk(b, chunk);
+        KASSERT(*index < b->nbits);
+        return 0;
 }
 
 static
@@ -142,6 +330,9 @@ bitmap_mark(struct bitmap *b, unsigned index)
 
         KASSERT((b->v[ix] & mask)==0);
         b->v[ix] |= mask;
+        if (bitmap_chunkfull(b, ix / WORDS_PER_CHUNK)) {
+                bitmap_setfull(b, ix / WORDS_PER_CHUNK, true);
+        }
 }
 
 void
@@ -155,6 +346,7 @@ bitmap_unmark(struct bitmap *b, unsigned index)
 
         KASSERT((b->v[ix] & mask)!=0);
         b->v[ix] &= ~mask;
+        bitmap_setfull(b, ix / WORDS_PER_CHUNK, false);
 }
 
 
@@ -171,6 +363,7 @@ bitmap_isset(struct bitmap *b, unsigned index)
 void
 bitmap_destroy(struct bitmap *b)
 {
+        kfree(b->full);
         kfree(b->v);
         kfree(b);
 }
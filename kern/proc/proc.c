@@ -43,12 +43,16 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
+#include <kern/wait.h>
+#include <limits.h>
 #include <proc.h>
 #include <current.h>
 #include <addrspace.h>
 #include <vnode.h>
 #include <vfs.h>
 #include <synch.h>
+#include <file.h>
 #include <kern/fcntl.h>  
 
 /*
@@ -69,7 +73,164 @@ static struct semaphore *proc_count_mutex;
 struct semaphore *no_proc_sem;   
 #endif  // UW
 
+/*
+ * The process table.
+ *
+ * There are PROC_MAX slots, and the process with pid P is in slot
+ * P % PROC_MAX, so finding a process is one array index. Free slots
+ * are kept in a FIFO, so allocating a pid takes a slot off the front
+ * and freeing one puts it on the back; each slot remembers the next
+ * pid it will hand out, which goes up by PROC_MAX each time. Between
+ * the two a pid is not reused until a good while after it's freed.
+ *
+ * proctable_lock protects the table and also the process-table
+ * fields of every struct proc (p_parent, p_children, p_exited, and
+ * so on). A process waiting for its children sleeps on its own
+ * p_waitcv, so an exiting process wakes only its own parent.
+ */
+#define PROC_MAX 128
+
+static struct lock *proctable_lock;
+static struct proc *proctable[PROC_MAX];
+static pid_t proctable_nextpid[PROC_MAX];
+static unsigned proctable_free[PROC_MAX];	/* FIFO of free slots */
+static unsigned proctable_freehead;
+static unsigned proctable_numfree;
+
+/*
+ * Set up the process table.
+ */
+static
+void
+proctable_bootstrap(void)
+{
+	unsigned i;
+
+	proctable_lock = lock_create("proctable");
+	if (proctable_lock == NULL) {
+		panic("could not create the process table lock\n");
+	}
+	for (i=0; i<PROC_MAX; i++) {
+		proctable[i] = NULL;
+		proctable_nextpid[i] = i < PID_MIN ? i + PROC_MAX : i;
+		proctable_free[i] = i;
+	}
+	proctable_freehead = 0;
+	proctable_numfree = PROC_MAX;
+}
+
+/*
+ * Give PROC a pid and enter it in the table.
+ */
+static
+int
+proctable_add(struct proc *proc)
+{
+	unsigned slot;
+	pid_t pid;
+
+	lock_acquire(proctable_lock);
+	if (proctable_numfree == 0) {
+		lock_release(proctable_lock);
+		return ENPROC;
+	}
+	slot = proctable_free[proctable_freehead];
+	proctable_freehead = (proctable_freehead + 1) % PROC_MAX;
+	proctable_numfree--;
+
+	pid = proctable_nextpid[slot];
+	KASSERT((unsigned)pid % PROC_MAX == slot);
+	proctable_nextpid[slot] = pid + PROC_MAX;
+	if (proctable_nextpid[slot] > PID_MAX) {
+		proctable_nextpid[slot] = slot < PID_MIN ? slot + PROC_MAX : slot;
+	}
+
+	KASSERT(proctable[slot] == NULL);
+	proctable[slot] = proc;
+	proc->p_pid = pid;
+	lock_release(proctable_lock);
+	return 0;
+}
+
+/*
+ * Take PROC out of the table and free its pid.
+ * Call with proctable_lock held.
+ */
+static
+void
+proctable_remove(struct proc *proc)
+{
+	unsigned slot;
+
+	KASSERT(lock_do_i_hold(proctable_lock));
+
+	slot = proc->p_pid % PROC_MAX;
+	KASSERT(proctable[slot] == proc);
+	proctable[slot] = NULL;
+	proctable_free[(proctable_freehead + proctable_numfree) % PROC_MAX] =
+		slot;
+	proctable_numfree++;
+	proc->p_pid = 0;
+}
+
+/*
+ * Find the process with pid PID, or return NULL.
+ * Call with proctable_lock held.
+ */
+static
+struct proc *
+proctable_lookup(pid_t pid)
+{
+	struct proc *proc;
 
+	KASSERT(lock_do_i_hold(proctable_lock));
+
+	if (pid < PID_MIN || pid > PID_MAX) {
+		return NULL;
+	}
+	proc = proctable[pid % PROC_MAX];
+	if (proc == NULL || proc->p_pid != pid) {
+		return NULL;
+	}
+	return proc;
+}
+
+/*
+ * Take CHILD off its parent's list of children.
+ * Call with proctable_lock held.
+ */
+static
+void
+proc_unlinkchild(struct proc *child)
+{
+	struct proc **pp;
+
+	KASSERT(lock_do_i_hold(proctable_lock));
+	KASSERT(child->p_parent != NULL);
+
+	for (pp = &child->p_parent->p_children; *pp != child;
+	     pp = &(*pp)->p_sibling) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = child->p_sibling;
+	child->p_sibling = NULL;
+	child->p_parent = NULL;
+}
+
+/*
+ * Free a proc structure that has nothing else left in it.
+ */
+static
+void
+proc_free(struct proc *proc)
+{
+	cv_destroy(proc->p_waitcv);
+	threadarray_cleanup(&proc->p_threads);
+	spinlock_cleanup(&proc->p_lock);
+
+	kfree(proc->p_name);
+	kfree(proc);
+}
 
 /*
  * Create a proc structure.
@@ -89,6 +250,12 @@ proc_create(const char *name)
 		kfree(proc);
 		return NULL;
 	}
+	proc->p_waitcv = cv_create(name);
+	if (proc->p_waitcv == NULL) {
+		kfree(proc->p_name);
+		kfree(proc);
+		return NULL;
+	}
 
 	threadarray_init(&proc->p_threads);
 	spinlock_init(&proc->p_lock);
@@ -99,9 +266,16 @@ proc_create(const char *name)
 	/* VFS fields */
 	proc->p_cwd = NULL;
 
-#ifdef UW
-	proc->console = NULL;
-#endif // UW
+	/* Open files */
+	proc->p_filetable = NULL;
+
+	/* Process table fields */
+	proc->p_pid = 0;
+	proc->p_parent = NULL;
+	proc->p_children = NULL;
+	proc->p_sibling = NULL;
+	proc->p_exited = false;
+	proc->p_exitstatus = 0;
 
 	return proc;
 }
@@ -124,6 +298,21 @@ proc_destroy(struct proc *proc)
 	KASSERT(proc != NULL);
 	KASSERT(proc != kproc);
 
+	/*
+	 * Take it out of the process table, and away from its
+	 * parent if it still has one. Any children should have been
+	 * orphaned by proc_exit; a process that never ran has none.
+	 */
+	if (proc->p_pid != 0) {
+		lock_acquire(proctable_lock);
+		KASSERT(proc->p_children == NULL);
+		if (proc->p_parent != NULL) {
+			proc_unlinkchild(proc);
+		}
+		proctable_remove(proc);
+		lock_release(proctable_lock);
+	}
+
 	/*
 	 * We don't take p_lock in here because we must have the only
 	 * reference to this structure. (Otherwise it would be
@@ -157,17 +346,12 @@ proc_destroy(struct proc *proc)
 	}
 #endif // UW
 
-#ifdef UW
-	if (proc->console) {
-	  vfs_close(proc->console);
+	if (proc->p_filetable) {
+		filetable_destroy(proc->p_filetable);
+		proc->p_filetable = NULL;
 	}
-#endif // UW
 
-	threadarray_cleanup(&proc->p_threads);
-	spinlock_cleanup(&proc->p_lock);
-
-	kfree(proc->p_name);
-	kfree(proc);
+	proc_free(proc);
 
 #ifdef UW
 	/* decrement the process count */
@@ -197,6 +381,7 @@ proc_bootstrap(void)
   if (kproc == NULL) {
     panic("proc_create for kproc failed\n");
   }
+  proctable_bootstrap();
 #ifdef UW
   proc_count = 0;
   proc_count_mutex = sem_create("proc_count_mutex",1);
@@ -210,35 +395,54 @@ proc_bootstrap(void)
 #endif // UW 
 }
 
+/*
+ * Open the console on stdin, stdout, and stderr in FT.
+ */
+static
+void
+proc_openconsole(struct filetable *ft)
+{
+	static const int flags[3] = { O_RDONLY, O_WRONLY, O_WRONLY };
+	struct openfile *of;
+	char console_path[5];
+	int fd, i;
+
+	for (i=0; i<3; i++) {
+		/* open the console - this should always succeed */
+		strcpy(console_path, "con:");
+		if (openfile_open(console_path, flags[i], 0, &of)) {
+			panic("unable to open the console during process creation\n");
+		}
+		if (filetable_place(ft, of, &fd)) {
+			panic("no room for the console in a new file table\n");
+		}
+		KASSERT(fd == i);
+	}
+}
+
 /*
  * Create a fresh proc for use by runprogram.
  *
  * It will have no address space and will inherit the current
- * process's (that is, the kernel menu's) current directory.
+ * process's current directory. It also inherits the current
+ * process's open files; if that's the kernel (that is, the kernel
+ * menu), which has none, it gets the console on stdin, stdout, and
+ * stderr instead.
  */
 struct proc *
 proc_create_runprogram(const char *name)
 {
 	struct proc *proc;
-	char *console_path;
 
 	proc = proc_create(name);
 	if (proc == NULL) {
 		return NULL;
 	}
-
-#ifdef UW
-	/* open the console - this should always succeed */
-	console_path = kstrdup("con:");
-	if (console_path == NULL) {
-	  panic("unable to copy console path name during process creation\n");
-	}
-	if (vfs_open(console_path,O_WRONLY,0,&(proc->console))) {
-	  panic("unable to open the console during process creation\n");
+	if (proctable_add(proc)) {
+		proc_free(proc);
+		return NULL;
 	}
-	kfree(console_path);
-#endif // UW
-	  
+
 	/* VM fields */
 
 	proc->p_addrspace = NULL;
@@ -271,9 +475,181 @@ proc_create_runprogram(const char *name)
 	V(proc_count_mutex);
 #endif // UW
 
+	/* Open files */
+	if (curproc->p_filetable != NULL) {
+		/* fork or spawn: share the parent's open files */
+		if (filetable_copy(curproc->p_filetable, &proc->p_filetable)) {
+			proc_destroy(proc);
+			return NULL;
+		}
+	}
+	else {
+		/* from the menu: start with the console */
+		proc->p_filetable = filetable_create();
+		if (proc->p_filetable == NULL) {
+			proc_destroy(proc);
+			return NULL;
+		}
+		proc_openconsole(proc->p_filetable);
+	}
+
 	return proc;
 }
 
+/*
+ * Make CHILD a child of PARENT.
+ */
+void
+proc_addchild(struct proc *parent, struct proc *child)
+{
+	lock_acquire(proctable_lock);
+	KASSERT(child->p_parent == NULL);
+	KASSERT(!parent->p_exited);
+	child->p_parent = parent;
+	child->p_sibling = parent->p_children;
+	parent->p_children = child;
+	lock_release(proctable_lock);
+}
+
+/*
+ * Exit PROC with wait status STATUS.
+ *
+ * Children that have already exited are reaped on the spot and the
+ * rest are orphaned; an orphan is reaped as soon as it exits. PROC
+ * itself is reaped here if it has no parent, and otherwise left for
+ * its parent's waitpid, with only its table entry and exit status
+ * still in use.
+ */
+void
+proc_exit(struct proc *proc, int status)
+{
+	struct proc *child, *next, *reap;
+
+	KASSERT(proc != kproc);
+	KASSERT(threadarray_num(&proc->p_threads) == 0);
+
+	/* Nobody else can use these any more; let them go now. */
+	if (proc->p_cwd) {
+		VOP_DECREF(proc->p_cwd);
+		proc->p_cwd = NULL;
+	}
+	if (proc->p_filetable) {
+		filetable_destroy(proc->p_filetable);
+		proc->p_filetable = NULL;
+	}
+
+	reap = NULL;
+
+	lock_acquire(proctable_lock);
+	for (child = proc->p_children; child != NULL; child = next) {
+		next = child->p_sibling;
+		child->p_parent = NULL;
+		child->p_sibling = NULL;
+		if (child->p_exited) {
+			child->p_sibling = reap;
+			reap = child;
+		}
+	}
+	proc->p_children = NULL;
+
+	proc->p_exitstatus = status;
+	proc->p_exited = true;
+	if (proc->p_parent == NULL) {
+		proc->p_sibling = reap;
+		reap = proc;
+	}
+	else {
+		cv_broadcast(proc->p_parent->p_waitcv, proctable_lock);
+	}
+	lock_release(proctable_lock);
+
+	for (; reap != NULL; reap = next) {
+		next = reap->p_sibling;
+		reap->p_sibling = NULL;
+		proc_destroy(reap);
+	}
+}
+
+/*
+ * Find a child of PARENT that has exited, or return NULL.
+ * Call with proctable_lock held.
+ */
+static
+struct proc *
+proc_findexited(struct proc *parent)
+{
+	struct proc *child;
+
+	KASSERT(lock_do_i_hold(proctable_lock));
+
+	for (child = parent->p_children; child != NULL;
+	     child = child->p_sibling) {
+		if (child->p_exited) {
+			return child;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Wait for child PID of the current process to exit, then reap it.
+ * PID may be WAIT_ANY to take whichever child exits first. With
+ * WNOHANG, if there's no exited child to take, return 0 in RET
+ * instead of waiting.
+ */
+int
+proc_wait(pid_t pid, int options, int *status, pid_t *ret)
+{
+	struct proc *child;
+
+	if ((options & ~WNOHANG) != 0) {
+		return EINVAL;
+	}
+
+	lock_acquire(proctable_lock);
+	if (pid == WAIT_ANY) {
+		if (curproc->p_children == NULL) {
+			lock_release(proctable_lock);
+			return ECHILD;
+		}
+		while ((child = proc_findexited(curproc)) == NULL) {
+			if (options & WNOHANG) {
+				lock_release(proctable_lock);
+				*ret = 0;
+				return 0;
+			}
+			cv_wait(curproc->p_waitcv, proctable_lock);
+		}
+	}
+	else {
+		child = proctable_lookup(pid);
+		if (child == NULL) {
+			lock_release(proctable_lock);
+			return ESRCH;
+		}
+		if (child->p_parent != curproc) {
+			lock_release(proctable_lock);
+			return ECHILD;
+		}
+		while (!child->p_exited) {
+			if (options & WNOHANG) {
+				lock_release(proctable_lock);
+				*ret = 0;
+				return 0;
+			}
+			cv_wait(curproc->p_waitcv, proctable_lock);
+		}
+	}
+	*status = child->p_exitstatus;
+	*ret = child->p_pid;
+	lock_release(proctable_lock);
+
+	/* Only we can reap it, so it's still ours. */
+	proc_destroy(child);
+
+	return 0;
+}
+
 /*
  * Add a thread to a process. Either the thread or the process might
  * or might not be current.
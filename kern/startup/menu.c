@@ -38,6 +38,7 @@
 #include <thread.h>
 #include <proc.h>
 #include <synch.h>
+#include <device.h>
 #include <vfs.h>
 #include <sfs.h>
 #include <syscall.h>
@@ -45,6 +46,7 @@
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-lockprof.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -396,6 +398,120 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+/*
+ * Command for listing the most contended spinlocks.
+ * Usage: sl [count]
+ */
+static
+int
+cmd_spinlockstats(int nargs, char **args)
+{
+	int n;
+
+	if (nargs > 2) {
+		kprintf("Usage: sl [count]\n");
+		return EINVAL;
+	}
+
+	n = (nargs == 2) ? atoi(args[1]) : 10;
+	if (n <= 0) {
+		kprintf("Usage: sl [count]\n");
+		return EINVAL;
+	}
+
+	spinlock_printstats(n);
+
+	return 0;
+}
+
+/*
+ * Command for disk scheduling statistics.
+ * Usage: ds [fifo | clook | reset]
+ * With an argument, switches the scheduling policy (and clears the
+ * statistics, to start a new comparison) or just clears them.
+ */
+static
+int
+cmd_diskstats(int nargs, char **args)
+{
+	if (dev_diskstats == NULL) {
+		kprintf("No disk keeps scheduling statistics\n");
+		return 0;
+	}
+	if (nargs == 1) {
+		dev_diskstats->ds_print(false);
+		return 0;
+	}
+	if (nargs == 2 && !strcmp(args[1], "fifo")) {
+		dev_diskstats->ds_setfifo(true);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "clook")) {
+		dev_diskstats->ds_setfifo(false);
+	}
+	else if (nargs != 2 || strcmp(args[1], "reset")) {
+		kprintf("Usage: ds [fifo | clook | reset]\n");
+		return EINVAL;
+	}
+	dev_diskstats->ds_print(true);
+	return 0;
+}
+
+/*
+ * Command for name cache statistics.
+ */
+static
+int
+cmd_namecachestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vfs_namecache_printstats();
+
+	return 0;
+}
+
+#if OPT_LOCKPROF
+/*
+ * Commands for lock contention statistics.
+ * Usage: lp [count]   (list locks with the most wait time)
+ *        lpr          (reset, to start a new measurement window)
+ */
+static
+int
+cmd_lockprof(int nargs, char **args)
+{
+	int n;
+
+	if (nargs > 2) {
+		kprintf("Usage: lp [count]\n");
+		return EINVAL;
+	}
+
+	n = (nargs == 2) ? atoi(args[1]) : 10;
+	if (n <= 0) {
+		kprintf("Usage: lp [count]\n");
+		return EINVAL;
+	}
+
+	lockprof_printstats(n);
+
+	return 0;
+}
+
+static
+int
+cmd_lockprofreset(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	lockprof_reset();
+
+	return 0;
+}
+#endif
+
 /*
  * Command to set dbflags true.
  *
@@ -482,6 +598,7 @@ static const char *testmenu[] = {
 	"[sy1] Semaphore test                ",
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
+	"[sy4] RW lock test          (1)     ",
 #ifdef UW
 	"[uw1] UW lock test          (1)     ",
 	"[uw2] UW vmstats test       (3)     ",
@@ -521,6 +638,13 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+	"[sl] Spinlock contention stats      ",
+	"[ds] Disk scheduling stats          ",
+	"[nc] Name cache stats               ",
+#if OPT_LOCKPROF
+	"[lp] Lock contention stats          ",
+	"[lpr] Reset lock contention stats   ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -578,6 +702,13 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "sl",		cmd_spinlockstats },
+	{ "ds",		cmd_diskstats },
+	{ "nc",		cmd_namecachestats },
+#if OPT_LOCKPROF
+	{ "lp",		cmd_lockprof },
+	{ "lpr",	cmd_lockprofreset },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -595,6 +726,7 @@ static struct {
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
+	{ "sy4",	rwlocktest },
 #ifdef UW
 	{ "uw1",	uwlocktest1 },
 	{ "uw2",	uwvmstatstest },
@@ -1,60 +1,636 @@
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/seek.h>
+#include <kern/stat.h>
 #include <kern/unistd.h>
+#include <limits.h>
 #include <lib.h>
 #include <uio.h>
 #include <syscall.h>
+#include <synch.h>
 #include <vnode.h>
 #include <vfs.h>
 #include <current.h>
 #include <proc.h>
+#include <copyinout.h>
+#include <file.h>
+#include <pipe.h>
 
-/* handler for write() system call                  */
 /*
- * n.b.
- * This implementation handles only writes to standard output 
- * and standard error, both of which go to the console.
- * Also, it does not provide any synchronization, so writes
- * are not atomic.
+ * Common code for read, write, and the vectored and positional
+ * variants: transfer LEN bytes between the open file FDESC and the
+ * user buffers in IOV, which has IOVCNT entries, all in one uio.
  *
- * You will need to improve this implementation
+ * Ordinary I/O uses and updates the openfile's seek position, under
+ * the openfile's lock so that the transfer and the update are atomic.
+ * Positional I/O (POSITIONAL true) is done at POS instead and leaves
+ * the seek position alone, so it doesn't need the lock.
+ */
+static
+int
+file_rw(int fdesc, struct iovec *iov, unsigned iovcnt, size_t len,
+	bool positional, off_t pos, enum uio_rw rw, int *retval)
+{
+  struct openfile *of;
+  struct uio u;
+  struct stat st;
+  int badmode;
+  int res;
+
+  res = filetable_get(curproc->p_filetable, fdesc, &of);
+  if (res) {
+    return res;
+  }
+  badmode = (rw == UIO_READ) ? O_WRONLY : O_RDONLY;
+  if ((of->of_flags & O_ACCMODE) == badmode) {
+    openfile_decref(of);
+    return EBADF;
+  }
+
+  if (positional) {
+    if (pos < 0) {
+      openfile_decref(of);
+      return EINVAL;
+    }
+    /* this rejects the console, and other devices, with ESPIPE */
+    res = VOP_TRYSEEK(of->of_vnode, pos);
+    if (res) {
+      openfile_decref(of);
+      return res;
+    }
+  }
+  else {
+    lock_acquire(of->of_lock);
+    if (rw == UIO_WRITE && (of->of_flags & O_APPEND)) {
+      res = VOP_STAT(of->of_vnode, &st);
+      if (res) {
+	lock_release(of->of_lock);
+	openfile_decref(of);
+	return res;
+      }
+      of->of_offset = st.st_size;
+    }
+    pos = of->of_offset;
+  }
+
+  /* set up a uio structure to refer to the user program's buffers */
+  u.uio_iov = iov;
+  u.uio_iovcnt = iovcnt;
+  u.uio_offset = pos;
+  u.uio_resid = len;
+  u.uio_segflg = UIO_USERSPACE;
+  u.uio_rw = rw;
+  u.uio_space = curproc_getas();
+
+  if (rw == UIO_READ) {
+    res = VOP_READ(of->of_vnode, &u);
+  }
+  else {
+    res = VOP_WRITE(of->of_vnode, &u);
+  }
+
+  if (!positional) {
+    if (res == 0) {
+      of->of_offset = u.uio_offset;
+    }
+    lock_release(of->of_lock);
+  }
+  openfile_decref(of);
+  if (res) {
+    return res;
+  }
+
+  /* pass back the number of bytes actually transferred */
+  *retval = len - u.uio_resid;
+  KASSERT(*retval >= 0);
+  return 0;
+}
+
+/*
+ * Common code for readv, writev, preadv, and pwritev: fetch the
+ * user's iovec array and do the whole transfer as one file_rw.
  */
+static
+int
+file_rwv(int fdesc, userptr_t uiov, int iovcnt,
+	 bool positional, off_t pos, enum uio_rw rw, int *retval)
+{
+  struct iovec *iov;
+  size_t len;
+  int i, res;
+
+  if (iovcnt <= 0 || iovcnt > IOV_MAX) {
+    return EINVAL;
+  }
+
+  /* the user's struct iovec is laid out the same as ours */
+  iov = kmalloc(iovcnt * sizeof(struct iovec));
+  if (iov == NULL) {
+    return ENOMEM;
+  }
+  res = copyin(uiov, iov, iovcnt * sizeof(struct iovec));
+  if (res) {
+    kfree(iov);
+    return res;
+  }
+
+  /* the total has to fit in the (int) return value */
+  len = 0;
+  for (i=0; i<iovcnt; i++) {
+    if (iov[i].iov_len > (size_t)0x7fffffff - len) {
+      kfree(iov);
+      return EINVAL;
+    }
+    len += iov[i].iov_len;
+  }
+
+  res = file_rw(fdesc, iov, iovcnt, len, positional, pos, rw, retval);
+  kfree(iov);
+  return res;
+}
+
+/* handler for open() system call                  */
+int
+sys_open(userptr_t upath, int flags, mode_t mode, int *retval)
+{
+  char *path;
+  struct openfile *of;
+  int result;
+
+  path = kmalloc(PATH_MAX);
+  if (path == NULL) {
+    return ENOMEM;
+  }
+  result = copyinstr(upath, path, PATH_MAX, NULL);
+  if (result) {
+    kfree(path);
+    return result;
+  }
+
+  result = openfile_open(path, flags, mode, &of);
+  kfree(path);
+  if (result) {
+    return result;
+  }
+
+  result = filetable_place(curproc->p_filetable, of, retval);
+  if (result) {
+    openfile_decref(of);
+    return result;
+  }
+  return 0;
+}
+
+/* handler for close() system call                  */
+int
+sys_close(int fdesc)
+{
+  struct openfile *of;
+  int result;
+
+  result = filetable_remove(curproc->p_filetable, fdesc, &of);
+  if (result) {
+    return result;
+  }
+  openfile_decref(of);
+  return 0;
+}
+
+/* handler for pipe() system call                  */
+int
+sys_pipe(userptr_t ufds)
+{
+  struct vnode *rvn, *wvn;
+  struct openfile *rof, *wof, *junk;
+  int fds[2];
+  int result;
+
+  result = pipe_create(&rvn, &wvn);
+  if (result) {
+    return result;
+  }
+  /* each end is open once, by its openfile */
+  VOP_INCOPEN(rvn);
+  VOP_INCOPEN(wvn);
+
+  result = openfile_create(rvn, O_RDONLY, &rof);
+  if (result) {
+    vfs_close(rvn);
+    vfs_close(wvn);
+    return result;
+  }
+  result = openfile_create(wvn, O_WRONLY, &wof);
+  if (result) {
+    openfile_decref(rof);
+    vfs_close(wvn);
+    return result;
+  }
+
+  result = filetable_place(curproc->p_filetable, rof, &fds[0]);
+  if (result) {
+    openfile_decref(rof);
+    openfile_decref(wof);
+    return result;
+  }
+  result = filetable_place(curproc->p_filetable, wof, &fds[1]);
+  if (result) {
+    filetable_remove(curproc->p_filetable, fds[0], &junk);
+    openfile_decref(rof);
+    openfile_decref(wof);
+    return result;
+  }
+
+  result = copyout(fds, ufds, sizeof(fds));
+  if (result) {
+    filetable_remove(curproc->p_filetable, fds[0], &junk);
+    filetable_remove(curproc->p_filetable, fds[1], &junk);
+    openfile_decref(rof);
+    openfile_decref(wof);
+    return result;
+  }
+  return 0;
+}
+
+/* handler for read() system call                  */
+int
+sys_read(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval)
+{
+  struct iovec iov;
+
+  DEBUG(DB_SYSCALL,"Syscall: read(%d,%x,%d)\n",fdesc,(unsigned int)ubuf,nbytes);
+
+  iov.iov_ubase = ubuf;
+  iov.iov_len = nbytes;
+  return file_rw(fdesc, &iov, 1, nbytes, false, 0, UIO_READ, retval);
+}
 
+/* handler for write() system call                  */
 int
 sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval)
 {
   struct iovec iov;
-  struct uio u;
-  int res;
 
   DEBUG(DB_SYSCALL,"Syscall: write(%d,%x,%d)\n",fdesc,(unsigned int)ubuf,nbytes);
-  
-  /* only stdout and stderr writes are currently implemented */
-  if (!((fdesc==STDOUT_FILENO)||(fdesc==STDERR_FILENO))) {
-    return EUNIMP;
-  }
-  KASSERT(curproc != NULL);
-  KASSERT(curproc->console != NULL);
-  KASSERT(curproc->p_addrspace != NULL);
 
-  /* set up a uio structure to refer to the user program's buffer (ubuf) */
   iov.iov_ubase = ubuf;
   iov.iov_len = nbytes;
-  u.uio_iov = &iov;
-  u.uio_iovcnt = 1;
-  u.uio_offset = 0;  /* not needed for the console */
-  u.uio_resid = nbytes;
-  u.uio_segflg = UIO_USERSPACE;
-  u.uio_rw = UIO_WRITE;
-  u.uio_space = curproc->p_addrspace;
+  return file_rw(fdesc, &iov, 1, nbytes, false, 0, UIO_WRITE, retval);
+}
+
+/*
+ * handlers for pread() and pwrite() system calls
+ *
+ * These never look at or change the seek position, so they don't
+ * take the openfile lock; any number of them can run on one open
+ * file at once, with only the file system's own locking between them.
+ */
+int
+sys_pread(int fdesc, userptr_t ubuf, unsigned int nbytes, off_t pos,
+	  int *retval)
+{
+  struct iovec iov;
+
+  iov.iov_ubase = ubuf;
+  iov.iov_len = nbytes;
+  return file_rw(fdesc, &iov, 1, nbytes, true, pos, UIO_READ, retval);
+}
+
+int
+sys_pwrite(int fdesc, userptr_t ubuf, unsigned int nbytes, off_t pos,
+	   int *retval)
+{
+  struct iovec iov;
 
-  res = VOP_WRITE(curproc->console,&u);
+  iov.iov_ubase = ubuf;
+  iov.iov_len = nbytes;
+  return file_rw(fdesc, &iov, 1, nbytes, true, pos, UIO_WRITE, retval);
+}
+
+/* handlers for readv(), writev(), preadv(), and pwritev() system calls */
+int
+sys_readv(int fdesc, userptr_t iov, int iovcnt, int *retval)
+{
+  return file_rwv(fdesc, iov, iovcnt, false, 0, UIO_READ, retval);
+}
+
+int
+sys_writev(int fdesc, userptr_t iov, int iovcnt, int *retval)
+{
+  return file_rwv(fdesc, iov, iovcnt, false, 0, UIO_WRITE, retval);
+}
+
+int
+sys_preadv(int fdesc, userptr_t iov, int iovcnt, off_t pos, int *retval)
+{
+  return file_rwv(fdesc, iov, iovcnt, true, pos, UIO_READ, retval);
+}
+
+int
+sys_pwritev(int fdesc, userptr_t iov, int iovcnt, off_t pos, int *retval)
+{
+  return file_rwv(fdesc, iov, iovcnt, true, pos, UIO_WRITE, retval);
+}
+
+/*
+ * Buffers for copy_file_range. They're big enough to cover a good
+ * many file system blocks per read and write, and so go to the page
+ * allocator; keep them on a free list once allocated rather than
+ * handing them back (which, under dumbvm, would leak them anyway).
+ */
+#define COPYBUF_SIZE (16*1024)
+
+static void *copybuf_freelist;
+static struct spinlock copybuf_freelist_lock = SPINLOCK_INITIALIZER;
+
+static
+void *
+copybuf_get(void)
+{
+  void *buf;
+
+  spinlock_acquire(&copybuf_freelist_lock);
+  buf = copybuf_freelist;
+  if (buf != NULL) {
+    copybuf_freelist = *(void **)buf;
+  }
+  spinlock_release(&copybuf_freelist_lock);
+
+  if (buf == NULL) {
+    buf = kmalloc(COPYBUF_SIZE);
+  }
+  return buf;
+}
+
+static
+void
+copybuf_put(void *buf)
+{
+  spinlock_acquire(&copybuf_freelist_lock);
+  *(void **)buf = copybuf_freelist;
+  copybuf_freelist = buf;
+  spinlock_release(&copybuf_freelist_lock);
+}
+
+/*
+ * Copy up to LEN bytes from IN at *INPOS to OUT at *OUTPOS through
+ * BUF, advancing both positions. Stops early at end of file. Returns
+ * the number of bytes copied in *DONE, even on error.
+ */
+static
+int
+file_copyrange(struct vnode *in, off_t *inpos, struct vnode *out,
+	       off_t *outpos, size_t len, void *buf, size_t *done)
+{
+  struct iovec iov;
+  struct uio u;
+  size_t chunk, got;
+  int res;
+
+  *done = 0;
+  while (*done < len) {
+    chunk = len - *done;
+    if (chunk > COPYBUF_SIZE) {
+      chunk = COPYBUF_SIZE;
+    }
+
+    uio_kinit(&iov, &u, buf, chunk, *inpos, UIO_READ);
+    res = VOP_READ(in, &u);
+    if (res) {
+      return res;
+    }
+    got = chunk - u.uio_resid;
+    if (got == 0) {
+      /* end of file */
+      break;
+    }
+
+    uio_kinit(&iov, &u, buf, got, *outpos, UIO_WRITE);
+    res = VOP_WRITE(out, &u);
+    /* only count as read what was written out */
+    *inpos += got - u.uio_resid;
+    *outpos += got - u.uio_resid;
+    *done += got - u.uio_resid;
+    if (res) {
+      return res;
+    }
+    if (u.uio_resid > 0) {
+      /* short write (e.g. disk full); report what we did */
+      break;
+    }
+  }
+  return 0;
+}
+
+/*
+ * handler for copy_file_range() system call
+ *
+ * Copies up to LEN bytes from INFD to OUTFD without the data ever
+ * going to user space: it moves through a kernel buffer in chunks of
+ * COPYBUF_SIZE, one VOP_READ and one VOP_WRITE per chunk. Each of
+ * UINPOS and UOUTPOS is either NULL, meaning use (and update) the
+ * file's seek position, or points to an offset to use (and update)
+ * instead. FLAGS must be 0.
+ */
+int
+sys_copy_file_range(int infd, userptr_t uinpos, int outfd, userptr_t uoutpos,
+		    size_t len, unsigned flags, int *retval)
+{
+  struct openfile *in, *out;
+  off_t inpos, outpos;
+  void *buf;
+  size_t done;
+  int res;
+
+  if (flags != 0) {
+    return EINVAL;
+  }
+  /* the count has to fit in the (int) return value */
+  if (len > 0x7fffffff) {
+    len = 0x7fffffff;
+  }
+
+  res = filetable_get(curproc->p_filetable, infd, &in);
+  if (res) {
+    return res;
+  }
+  res = filetable_get(curproc->p_filetable, outfd, &out);
   if (res) {
+    openfile_decref(in);
     return res;
   }
+  if ((in->of_flags & O_ACCMODE) == O_WRONLY ||
+      (out->of_flags & O_ACCMODE) == O_RDONLY ||
+      (out->of_flags & O_APPEND)) {
+    res = EBADF;
+    goto out_files;
+  }
 
-  /* pass back the number of bytes actually written */
-  *retval = nbytes - u.uio_resid;
-  KASSERT(*retval >= 0);
+  buf = copybuf_get();
+  if (buf == NULL) {
+    res = ENOMEM;
+    goto out_files;
+  }
+
+  if (uinpos != NULL) {
+    res = copyin(uinpos, &inpos, sizeof(inpos));
+    if (res) {
+      goto out_buf;
+    }
+  }
+  if (uoutpos != NULL) {
+    res = copyin(uoutpos, &outpos, sizeof(outpos));
+    if (res) {
+      goto out_buf;
+    }
+  }
+
+  /*
+   * Lock the openfiles whose seek positions we use. If that's
+   * both of them, take them in address order; if they're the
+   * same openfile, we can't copy a range onto itself that way.
+   */
+  if (uinpos == NULL && uoutpos == NULL) {
+    if (in == out) {
+      res = EINVAL;
+      goto out_buf;
+    }
+    lock_acquire(in < out ? in->of_lock : out->of_lock);
+    lock_acquire(in < out ? out->of_lock : in->of_lock);
+  }
+  else if (uinpos == NULL) {
+    lock_acquire(in->of_lock);
+  }
+  else if (uoutpos == NULL) {
+    lock_acquire(out->of_lock);
+  }
+  if (uinpos == NULL) {
+    inpos = in->of_offset;
+  }
+  if (uoutpos == NULL) {
+    outpos = out->of_offset;
+  }
+
+  if (inpos < 0 || outpos < 0) {
+    res = EINVAL;
+    done = 0;
+  }
+  else {
+    res = file_copyrange(in->of_vnode, &inpos, out->of_vnode, &outpos,
+			 len, buf, &done);
+  }
+
+  if (uinpos == NULL) {
+    in->of_offset = inpos;
+    lock_release(in->of_lock);
+  }
+  if (uoutpos == NULL) {
+    out->of_offset = outpos;
+    lock_release(out->of_lock);
+  }
+
+  /* a partial copy counts as success, like a short write */
+  if (res && done > 0) {
+    res = 0;
+  }
+  if (res == 0 && uinpos != NULL) {
+    res = copyout(&inpos, uinpos, sizeof(inpos));
+  }
+  if (res == 0 && uoutpos != NULL) {
+    res = copyout(&outpos, uoutpos, sizeof(outpos));
+  }
+  if (res == 0) {
+    *retval = done;
+  }
+
+ out_buf:
+  copybuf_put(buf);
+ out_files:
+  openfile_decref(out);
+  openfile_decref(in);
+  return res;
+}
+
+/* handler for lseek() system call                  */
+int
+sys_lseek(int fdesc, off_t pos, int whence, off_t *retval)
+{
+  struct openfile *of;
+  struct stat st;
+  off_t newpos;
+  int res;
+
+  res = filetable_get(curproc->p_filetable, fdesc, &of);
+  if (res) {
+    return res;
+  }
+
+  lock_acquire(of->of_lock);
+  switch (whence) {
+  case SEEK_SET:
+    newpos = pos;
+    break;
+  case SEEK_CUR:
+    newpos = of->of_offset + pos;
+    break;
+  case SEEK_END:
+    res = VOP_STAT(of->of_vnode, &st);
+    if (res) {
+      goto out;
+    }
+    newpos = st.st_size + pos;
+    break;
+  default:
+    res = EINVAL;
+    goto out;
+  }
+  if (newpos < 0) {
+    res = EINVAL;
+    goto out;
+  }
+  /* this also rejects seeking on the console, and other devices */
+  res = VOP_TRYSEEK(of->of_vnode, newpos);
+  if (res) {
+    goto out;
+  }
+  of->of_offset = newpos;
+  *retval = newpos;
+
+ out:
+  lock_release(of->of_lock);
+  openfile_decref(of);
+  return res;
+}
+
+/* handler for dup2() system call                  */
+int
+sys_dup2(int oldfd, int newfd, int *retval)
+{
+  struct openfile *of, *old;
+  int res;
+
+  if (newfd < 0 || newfd >= OPEN_MAX) {
+    return EBADF;
+  }
+  res = filetable_get(curproc->p_filetable, oldfd, &of);
+  if (res) {
+    return res;
+  }
+  if (oldfd == newfd) {
+    openfile_decref(of);
+    *retval = newfd;
+    return 0;
+  }
+
+  /* our reference from filetable_get becomes newfd's */
+  res = filetable_setfd(curproc->p_filetable, newfd, of, &old);
+  if (res) {
+    openfile_decref(of);
+    return res;
+  }
+  if (old != NULL) {
+    openfile_decref(old);
+  }
+  *retval = newfd;
   return 0;
 }
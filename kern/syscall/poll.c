@@ -0,0 +1,459 @@
+/*
+ * poll(), and the wait queues it sleeps on. See poll.h.
+ *
+ * A polling thread has one pollwaiter. Each pollentry it puts on a
+ * pollq points back at the pollwaiter; pollq_wakeup marks each entry
+ * on the queue as fired, links it onto its waiter's ready list, and
+ * wakes the waiter. The waiter then rechecks just the files on the
+ * ready list, so a wakeup costs time in proportion to the files it
+ * concerns, not to the number being polled.
+ *
+ * Lock order: pq_lock, then pw_lock.
+ *
+ * Timeouts are delayed work on poll_wq. The timeout holds its own
+ * reference to the pollwaiter, because once it has been taken off the
+ * queue to run it can't be cancelled, and may run after poll returns.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/poll.h>
+#include <limits.h>
+#include <lib.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <workqueue.h>
+#include <current.h>
+#include <proc.h>
+#include <copyinout.h>
+#include <syscall.h>
+#include <vnode.h>
+#include <file.h>
+#include <poll.h>
+
+/* Most poll timeouts pending on one cpu at once. */
+#define POLL_MAXTIMEOUTS 128
+
+struct pollwaiter {
+	struct spinlock pw_lock;	/* protects the fields below */
+	struct wchan *pw_wchan;		/* poller sleeps here */
+	struct pollentry *pw_ready;	/* entries fired since last look */
+	bool pw_timedout;		/* timeout has expired */
+	unsigned pw_refcount;		/* poller, and timeout if pending */
+	struct work pw_timeout;		/* the timeout */
+};
+
+static struct workqueue *poll_wq;
+
+static void pollwaiter_timeout(void *data1, unsigned long data2);
+
+////////////////////////////////////////////////////////////
+// Wait queues
+
+void
+pollq_init(struct pollq *pq)
+{
+	spinlock_init(&pq->pq_lock);
+	pq->pq_head = NULL;
+}
+
+void
+pollq_cleanup(struct pollq *pq)
+{
+	KASSERT(pq->pq_head == NULL);
+	spinlock_cleanup(&pq->pq_lock);
+}
+
+void
+pollq_add(struct pollq *pq, struct pollentry *pe)
+{
+	KASSERT(pe->pe_q == NULL);
+
+	spinlock_acquire(&pq->pq_lock);
+	pe->pe_q = pq;
+	pe->pe_next = pq->pq_head;
+	pq->pq_head = pe;
+	spinlock_release(&pq->pq_lock);
+
+	/*
+	 * Be on the queue before the caller looks at the object, so
+	 * that whoever changes it either sees us or is seen.
+	 */
+	spinlock_membar();
+}
+
+/*
+ * Take PE off whatever queue it's on.
+ */
+static
+void
+pollq_remove(struct pollentry *pe)
+{
+	struct pollq *pq = pe->pe_q;
+	struct pollentry **pp;
+
+	if (pq == NULL) {
+		return;
+	}
+
+	spinlock_acquire(&pq->pq_lock);
+	for (pp = (struct pollentry **)&pq->pq_head; *pp != pe;
+	     pp = &(*pp)->pe_next) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = pe->pe_next;
+	spinlock_release(&pq->pq_lock);
+
+	pe->pe_q = NULL;
+	pe->pe_next = NULL;
+}
+
+void
+pollq_wakeup(struct pollq *pq)
+{
+	struct pollentry *pe;
+	struct pollwaiter *pw;
+
+	/* Make the caller's change visible, then see if anyone cares. */
+	spinlock_membar();
+	if (pq->pq_head == NULL) {
+		return;
+	}
+
+	spinlock_acquire(&pq->pq_lock);
+	for (pe = pq->pq_head; pe != NULL; pe = pe->pe_next) {
+		pw = pe->pe_waiter;
+		spinlock_acquire(&pw->pw_lock);
+		if (!pe->pe_fired) {
+			pe->pe_fired = true;
+			pe->pe_readynext = pw->pw_ready;
+			pw->pw_ready = pe;
+			wchan_wakeall(pw->pw_wchan);
+		}
+		spinlock_release(&pw->pw_lock);
+	}
+	spinlock_release(&pq->pq_lock);
+}
+
+////////////////////////////////////////////////////////////
+// Waiters
+
+static
+struct pollwaiter *
+pollwaiter_create(void)
+{
+	struct pollwaiter *pw;
+
+	pw = kmalloc(sizeof(*pw));
+	if (pw == NULL) {
+		return NULL;
+	}
+	pw->pw_wchan = wchan_create("poll");
+	if (pw->pw_wchan == NULL) {
+		kfree(pw);
+		return NULL;
+	}
+	spinlock_init(&pw->pw_lock);
+	pw->pw_ready = NULL;
+	pw->pw_timedout = false;
+	pw->pw_refcount = 1;
+	work_init(&pw->pw_timeout, pollwaiter_timeout, pw, 0);
+	return pw;
+}
+
+static
+void
+pollwaiter_decref(struct pollwaiter *pw)
+{
+	bool last;
+
+	spinlock_acquire(&pw->pw_lock);
+	KASSERT(pw->pw_refcount > 0);
+	pw->pw_refcount--;
+	last = (pw->pw_refcount == 0);
+	spinlock_release(&pw->pw_lock);
+
+	if (last) {
+		spinlock_cleanup(&pw->pw_lock);
+		wchan_destroy(pw->pw_wchan);
+		kfree(pw);
+	}
+}
+
+/*
+ * Timeout function, run on poll_wq.
+ */
+static
+void
+pollwaiter_timeout(void *data1, unsigned long data2)
+{
+	struct pollwaiter *pw = data1;
+
+	(void)data2;
+
+	spinlock_acquire(&pw->pw_lock);
+	pw->pw_timedout = true;
+	wchan_wakeall(pw->pw_wchan);
+	spinlock_release(&pw->pw_lock);
+
+	pollwaiter_decref(pw);
+}
+
+/*
+ * Start the timeout, MS milliseconds from now.
+ */
+static
+int
+pollwaiter_settimeout(struct pollwaiter *pw, int ms)
+{
+	uint64_t ticks;
+	int result;
+
+	KASSERT(ms > 0);
+
+	/* Round up, so we never time out early. */
+	ticks = ((uint64_t)ms * HZ + 999) / 1000;
+
+	spinlock_acquire(&pw->pw_lock);
+	pw->pw_refcount++;
+	spinlock_release(&pw->pw_lock);
+
+	result = workqueue_add_delayed(poll_wq, &pw->pw_timeout, ticks);
+	if (result) {
+		pollwaiter_decref(pw);
+	}
+	return result;
+}
+
+/*
+ * Sleep until an entry fires or the timeout expires. Hands back the
+ * entries that fired, linked through pe_checknext, with pe_fired
+ * cleared so that they can fire again.
+ */
+static
+struct pollentry *
+pollwaiter_wait(struct pollwaiter *pw, bool *timedout)
+{
+	struct pollentry *pe, *ret;
+
+	spinlock_acquire(&pw->pw_lock);
+	while (pw->pw_ready == NULL && !pw->pw_timedout) {
+		wchan_lock(pw->pw_wchan);
+		spinlock_release(&pw->pw_lock);
+		wchan_sleep(pw->pw_wchan);
+		spinlock_acquire(&pw->pw_lock);
+	}
+
+	/*
+	 * Move the entries to a list of our own: once pe_fired is
+	 * clear, a wakeup can put an entry back on pw_ready (and
+	 * rewrite pe_readynext) while we're still going through them.
+	 */
+	ret = NULL;
+	for (pe = pw->pw_ready; pe != NULL; pe = pe->pe_readynext) {
+		pe->pe_fired = false;
+		pe->pe_checknext = ret;
+		ret = pe;
+	}
+	pw->pw_ready = NULL;
+	*timedout = pw->pw_timedout;
+	spinlock_release(&pw->pw_lock);
+
+	return ret;
+}
+
+////////////////////////////////////////////////////////////
+// The system call
+
+/*
+ * Per-call state. For OPEN_MAX files this is bigger than the largest
+ * subpage allocation, so it comes from the page allocator; keep the
+ * buffers on a free list rather than handing them back, which under
+ * dumbvm would leak a page or two on every call.
+ */
+struct pollbuf {
+	struct pollbuf *pb_next;		/* link on free list */
+	struct pollfd pb_fds[OPEN_MAX];		/* copy of the user's array */
+	struct openfile *pb_files[OPEN_MAX];	/* files being polled */
+	struct pollentry pb_pes[OPEN_MAX];	/* our wait queue entries */
+};
+
+static struct pollbuf *pollbuf_freelist;
+static struct spinlock pollbuf_freelist_lock = SPINLOCK_INITIALIZER;
+
+static
+struct pollbuf *
+pollbuf_get(void)
+{
+	struct pollbuf *pb;
+
+	spinlock_acquire(&pollbuf_freelist_lock);
+	pb = pollbuf_freelist;
+	if (pb != NULL) {
+		pollbuf_freelist = pb->pb_next;
+	}
+	spinlock_release(&pollbuf_freelist_lock);
+
+	if (pb == NULL) {
+		pb = kmalloc(sizeof(*pb));
+	}
+	return pb;
+}
+
+static
+void
+pollbuf_put(struct pollbuf *pb)
+{
+	spinlock_acquire(&pollbuf_freelist_lock);
+	pb->pb_next = pollbuf_freelist;
+	pollbuf_freelist = pb;
+	spinlock_release(&pollbuf_freelist_lock);
+}
+
+/*
+ * Check one file. If PE isn't NULL and the file isn't ready, PE is
+ * left waiting on it.
+ */
+static
+void
+poll_check(struct openfile *of, struct pollfd *pfd, struct pollentry *pe)
+{
+	int revents;
+	int result;
+
+	revents = 0;
+	result = VOP_POLL(of->of_vnode, pfd->events, pe, &revents);
+	if (result) {
+		revents = POLLERR;
+	}
+	pfd->revents = revents;
+}
+
+int
+sys_poll(userptr_t ufds, unsigned nfds, int timeout, int *retval)
+{
+	struct pollbuf *pb;
+	struct pollfd *fds;
+	struct openfile **files;
+	struct pollentry *pes, *pe;
+	struct pollwaiter *pw;
+	bool timedout;
+	unsigned i, nready;
+	int result;
+
+	if (nfds > OPEN_MAX) {
+		return EINVAL;
+	}
+
+	pb = pollbuf_get();
+	if (pb == NULL) {
+		return ENOMEM;
+	}
+	fds = pb->pb_fds;
+	files = pb->pb_files;
+	pes = pb->pb_pes;
+
+	pw = pollwaiter_create();
+	if (pw == NULL) {
+		result = ENOMEM;
+		goto out_alloc;
+	}
+
+	result = copyin(ufds, fds, nfds * sizeof(fds[0]));
+	if (result) {
+		goto out_alloc;
+	}
+
+	/*
+	 * First pass: check everything, waiting on each file that
+	 * isn't ready. Once something is ready we won't sleep, so
+	 * there's no need to wait on the rest.
+	 */
+	nready = 0;
+	for (i=0; i<nfds; i++) {
+		files[i] = NULL;
+		pe = &pes[i];
+		pe->pe_waiter = pw;
+		pe->pe_q = NULL;
+		pe->pe_next = NULL;
+		pe->pe_fired = false;
+
+		fds[i].revents = 0;
+		if (fds[i].fd < 0) {
+			continue;
+		}
+		if (filetable_get(curproc->p_filetable, fds[i].fd,
+				  &files[i])) {
+			files[i] = NULL;
+			fds[i].revents = POLLNVAL;
+			nready++;
+			continue;
+		}
+		poll_check(files[i], &fds[i],
+			   (nready == 0 && timeout != 0) ? pe : NULL);
+		if (fds[i].revents != 0) {
+			nready++;
+		}
+	}
+
+	if (nready == 0 && timeout > 0) {
+		result = pollwaiter_settimeout(pw, timeout);
+		if (result) {
+			goto out_files;
+		}
+	}
+
+	/*
+	 * Sleep until something fires, then recheck just what fired.
+	 * The entries stay on their queues, so nothing is missed
+	 * between checks.
+	 */
+	timedout = (timeout == 0);
+	while (nready == 0 && !timedout) {
+		for (pe = pollwaiter_wait(pw, &timedout); pe != NULL;
+		     pe = pe->pe_checknext) {
+			i = pe - pes;
+			poll_check(files[i], &fds[i], NULL);
+			if (fds[i].revents != 0) {
+				nready++;
+			}
+		}
+	}
+
+	if (workqueue_cancel(poll_wq, &pw->pw_timeout)) {
+		/* It won't run now; drop its reference for it. */
+		pollwaiter_decref(pw);
+	}
+
+	result = copyout(fds, ufds, nfds * sizeof(fds[0]));
+	if (result == 0) {
+		*retval = nready;
+	}
+
+ out_files:
+	for (i=0; i<nfds; i++) {
+		if (files[i] != NULL) {
+			pollq_remove(&pes[i]);
+			openfile_decref(files[i]);
+		}
+	}
+ out_alloc:
+	if (pw != NULL) {
+		pollwaiter_decref(pw);
+	}
+	pollbuf_put(pb);
+	return result;
+}
+
+/*
+ * Set up the workqueue for timeouts.
+ */
+void
+poll_bootstrap(void)
+{
+	poll_wq = workqueue_create("poll", POLL_MAXTIMEOUTS);
+	if (poll_wq == NULL) {
+		panic("poll_bootstrap: Could not create workqueue\n");
+	}
+}
@@ -1,29 +1,31 @@
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/fcntl.h>
 #include <kern/unistd.h>
 #include <kern/wait.h>
+#include <limits.h>
 #include <lib.h>
 #include <syscall.h>
 #include <current.h>
 #include <proc.h>
 #include <thread.h>
 #include <addrspace.h>
+#include <vm.h>
+#include <vfs.h>
+#include <synch.h>
 #include <copyinout.h>
+#include <mips/trapframe.h>
 
-  /* this implementation of sys__exit does not do anything with the exit code */
-  /* this needs to be fixed to get exit() and waitpid() working properly */
-
-void sys__exit(int exitcode) {
-
+/* tear down the current process, leaving WAITSTATUS for its parent,
+   and exit the current thread; does not return */
+static
+__DEAD
+void
+exit_curproc(int waitstatus)
+{
   struct addrspace *as;
   struct proc *p = curproc;
-  /* for now, just include this to keep the compiler from complaining about
-     an unused variable */
-  (void)exitcode;
-
-  DEBUG(DB_SYSCALL,"Syscall: _exit(%d)\n",exitcode);
 
-  KASSERT(curproc->p_addrspace != NULL);
   as_deactivate();
   /*
    * clear p_addrspace before calling as_destroy. Otherwise if
@@ -33,33 +35,42 @@ void sys__exit(int exitcode) {
    * messily fatal.
    */
   as = curproc_setas(NULL);
-  as_destroy(as);
+  if (as != NULL) {
+    as_destroy(as);
+  }
 
   /* detach this thread from its process */
   /* note: curproc cannot be used after this call */
   proc_remthread(curthread);
 
-  /* if this is the last user process in the system, proc_destroy()
-     will wake up the kernel menu thread */
-  proc_destroy(p);
+  /* keep the exit status for our parent; if there is no parent,
+     proc_exit() destroys the process, and if this is the last user
+     process in the system, that will wake up the kernel menu thread */
+  proc_exit(p, waitstatus);
   
   thread_exit();
   /* thread_exit() does not return, so we should never get here */
   panic("return from thread_exit in sys_exit\n");
 }
 
+void sys__exit(int exitcode) {
+
+  DEBUG(DB_SYSCALL,"Syscall: _exit(%d)\n",exitcode);
+
+  KASSERT(curproc->p_addrspace != NULL);
+  exit_curproc(_MKWAIT_EXIT(exitcode));
+}
+
 
-/* stub handler for getpid() system call                */
+/* handler for getpid() system call                */
 int
 sys_getpid(pid_t *retval)
 {
-  /* for now, this is just a stub that always returns a PID of 1 */
-  /* you need to fix this to make it work properly */
-  *retval = 1;
+  *retval = curproc->p_pid;
   return(0);
 }
 
-/* stub handler for waitpid() system call                */
+/* handler for waitpid() system call                */
 
 int
 sys_waitpid(pid_t pid,
@@ -70,25 +81,479 @@ sys_waitpid(pid_t pid,
   int exitstatus;
   int result;
 
-  /* this is just a stub implementation that always reports an
-     exit status of 0, regardless of the actual exit status of
-     the specified process.   
-     In fact, this will return 0 even if the specified process
-     is still running, and even if it never existed in the first place.
+  result = proc_wait(pid, options, &exitstatus, retval);
+  if (result) {
+    return(result);
+  }
+  /* with WNOHANG, nothing was reaped and there is no status */
+  if (*retval == 0) {
+    return(0);
+  }
+  /* the child is gone either way, so a bad status pointer just
+     loses the status */
+  if (status != NULL) {
+    result = copyout((void *)&exitstatus,status,sizeof(int));
+    if (result) {
+      return(result);
+    }
+  }
+  return(0);
+}
+
+/* the new thread in a forked process starts here */
+static
+void
+fork_child_start(void *tf, unsigned long unused)
+{
+  (void)unused;
+  enter_forked_process(tf);
+}
+
+/* handler for fork() system call                */
+int
+sys_fork(struct trapframe *tf, pid_t *retval)
+{
+  struct proc *child;
+  struct trapframe *childtf;
+  pid_t pid;
+  int result;
+
+  child = proc_create_runprogram(curproc->p_name);
+  if (child == NULL) {
+    return(ENPROC);
+  }
 
-     Fix this!
-  */
+  result = as_copy(curproc_getas(), &child->p_addrspace);
+  if (result) {
+    proc_destroy(child);
+    return(result);
+  }
 
-  if (options != 0) {
-    return(EINVAL);
+  /* the child's thread frees this once it has copied it */
+  childtf = kmalloc(sizeof(*childtf));
+  if (childtf == NULL) {
+    as_destroy(child->p_addrspace);
+    child->p_addrspace = NULL;
+    proc_destroy(child);
+    return(ENOMEM);
   }
-  /* for now, just pretend the exitstatus is 0 */
-  exitstatus = 0;
-  result = copyout((void *)&exitstatus,status,sizeof(int));
+  *childtf = *tf;
+
+  /* link the child in before it can run, so that it can't exit
+     without leaving us its exit status */
+  proc_addchild(curproc, child);
+  pid = child->p_pid;
+
+  result = thread_fork(curthread->t_name, child,
+		       fork_child_start, childtf, 0);
   if (result) {
+    kfree(childtf);
+    as_destroy(child->p_addrspace);
+    child->p_addrspace = NULL;
+    proc_destroy(child);
     return(result);
   }
+
   *retval = pid;
   return(0);
 }
 
+
+/*
+ * Program arguments, packed for the new user stack.
+ *
+ * argbuf_copyin copies the argument strings in back to back, each
+ * with its terminating null, into one buffer of ARG_MAX bytes; the
+ * strings plus the argv pointer array must fit in ARG_MAX, as on
+ * other systems. The user's argv array is fetched a page's worth at
+ * a time rather than one pointer per copyin. argbuf_copyout then
+ * slides the strings up to make room for the pointer array in front
+ * of them, fills the pointers in for where the block will land in
+ * the user stack, and copies the whole block out with a single
+ * copyout.
+ *
+ * The ARG_MAX buffers themselves are kept on a free list once
+ * allocated, so an exec doesn't cost a large kmalloc (which, under
+ * dumbvm, would never be given back).
+ */
+struct argbuf {
+  char *ab_buf;		/* ARG_MAX bytes */
+  size_t ab_strlen;	/* bytes of strings in ab_buf */
+  int ab_argc;		/* number of strings */
+};
+
+/* free ARG_MAX buffers, linked through their first word */
+static void *argbuf_freelist;
+static struct spinlock argbuf_freelist_lock = SPINLOCK_INITIALIZER;
+
+static
+int
+argbuf_init(struct argbuf *ab)
+{
+  spinlock_acquire(&argbuf_freelist_lock);
+  ab->ab_buf = argbuf_freelist;
+  if (ab->ab_buf != NULL) {
+    argbuf_freelist = *(void **)ab->ab_buf;
+  }
+  spinlock_release(&argbuf_freelist_lock);
+
+  if (ab->ab_buf == NULL) {
+    ab->ab_buf = kmalloc(ARG_MAX);
+    if (ab->ab_buf == NULL) {
+      return(ENOMEM);
+    }
+  }
+  ab->ab_strlen = 0;
+  ab->ab_argc = 0;
+  return(0);
+}
+
+static
+void
+argbuf_cleanup(struct argbuf *ab)
+{
+  spinlock_acquire(&argbuf_freelist_lock);
+  *(void **)ab->ab_buf = argbuf_freelist;
+  argbuf_freelist = ab->ab_buf;
+  spinlock_release(&argbuf_freelist_lock);
+  ab->ab_buf = NULL;
+}
+
+/* copy in the null-terminated user argv array UARGV */
+static
+int
+argbuf_copyin(struct argbuf *ab, userptr_t uargv)
+{
+  userptr_t uargs[64];
+  unsigned nargs, i;
+  vaddr_t next, pageend;
+  size_t ptrspace, got;
+  int result;
+
+  if (uargv == NULL || ((vaddr_t)uargv & (sizeof(userptr_t) - 1)) != 0) {
+    return(EFAULT);
+  }
+
+  next = (vaddr_t)uargv;
+  while (1) {
+    /*
+     * Fetch as many pointers as we can without crossing into
+     * another page, which might not be mapped even if the
+     * array ends before it.
+     */
+    pageend = (next & PAGE_FRAME) + PAGE_SIZE;
+    nargs = (pageend - next) / sizeof(userptr_t);
+    if (nargs > sizeof(uargs) / sizeof(uargs[0])) {
+      nargs = sizeof(uargs) / sizeof(uargs[0]);
+    }
+    result = copyin((const_userptr_t)next, uargs,
+		    nargs * sizeof(userptr_t));
+    if (result) {
+      return(result);
+    }
+    next += nargs * sizeof(userptr_t);
+
+    for (i=0; i<nargs; i++) {
+      if (uargs[i] == NULL) {
+	return(0);
+      }
+
+      /* leave room for this pointer, the one after, and the string */
+      ptrspace = (ab->ab_argc + 2) * sizeof(userptr_t);
+      if (ab->ab_strlen + ptrspace >= ARG_MAX) {
+	return(E2BIG);
+      }
+      result = copyinstr(uargs[i], ab->ab_buf + ab->ab_strlen,
+			 ARG_MAX - ptrspace - ab->ab_strlen, &got);
+      if (result == ENAMETOOLONG) {
+	return(E2BIG);
+      }
+      if (result) {
+	return(result);
+      }
+      ab->ab_strlen += got;
+      ab->ab_argc++;
+    }
+  }
+}
+
+/* put the arguments on the user stack of AS below *STACKPTR, updating
+   *STACKPTR and returning the user address of argv in *UARGV; fails
+   with E2BIG if they'd leave the program less than a page of stack */
+static
+int
+argbuf_copyout(struct argbuf *ab, struct addrspace *as, vaddr_t *stackptr,
+	       userptr_t *uargv)
+{
+  userptr_t *ptrs;
+  size_t ptrsize, total, pos;
+  vaddr_t base, strbase;
+  int i;
+
+  ptrsize = (ab->ab_argc + 1) * sizeof(userptr_t);
+  total = ptrsize + ab->ab_strlen;
+  KASSERT(total <= ARG_MAX);
+  if (total + 8 + PAGE_SIZE > as_stacksize(as)) {
+    return(E2BIG);
+  }
+
+  base = (*stackptr - total) & ~(vaddr_t)7;
+  strbase = base + ptrsize;
+
+  /* make room for the pointers, then fill them in */
+  memmove(ab->ab_buf + ptrsize, ab->ab_buf, ab->ab_strlen);
+  ptrs = (userptr_t *)ab->ab_buf;
+  pos = 0;
+  for (i=0; i<ab->ab_argc; i++) {
+    ptrs[i] = (userptr_t)(strbase + pos);
+    pos += strlen(ab->ab_buf + ptrsize + pos) + 1;
+  }
+  KASSERT(pos == ab->ab_strlen);
+  ptrs[ab->ab_argc] = NULL;
+
+  *stackptr = base;
+  *uargv = (userptr_t)base;
+  return(copyout(ab->ab_buf, (userptr_t)base, total));
+}
+
+/* what sys_spawn hands to the new process's thread */
+struct spawnargs {
+  char *sa_path;		/* program to run */
+  struct argbuf sa_args;	/* its arguments */
+  struct semaphore *sa_done;	/* V'd once the program is loaded */
+  int sa_result;		/* and whether that worked */
+};
+
+/* load the program into a new address space for the current (new)
+   process and set up its stack */
+static
+int
+spawn_load(struct spawnargs *sa, vaddr_t *entrypoint,
+	   vaddr_t *stackptr, userptr_t *uargv)
+{
+  struct addrspace *as;
+  struct vnode *v;
+  int result;
+
+  KASSERT(curproc_getas() == NULL);
+
+  as = as_create();
+  if (as == NULL) {
+    return(ENOMEM);
+  }
+  curproc_setas(as);
+  as_activate();
+
+  /* on failure the address space goes away when we exit */
+  result = vfs_open(sa->sa_path, O_RDONLY, 0, &v);
+  if (result) {
+    return(result);
+  }
+  result = load_elf(v, entrypoint);
+  vfs_close(v);
+  if (result) {
+    return(result);
+  }
+
+  result = as_define_stack(as, stackptr);
+  if (result) {
+    return(result);
+  }
+  return(argbuf_copyout(&sa->sa_args, as, stackptr, uargv));
+}
+
+/* the new thread in a spawned process starts here */
+static
+void
+spawn_child_start(void *data, unsigned long unused)
+{
+  struct spawnargs *sa = data;
+  vaddr_t entrypoint, stackptr;
+  userptr_t uargv;
+  int argc, result;
+
+  (void)unused;
+
+  result = spawn_load(sa, &entrypoint, &stackptr, &uargv);
+  argc = sa->sa_args.ab_argc;
+
+  /* sys_spawn frees SA once we let it go */
+  sa->sa_result = result;
+  V(sa->sa_done);
+
+  if (result) {
+    exit_curproc(_MKWAIT_EXIT(1));
+  }
+  enter_new_process(argc, uargv, stackptr, entrypoint);
+  /* enter_new_process does not return */
+  panic("spawn_child_start: enter_new_process returned\n");
+}
+
+/*
+ * handler for spawn() system call
+ *
+ * spawn(path, argv) is fork() followed by execv(path, argv) in the
+ * child, without copying the parent's address space only to throw it
+ * away: the child starts out empty and loads the program directly.
+ * The parent waits until the program has been loaded, so errors such
+ * as a bad path come back from spawn itself.
+ */
+int
+sys_spawn(userptr_t upath, userptr_t uargv, pid_t *retval)
+{
+  struct spawnargs *sa;
+  struct proc *child;
+  pid_t pid;
+  int status;
+  int result;
+
+  sa = kmalloc(sizeof(*sa));
+  if (sa == NULL) {
+    return(ENOMEM);
+  }
+  sa->sa_path = kmalloc(PATH_MAX);
+  if (sa->sa_path == NULL) {
+    kfree(sa);
+    return(ENOMEM);
+  }
+  result = argbuf_init(&sa->sa_args);
+  if (result) {
+    kfree(sa->sa_path);
+    kfree(sa);
+    return(result);
+  }
+  sa->sa_done = sem_create("spawn", 0);
+  if (sa->sa_done == NULL) {
+    result = ENOMEM;
+    goto out;
+  }
+  sa->sa_result = 0;
+
+  result = copyinstr(upath, sa->sa_path, PATH_MAX, NULL);
+  if (result) {
+    goto out;
+  }
+  result = argbuf_copyin(&sa->sa_args, uargv);
+  if (result) {
+    goto out;
+  }
+
+  child = proc_create_runprogram(sa->sa_path);
+  if (child == NULL) {
+    result = ENPROC;
+    goto out;
+  }
+  proc_addchild(curproc, child);
+  pid = child->p_pid;
+
+  result = thread_fork(child->p_name, child, spawn_child_start, sa, 0);
+  if (result) {
+    proc_destroy(child);
+    goto out;
+  }
+
+  P(sa->sa_done);
+  result = sa->sa_result;
+  if (result) {
+    /* the child is exiting; reap it so it doesn't linger */
+    proc_wait(pid, 0, &status, &pid);
+    goto out;
+  }
+  *retval = pid;
+
+ out:
+  if (sa->sa_done != NULL) {
+    sem_destroy(sa->sa_done);
+  }
+  argbuf_cleanup(&sa->sa_args);
+  kfree(sa->sa_path);
+  kfree(sa);
+  return(result);
+}
+
+/*
+ * handler for execv() system call
+ *
+ * The old address space is kept until the new program is loaded and
+ * its arguments are in place, so on any error we can go back to it
+ * and return the error as usual.
+ */
+int
+sys_execv(userptr_t upath, userptr_t uargv)
+{
+  char *path;
+  struct argbuf ab;
+  struct vnode *v;
+  struct addrspace *newas, *oldas;
+  vaddr_t entrypoint, stackptr;
+  userptr_t argvaddr;
+  int argc;
+  int result;
+
+  path = kmalloc(PATH_MAX);
+  if (path == NULL) {
+    return(ENOMEM);
+  }
+  result = copyinstr(upath, path, PATH_MAX, NULL);
+  if (result) {
+    kfree(path);
+    return(result);
+  }
+  result = argbuf_init(&ab);
+  if (result) {
+    kfree(path);
+    return(result);
+  }
+  /* arguments come from the old address space, so fetch them first */
+  result = argbuf_copyin(&ab, uargv);
+  if (result) {
+    goto fail;
+  }
+
+  result = vfs_open(path, O_RDONLY, 0, &v);
+  if (result) {
+    goto fail;
+  }
+
+  newas = as_create();
+  if (newas == NULL) {
+    vfs_close(v);
+    result = ENOMEM;
+    goto fail;
+  }
+  oldas = curproc_setas(newas);
+  as_activate();
+
+  result = load_elf(v, &entrypoint);
+  vfs_close(v);
+  if (result) {
+    goto fail_as;
+  }
+  result = as_define_stack(newas, &stackptr);
+  if (result) {
+    goto fail_as;
+  }
+  result = argbuf_copyout(&ab, newas, &stackptr, &argvaddr);
+  if (result) {
+    goto fail_as;
+  }
+
+  /* no going back now */
+  as_destroy(oldas);
+  argc = ab.ab_argc;
+  argbuf_cleanup(&ab);
+  kfree(path);
+
+  enter_new_process(argc, argvaddr, stackptr, entrypoint);
+  /* enter_new_process does not return */
+  panic("sys_execv: enter_new_process returned\n");
+
+ fail_as:
+  curproc_setas(oldas);
+  as_activate();
+  as_destroy(newas);
+ fail:
+  argbuf_cleanup(&ab);
+  kfree(path);
+  return(result);
+}
@@ -28,6 +28,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
 #include <test.h>
@@ -101,6 +102,34 @@ bitmaptest(int nargs, char **args)
 		KASSERT(data[i]==0);
 	}
 
+	/* Free bits on both sides of where allocation left off. */
+	for (i=0; i<TESTSIZE; i+=97) {
+		bitmap_unmark(b, i);
+		data[i] = 1;
+	}
+	while (bitmap_alloc(b, &x)==0) {
+		KASSERT(x < TESTSIZE);
+		KASSERT(data[x]==1);
+		data[x] = 0;
+	}
+	for (i=0; i<TESTSIZE; i++) {
+		KASSERT(data[i]==0);
+	}
+
+	/* bitmap_alloc_near: the hint itself, */
+	bitmap_unmark(b, 100);
+	KASSERT(bitmap_alloc_near(b, 100, &x)==0 && x==100);
+	/* a later bit in the same chunk, */
+	bitmap_unmark(b, 110);
+	KASSERT(bitmap_alloc_near(b, 100, &x)==0 && x==110);
+	/* a later chunk, */
+	bitmap_unmark(b, 200);
+	KASSERT(bitmap_alloc_near(b, 100, &x)==0 && x==200);
+	/* and wrapping around to before the hint. */
+	bitmap_unmark(b, 5);
+	KASSERT(bitmap_alloc_near(b, 400, &x)==0 && x==5);
+	KASSERT(bitmap_alloc_near(b, 400, &x)==ENOSPC);
+
 	kprintf("Bitmap test complete\n");
 	return 0;
 }
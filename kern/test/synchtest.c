@@ -347,3 +347,318 @@ cvtest(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Reader/writer lock test.
+ *
+ * Each part sets up a particular arrangement of holders and waiters
+ * and checks who gets in. "Doesn't get in" is checked by yielding for
+ * a while (RWT_YIELDS times) and seeing that it still hasn't happened;
+ * "gets in" by waiting up to the same long for it.
+ */
+
+#define RWT_YIELDS 2000
+
+static struct rwlock *testrw;
+static struct semaphore *rwt_gate;
+static struct spinlock rwt_lock = SPINLOCK_INITIALIZER;
+static volatile unsigned rwt_readers;	/* readers inside the lock */
+static volatile unsigned rwt_writers;	/* writers inside the lock */
+static volatile unsigned rwt_seq;	/* order threads got in */
+static volatile unsigned rwt_readerseq;
+static volatile unsigned rwt_writerseq;
+static volatile bool rwt_upgraded;
+static volatile unsigned rwt_failures;
+
+static
+void
+rwt_fail(unsigned long num, const char *msg)
+{
+	kprintf("thread %lu: %s\n", num, msg);
+	spinlock_acquire(&rwt_lock);
+	rwt_failures++;
+	spinlock_release(&rwt_lock);
+}
+
+static
+void
+rwt_adjust(volatile unsigned *counter, int delta)
+{
+	spinlock_acquire(&rwt_lock);
+	*counter += delta;
+	spinlock_release(&rwt_lock);
+}
+
+/*
+ * Yield until *COUNTER reaches VAL, or until we give up. Returns true
+ * if it got there.
+ */
+static
+bool
+rwt_waitfor(volatile unsigned *counter, unsigned val)
+{
+	unsigned i;
+
+	for (i=0; i<RWT_YIELDS; i++) {
+		if (*counter == val) {
+			return true;
+		}
+		thread_yield();
+	}
+	return *counter == val;
+}
+
+static
+void
+rwt_yieldawhile(void)
+{
+	unsigned i;
+
+	for (i=0; i<RWT_YIELDS; i++) {
+		thread_yield();
+	}
+}
+
+/*
+ * Part 1: get in for reading, then wait at the gate while still
+ * holding the lock.
+ */
+static
+void
+rwt_gatereader(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	rwlock_acquire_read(testrw);
+	rwt_adjust(&rwt_readers, 1);
+	P(rwt_gate);
+	rwt_adjust(&rwt_readers, -1);
+	rwlock_release_read(testrw);
+	V(donesem);
+}
+
+/*
+ * Part 2: readers and writers in a loop, each checking that nobody
+ * is inside with it who shouldn't be.
+ */
+static
+void
+rwt_mixed(void *junk, unsigned long num)
+{
+	int i;
+	(void)junk;
+
+	for (i=0; i<NLOCKLOOPS; i++) {
+		if (num % 4 == 0) {
+			rwlock_acquire_write(testrw);
+			rwt_adjust(&rwt_writers, 1);
+			if (rwt_writers != 1 || rwt_readers != 0) {
+				rwt_fail(num, "writer not alone");
+			}
+			thread_yield();
+			if (rwt_writers != 1 || rwt_readers != 0) {
+				rwt_fail(num, "writer not alone");
+			}
+			rwt_adjust(&rwt_writers, -1);
+			rwlock_release_write(testrw);
+		}
+		else {
+			rwlock_acquire_read(testrw);
+			rwt_adjust(&rwt_readers, 1);
+			if (rwt_writers != 0) {
+				rwt_fail(num, "reader with a writer");
+			}
+			thread_yield();
+			if (rwt_writers != 0) {
+				rwt_fail(num, "reader with a writer");
+			}
+			rwt_adjust(&rwt_readers, -1);
+			rwlock_release_read(testrw);
+		}
+	}
+	V(donesem);
+}
+
+/*
+ * Parts 3 and 5: get the lock once, and record in what order.
+ */
+static
+void
+rwt_oncewriter(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	rwlock_acquire_write(testrw);
+	spinlock_acquire(&rwt_lock);
+	rwt_writerseq = ++rwt_seq;
+	spinlock_release(&rwt_lock);
+	rwlock_release_write(testrw);
+	V(donesem);
+}
+
+static
+void
+rwt_oncereader(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	rwlock_acquire_read(testrw);
+	spinlock_acquire(&rwt_lock);
+	rwt_readerseq = ++rwt_seq;
+	spinlock_release(&rwt_lock);
+	rwlock_release_read(testrw);
+	V(donesem);
+}
+
+/*
+ * Part 4: get in for reading and try to upgrade.
+ */
+static
+void
+rwt_upgrader(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	rwlock_acquire_read(testrw);
+	V(rwt_gate);
+	if (rwlock_upgrade(testrw)) {
+		rwt_upgraded = true;
+		rwlock_release_write(testrw);
+	}
+	else {
+		rwlock_release_read(testrw);
+	}
+	V(donesem);
+}
+
+static
+void
+rwt_fork(void (*func)(void *, unsigned long), unsigned long num)
+{
+	int result;
+
+	result = thread_fork("rwlocktest", NULL, func, NULL, num);
+	if (result) {
+		panic("rwlocktest: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+}
+
+int
+rwlocktest(int nargs, char **args)
+{
+	int i;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	testrw = rwlock_create("testrw");
+	rwt_gate = sem_create("rwt_gate", 0);
+	if (testrw == NULL || rwt_gate == NULL) {
+		panic("rwlocktest: out of memory\n");
+	}
+	rwt_readers = rwt_writers = 0;
+	rwt_failures = 0;
+	kprintf("Starting rwlock test...\n");
+
+	kprintf("Readers run concurrently...\n");
+	rwlock_acquire_read(testrw);
+	for (i=0; i<NTHREADS; i++) {
+		rwt_fork(rwt_gatereader, i);
+	}
+	if (!rwt_waitfor(&rwt_readers, NTHREADS)) {
+		rwt_fail(0, "readers did not all get in together");
+	}
+	rwlock_release_read(testrw);
+	for (i=0; i<NTHREADS; i++) {
+		V(rwt_gate);
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(donesem);
+	}
+
+	kprintf("Writers exclude everyone...\n");
+	for (i=0; i<NTHREADS; i++) {
+		rwt_fork(rwt_mixed, i);
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(donesem);
+	}
+
+	kprintf("A waiting writer holds off new readers...\n");
+	rwt_seq = rwt_readerseq = rwt_writerseq = 0;
+	rwlock_acquire_read(testrw);
+	rwt_fork(rwt_oncewriter, 0);
+	if (!rwt_waitfor(&testrw->rw_writerswaiting, 1)) {
+		rwt_fail(0, "writer never queued");
+	}
+	rwt_fork(rwt_oncereader, 1);
+	rwt_yieldawhile();
+	if (rwt_readerseq != 0) {
+		rwt_fail(1, "reader got in past a waiting writer");
+	}
+	rwlock_release_read(testrw);
+	P(donesem);
+	P(donesem);
+	if (rwt_writerseq == 0 || rwt_readerseq < rwt_writerseq) {
+		rwt_fail(0, "waiting writer did not go first");
+	}
+
+	kprintf("A second upgrader fails...\n");
+	rwt_upgraded = false;
+	rwlock_acquire_read(testrw);
+	rwt_fork(rwt_upgrader, 0);
+	P(rwt_gate);
+	for (i=0; i<RWT_YIELDS && testrw->rw_upgrader == NULL; i++) {
+		thread_yield();
+	}
+	if (testrw->rw_upgrader == NULL) {
+		rwt_fail(0, "first upgrader never started waiting");
+	}
+	else if (rwlock_upgrade(testrw)) {
+		rwt_fail(0, "second upgrade succeeded");
+		rwlock_release_write(testrw);
+	}
+	else {
+		rwlock_release_read(testrw);
+	}
+	P(donesem);
+	if (!rwt_upgraded) {
+		rwt_fail(0, "first upgrade failed");
+	}
+
+	kprintf("Downgrading keeps writers out...\n");
+	rwt_seq = rwt_writerseq = 0;
+	rwlock_acquire_write(testrw);
+	rwt_fork(rwt_oncewriter, 0);
+	if (!rwt_waitfor(&testrw->rw_writerswaiting, 1)) {
+		rwt_fail(0, "writer never queued");
+	}
+	rwlock_downgrade(testrw);
+	rwt_yieldawhile();
+	if (rwt_writerseq != 0) {
+		rwt_fail(0, "writer got in after downgrade");
+	}
+	rwlock_release_read(testrw);
+	P(donesem);
+	if (rwt_writerseq == 0) {
+		rwt_fail(0, "writer never got in");
+	}
+
+	sem_destroy(rwt_gate);
+	rwlock_destroy(testrw);
+#ifdef UW
+	cleanitems();
+#endif
+	if (rwt_failures > 0) {
+		kprintf("Test failed\n");
+	}
+	kprintf("RW lock test done.\n");
+
+	return 0;
+}
@@ -34,6 +34,7 @@
 #include <clock.h>
 #include <thread.h>
 #include <current.h>
+#include <workqueue.h>
 
 /*
  * Time handling.
@@ -93,6 +94,7 @@ hardclock(void)
 	 */
 
 	curcpu->c_hardclocks++;
+	workqueue_hardclock();
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
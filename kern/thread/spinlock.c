@@ -39,8 +39,109 @@
 
 /*
  * Spinlocks.
+ *
+ * These are MCS queued locks; see the notes in spinlock.h. The lock
+ * word is lk_tail, which points to the queue node of the last cpu in
+ * line (the holder, if nobody is waiting) or is NULL if the lock is
+ * free.
+ */
+
+/* Queue nodes used before curcpu is set up (only one cpu runs then) */
+static struct spinlock_qnode boot_spinnodes[SPINLOCK_MAXNEST];
+static unsigned boot_spinnodes_used;
+
+/*
+ * List of spinlocks that have been contended, for spinlock_printstats.
+ * This can't itself be protected by a spinlock, so it uses a bare
+ * test-and-set word. Interrupts must be off while holding it.
  */
+static struct spinlock *spinlock_statlist;
+static volatile spinlock_data_t spinlock_statlist_lock =
+	SPINLOCK_DATA_INITIALIZER;
+
+/* Most locks spinlock_printstats will list */
+#define SPINLOCK_MAXSTATS 32
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Get a free queue node for the current cpu. Interrupts must be off.
+ */
+static
+struct spinlock_qnode *
+spinlock_qnode_get(void)
+{
+	struct spinlock_qnode *nodes;
+	unsigned *used;
+	unsigned i;
 
+	/* this must work before curcpu initialization */
+	if (CURCPU_EXISTS()) {
+		nodes = curcpu->c_spinnodes;
+		used = &curcpu->c_spinnodes_used;
+	}
+	else {
+		nodes = boot_spinnodes;
+		used = &boot_spinnodes_used;
+	}
+
+	for (i=0; i<SPINLOCK_MAXNEST; i++) {
+		if ((*used & (1U << i)) == 0) {
+			*used |= 1U << i;
+			return &nodes[i];
+		}
+	}
+	panic("spinlock: more than %d spinlocks held at once\n",
+	      SPINLOCK_MAXNEST);
+	return NULL;
+}
+
+/*
+ * Give back a queue node. Spinlocks need not be released in the
+ * order they were acquired, so work out which slot it was.
+ */
+static
+void
+spinlock_qnode_put(struct spinlock_qnode *node)
+{
+	if (node >= boot_spinnodes && node < boot_spinnodes + SPINLOCK_MAXNEST) {
+		boot_spinnodes_used &= ~(1U << (node - boot_spinnodes));
+	}
+	else {
+		KASSERT(CURCPU_EXISTS());
+		KASSERT(node >= curcpu->c_spinnodes &&
+			node < curcpu->c_spinnodes + SPINLOCK_MAXNEST);
+		curcpu->c_spinnodes_used &=
+			~(1U << (node - curcpu->c_spinnodes));
+	}
+}
+
+/*
+ * Lock and unlock the contended-lock list. Interrupts must be off.
+ */
+static
+void
+spinlock_statlist_lock_acquire(void)
+{
+	while (1) {
+		if (spinlock_data_get(&spinlock_statlist_lock) != 0) {
+			continue;
+		}
+		if (spinlock_data_testandset(&spinlock_statlist_lock) != 0) {
+			continue;
+		}
+		break;
+	}
+}
+
+static
+void
+spinlock_statlist_lock_release(void)
+{
+	spinlock_data_set(&spinlock_statlist_lock, 0);
+}
+
+////////////////////////////////////////////////////////////
 
 /*
  * Initialize spinlock.
@@ -48,8 +149,16 @@
 void
 spinlock_init(struct spinlock *lk)
 {
-	spinlock_data_set(&lk->lk_lock, 0);
+	lk->lk_tail = NULL;
+	lk->lk_node = NULL;
 	lk->lk_holder = NULL;
+
+	lk->lk_acquires = 0;
+	lk->lk_contended = 0;
+	lk->lk_spincycles = 0;
+	lk->lk_site = NULL;
+	lk->lk_statnext = NULL;
+	lk->lk_statprev = NULL;
 }
 
 /*
@@ -59,20 +168,34 @@ void
 spinlock_cleanup(struct spinlock *lk)
 {
 	KASSERT(lk->lk_holder == NULL);
-	KASSERT(spinlock_data_get(&lk->lk_lock) == 0);
+	KASSERT(lk->lk_tail == NULL);
+
+	if (lk->lk_statprev != NULL) {
+		splraise(IPL_NONE, IPL_HIGH);
+		spinlock_statlist_lock_acquire();
+		*lk->lk_statprev = lk->lk_statnext;
+		if (lk->lk_statnext != NULL) {
+			lk->lk_statnext->lk_statprev = lk->lk_statprev;
+		}
+		lk->lk_statnext = NULL;
+		lk->lk_statprev = NULL;
+		spinlock_statlist_lock_release();
+		spllower(IPL_HIGH, IPL_NONE);
+	}
 }
 
 /*
  * Get the lock.
  *
  * First disable interrupts (otherwise, if we get a timer interrupt we
- * might come back to this lock and deadlock), then use a machine-level
- * atomic operation to wait for the lock to be free.
+ * might come back to this lock and deadlock), then join the queue.
  */
 void
 spinlock_acquire(struct spinlock *lk)
 {
 	struct cpu *mycpu;
+	struct spinlock_qnode *node, *pred;
+	uint32_t start, spun;
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -87,42 +210,88 @@ spinlock_acquire(struct spinlock *lk)
 		mycpu = NULL;
 	}
 
-	while (1) {
-		/*
-		 * Do test-test-and-set, that is, read first before
-		 * doing test-and-set, to reduce bus contention.
-		 *
-		 * Test-and-set is a machine-level atomic operation
-		 * that writes 1 into the lock word and returns the
-		 * previous value. If that value was 0, the lock was
-		 * previously unheld and we now own it. If it was 1,
-		 * we don't.
-		 */
-		if (spinlock_data_get(&lk->lk_lock) != 0) {
-			continue;
-		}
-		if (spinlock_data_testandset(&lk->lk_lock) != 0) {
-			continue;
+	node = spinlock_qnode_get();
+	node->sq_next = NULL;
+	node->sq_waiting = true;
+
+	/*
+	 * Put ourselves at the end of the queue. If there was nobody
+	 * there, the lock was free and we now own it. Otherwise link
+	 * in behind our predecessor and spin on our own node until
+	 * it hands the lock to us in spinlock_release.
+	 */
+	pred = spinlock_ptr_swap((void *volatile *)&lk->lk_tail, node);
+	if (pred == NULL) {
+		spun = 0;
+	}
+	else {
+		start = cpu_cycles();
+		pred->sq_next = node;
+		while (node->sq_waiting) {
+			/* spin */
 		}
-		break;
+		spun = cpu_cycles() - start;
 	}
 
+	lk->lk_node = node;
 	lk->lk_holder = mycpu;
+
+	lk->lk_acquires++;
+	if (pred != NULL) {
+		lk->lk_contended++;
+		lk->lk_spincycles += spun;
+		if (lk->lk_statprev == NULL) {
+			/* First contention; put it on the list. */
+			lk->lk_site = __builtin_return_address(0);
+			spinlock_statlist_lock_acquire();
+			lk->lk_statnext = spinlock_statlist;
+			if (spinlock_statlist != NULL) {
+				spinlock_statlist->lk_statprev =
+					&lk->lk_statnext;
+			}
+			spinlock_statlist = lk;
+			lk->lk_statprev = &spinlock_statlist;
+			spinlock_statlist_lock_release();
+		}
+	}
 }
 
 /*
  * Release the lock.
+ *
+ * If somebody is queued behind us, hand the lock directly to them.
+ * If nobody appears to be, try to swing the tail back to NULL; if
+ * that fails, a new waiter is in the middle of linking in, so wait
+ * for it to finish and then hand over.
  */
 void
 spinlock_release(struct spinlock *lk)
 {
+	struct spinlock_qnode *node;
+
 	/* this must work before curcpu initialization */
 	if (CURCPU_EXISTS()) {
 		KASSERT(lk->lk_holder == curcpu->c_self);
 	}
 
+	node = lk->lk_node;
+	KASSERT(node != NULL);
+	lk->lk_node = NULL;
 	lk->lk_holder = NULL;
-	spinlock_data_set(&lk->lk_lock, 0);
+
+	if (node->sq_next == NULL) {
+		if (spinlock_ptr_cas((void *volatile *)&lk->lk_tail,
+				     node, NULL)) {
+			goto done;
+		}
+		while (node->sq_next == NULL) {
+			/* spin */
+		}
+	}
+	node->sq_next->sq_waiting = false;
+
+ done:
+	spinlock_qnode_put(node);
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
@@ -139,3 +308,60 @@ spinlock_do_i_hold(struct spinlock *lk)
 	/* Assume we can read lk_holder atomically enough for this to work */
 	return (lk->lk_holder == curcpu->c_self);
 }
+
+/*
+ * Print the N contended spinlocks with the most total spin cycles.
+ * The numbers are read without the locks themselves, so they may be
+ * slightly stale, but that's good enough for this.
+ */
+void
+spinlock_printstats(unsigned n)
+{
+	struct {
+		struct spinlock *lk;
+		const void *site;
+		unsigned acquires;
+		unsigned contended;
+		uint64_t spincycles;
+	} top[SPINLOCK_MAXSTATS];
+	struct spinlock *lk;
+	unsigned num, i, j;
+
+	if (n > SPINLOCK_MAXSTATS) {
+		n = SPINLOCK_MAXSTATS;
+	}
+
+	/* Insertion sort into top[], keeping only the first n. */
+	num = 0;
+	splraise(IPL_NONE, IPL_HIGH);
+	spinlock_statlist_lock_acquire();
+	for (lk = spinlock_statlist; lk != NULL; lk = lk->lk_statnext) {
+		for (i=num; i>0 && top[i-1].spincycles < lk->lk_spincycles;
+		     i--) {
+			if (i < n) {
+				top[i] = top[i-1];
+			}
+		}
+		if (i < n) {
+			top[i].lk = lk;
+			top[i].site = lk->lk_site;
+			top[i].acquires = lk->lk_acquires;
+			top[i].contended = lk->lk_contended;
+			top[i].spincycles = lk->lk_spincycles;
+			if (num < n) {
+				num++;
+			}
+		}
+	}
+	spinlock_statlist_lock_release();
+	spllower(IPL_HIGH, IPL_NONE);
+
+	kprintf("%-10s %-10s %10s %10s %14s\n",
+		"lock", "site", "acquires", "contended", "spin cycles");
+	for (j=0; j<num; j++) {
+		kprintf("%-10p %-10p %10u %10u %14llu\n",
+			top[j].lk, top[j].site,
+			top[j].acquires, top[j].contended,
+			(unsigned long long) top[j].spincycles);
+	}
+}
@@ -38,6 +38,7 @@
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
+#include <cpu.h>
 #include <synch.h>
 
 ////////////////////////////////////////////////////////////
@@ -147,6 +148,201 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+#if OPT_LOCKPROF
+
+/* Most locks lockprof_printstats will list */
+#define LOCKPROF_MAXSTATS 32
+
+/* All locks, for lockprof_printstats and lockprof_reset */
+static struct lock *lockprof_list;
+static struct spinlock lockprof_listlock = SPINLOCK_INITIALIZER;
+
+static
+void
+lockprof_zero(struct lockprof *lp)
+{
+        lp->lp_acquires = 0;
+        lp->lp_contended = 0;
+        lp->lp_cvwaits = 0;
+        lp->lp_waitcycles = 0;
+        lp->lp_maxwait = 0;
+        lp->lp_holdcycles = 0;
+        lp->lp_maxhold = 0;
+}
+
+static
+void
+lockprof_init(struct lock *lock)
+{
+        struct lockprof *lp = &lock->lk_prof;
+
+        lockprof_zero(lp);
+        lp->lp_acquiredat = 0;
+
+        spinlock_acquire(&lockprof_listlock);
+        lp->lp_next = lockprof_list;
+        if (lockprof_list != NULL) {
+                lockprof_list->lk_prof.lp_prev = &lp->lp_next;
+        }
+        lockprof_list = lock;
+        lp->lp_prev = &lockprof_list;
+        spinlock_release(&lockprof_listlock);
+}
+
+static
+void
+lockprof_cleanup(struct lock *lock)
+{
+        struct lockprof *lp = &lock->lk_prof;
+
+        spinlock_acquire(&lockprof_listlock);
+        *lp->lp_prev = lp->lp_next;
+        if (lp->lp_next != NULL) {
+                lp->lp_next->lk_prof.lp_prev = lp->lp_prev;
+        }
+        spinlock_release(&lockprof_listlock);
+}
+
+/*
+ * Record an acquisition. START is when lock_acquire was called.
+ * Called by the new holder.
+ */
+static
+void
+lockprof_acquired(struct lock *lock, uint32_t start, bool contended)
+{
+        struct lockprof *lp = &lock->lk_prof;
+        uint32_t now, wait;
+
+        now = cpu_cycles();
+        wait = now - start;
+
+        lp->lp_acquires++;
+        if (contended) {
+                lp->lp_contended++;
+        }
+        lp->lp_waitcycles += wait;
+        if (wait > lp->lp_maxwait) {
+                lp->lp_maxwait = wait;
+        }
+        lp->lp_acquiredat = now;
+}
+
+/*
+ * Record a release. Called by the holder.
+ */
+static
+void
+lockprof_released(struct lock *lock)
+{
+        struct lockprof *lp = &lock->lk_prof;
+        uint32_t hold;
+
+        hold = cpu_cycles() - lp->lp_acquiredat;
+        lp->lp_holdcycles += hold;
+        if (hold > lp->lp_maxhold) {
+                lp->lp_maxhold = hold;
+        }
+}
+
+/*
+ * Copies of the statistics being printed. Too big for the stack, so
+ * static; lockprof_printing (under lockprof_listlock) says someone is
+ * using them.
+ */
+struct lockprof_copy {
+        char name[24];
+        struct lockprof prof;
+};
+static struct lockprof_copy lockprof_top[LOCKPROF_MAXSTATS];
+static bool lockprof_printing;
+
+/*
+ * Print the N locks with the most total wait time. The numbers are
+ * read without each lock's own spinlock, so they may be slightly
+ * stale.
+ */
+void
+lockprof_printstats(unsigned n)
+{
+        struct lockprof_copy *top = lockprof_top;
+        struct lock *lock;
+        unsigned num, i, j;
+
+        if (n > LOCKPROF_MAXSTATS) {
+                n = LOCKPROF_MAXSTATS;
+        }
+
+        spinlock_acquire(&lockprof_listlock);
+        if (lockprof_printing) {
+                spinlock_release(&lockprof_listlock);
+                kprintf("lockprof: Already printing\n");
+                return;
+        }
+        lockprof_printing = true;
+
+        /* Insertion sort into top[], keeping only the first n. */
+        num = 0;
+        for (lock = lockprof_list; lock != NULL;
+             lock = lock->lk_prof.lp_next) {
+                if (lock->lk_prof.lp_acquires == 0) {
+                        continue;
+                }
+                for (i=num; i>0 && top[i-1].prof.lp_waitcycles <
+                             lock->lk_prof.lp_waitcycles; i--) {
+                        if (i < n) {
+                                top[i] = top[i-1];
+                        }
+                }
+                if (i < n) {
+                        snprintf(top[i].name, sizeof(top[i].name), "%s",
+                                 lock->lk_name);
+                        top[i].prof = lock->lk_prof;
+                        if (num < n) {
+                                num++;
+                        }
+                }
+        }
+        spinlock_release(&lockprof_listlock);
+
+        kprintf("%-16s %8s %8s %6s %12s %10s %12s %10s\n",
+                "lock", "acquire", "contend", "cvwait",
+                "wait cycles", "max wait", "hold cycles", "max hold");
+        for (j=0; j<num; j++) {
+                kprintf("%-16s %8u %8u %6u %12llu %10u %12llu %10u\n",
+                        top[j].name,
+                        top[j].prof.lp_acquires,
+                        top[j].prof.lp_contended,
+                        top[j].prof.lp_cvwaits,
+                        (unsigned long long) top[j].prof.lp_waitcycles,
+                        top[j].prof.lp_maxwait,
+                        (unsigned long long) top[j].prof.lp_holdcycles,
+                        top[j].prof.lp_maxhold);
+        }
+
+        spinlock_acquire(&lockprof_listlock);
+        lockprof_printing = false;
+        spinlock_release(&lockprof_listlock);
+}
+
+/*
+ * Zero the statistics of every lock.
+ */
+void
+lockprof_reset(void)
+{
+        struct lock *lock;
+
+        spinlock_acquire(&lockprof_listlock);
+        for (lock = lockprof_list; lock != NULL;
+             lock = lock->lk_prof.lp_next) {
+                lockprof_zero(&lock->lk_prof);
+        }
+        spinlock_release(&lockprof_listlock);
+}
+
+#endif /* OPT_LOCKPROF */
+
 struct lock *
 lock_create(const char *name)
 {
@@ -175,6 +371,9 @@ lock_create(const char *name)
     spinlock_init(&lock->spin_lock);
     lock->lk_holder = NULL;
     lock->lock_count = 1;
+#if OPT_LOCKPROF
+    lockprof_init(lock);
+#endif
     
     return lock;
 }
@@ -185,6 +384,9 @@ lock_destroy(struct lock *lock)
         KASSERT(lock != NULL);
 
         // add stuff here as needed
+#if OPT_LOCKPROF
+    lockprof_cleanup(lock);
+#endif
     spinlock_cleanup(&lock->spin_lock);
     wchan_destroy(lock->lock_wchan);
     kfree(lock->lk_holder);
@@ -196,12 +398,20 @@ lock_destroy(struct lock *lock)
 void
 lock_acquire(struct lock *lock)
 {
+#if OPT_LOCKPROF
+    uint32_t start = cpu_cycles();
+    bool contended = false;
+#endif
+
         // Write this
     KASSERT(lock != NULL);
     KASSERT(curthread->t_in_interrupt == false);
 
     spinlock_acquire(&lock->spin_lock);
     while (lock->lock_count == 0) {
+#if OPT_LOCKPROF
+        contended = true;
+#endif
 
         wchan_lock(lock->lock_wchan);
         spinlock_release(&lock->spin_lock);
@@ -212,6 +422,9 @@ lock_acquire(struct lock *lock)
     KASSERT(lock->lock_count > 0);
     lock->lock_count--;
     lock->lk_holder = curthread;
+#if OPT_LOCKPROF
+    lockprof_acquired(lock, start, contended);
+#endif
     spinlock_release(&lock->spin_lock);
         
         //(void)lock;  // suppress warning until code gets written
@@ -225,6 +438,9 @@ lock_release(struct lock *lock)
     KASSERT(lock->lk_holder == curthread);
 
     spinlock_acquire(&lock->spin_lock);
+#if OPT_LOCKPROF
+    lockprof_released(lock);
+#endif
     lock->lock_count++;
     KASSERT(lock->lock_count > 0);
     lock->lk_holder = NULL;
@@ -291,6 +507,9 @@ cv_wait(struct cv *cv, struct lock *lock)
 {
         // Write this
     KASSERT(lock->lk_holder == curthread);
+#if OPT_LOCKPROF
+    lock->lk_prof.lp_cvwaits++;
+#endif
     wchan_lock(cv->cv_wchan);
     lock_release(lock);
     wchan_sleep(cv->cv_wchan);
@@ -318,3 +537,227 @@ cv_broadcast(struct cv *cv, struct lock *lock)
     //(void)cv;    // suppress warning until code gets written
     //(void)lock;  // suppress warning until code gets written
 }
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rw;
+
+	rw = kmalloc(sizeof(struct rwlock));
+	if (rw == NULL) {
+		return NULL;
+	}
+
+	rw->rw_name = kstrdup(name);
+	if (rw->rw_name == NULL) {
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_readwchan = wchan_create(rw->rw_name);
+	if (rw->rw_readwchan == NULL) {
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_writewchan = wchan_create(rw->rw_name);
+	if (rw->rw_writewchan == NULL) {
+		wchan_destroy(rw->rw_readwchan);
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_upgradewchan = wchan_create(rw->rw_name);
+	if (rw->rw_upgradewchan == NULL) {
+		wchan_destroy(rw->rw_writewchan);
+		wchan_destroy(rw->rw_readwchan);
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	spinlock_init(&rw->rw_lock);
+	rw->rw_readers = 0;
+	rw->rw_writerswaiting = 0;
+	rw->rw_writer = NULL;
+	rw->rw_upgrader = NULL;
+
+	return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(rw->rw_readers == 0);
+	KASSERT(rw->rw_writer == NULL);
+
+	/* wchan_cleanup will assert if anyone's waiting on it */
+	spinlock_cleanup(&rw->rw_lock);
+	wchan_destroy(rw->rw_upgradewchan);
+	wchan_destroy(rw->rw_writewchan);
+	wchan_destroy(rw->rw_readwchan);
+	kfree(rw->rw_name);
+	kfree(rw);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(rw->rw_writer != curthread);
+
+	spinlock_acquire(&rw->rw_lock);
+	/*
+	 * Writer preference: wait not only while a writer holds the
+	 * lock but also while one is waiting or a reader is trying to
+	 * upgrade.
+	 */
+	while (rw->rw_writer != NULL || rw->rw_writerswaiting > 0 ||
+	       rw->rw_upgrader != NULL) {
+		wchan_lock(rw->rw_readwchan);
+		spinlock_release(&rw->rw_lock);
+		wchan_sleep(rw->rw_readwchan);
+		spinlock_acquire(&rw->rw_lock);
+	}
+	rw->rw_readers++;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_readers > 0);
+	KASSERT(rw->rw_writer == NULL);
+	rw->rw_readers--;
+	if (rw->rw_upgrader != NULL) {
+		/* The upgrader is waiting to be the only reader left. */
+		if (rw->rw_readers == 1) {
+			wchan_wakeone(rw->rw_upgradewchan);
+		}
+	}
+	else if (rw->rw_readers == 0) {
+		wchan_wakeone(rw->rw_writewchan);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(rw->rw_writer != curthread);
+
+	spinlock_acquire(&rw->rw_lock);
+	rw->rw_writerswaiting++;
+	while (rw->rw_writer != NULL || rw->rw_readers > 0) {
+		wchan_lock(rw->rw_writewchan);
+		spinlock_release(&rw->rw_lock);
+		wchan_sleep(rw->rw_writewchan);
+		spinlock_acquire(&rw->rw_lock);
+	}
+	rw->rw_writerswaiting--;
+	rw->rw_writer = curthread;
+	spinlock_release(&rw->rw_lock);
+}
+
+/*
+ * Wake whoever should go next once the lock has no writer. Waiting
+ * writers go first; if there are none, let all the readers in.
+ * Call with rw_lock held.
+ */
+static
+void
+rwlock_wakeup(struct rwlock *rw)
+{
+	KASSERT(spinlock_do_i_hold(&rw->rw_lock));
+
+	if (rw->rw_writerswaiting > 0) {
+		if (rw->rw_readers == 0) {
+			wchan_wakeone(rw->rw_writewchan);
+		}
+	}
+	else {
+		wchan_wakeall(rw->rw_readwchan);
+	}
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer == curthread);
+	KASSERT(rw->rw_readers == 0);
+	rw->rw_writer = NULL;
+	rwlock_wakeup(rw);
+	spinlock_release(&rw->rw_lock);
+}
+
+bool
+rwlock_upgrade(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_readers > 0);
+	KASSERT(rw->rw_writer == NULL);
+	if (rw->rw_upgrader != NULL) {
+		/* Two upgraders would wait for each other forever. */
+		spinlock_release(&rw->rw_lock);
+		return false;
+	}
+
+	/*
+	 * Keep our read hold while waiting, so no writer can get in
+	 * ahead of us; new readers are held off by rw_upgrader.
+	 */
+	rw->rw_upgrader = curthread;
+	while (rw->rw_readers > 1) {
+		wchan_lock(rw->rw_upgradewchan);
+		spinlock_release(&rw->rw_lock);
+		wchan_sleep(rw->rw_upgradewchan);
+		spinlock_acquire(&rw->rw_lock);
+	}
+	rw->rw_upgrader = NULL;
+	rw->rw_readers = 0;
+	rw->rw_writer = curthread;
+	spinlock_release(&rw->rw_lock);
+	return true;
+}
+
+void
+rwlock_downgrade(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer == curthread);
+	KASSERT(rw->rw_readers == 0);
+	rw->rw_writer = NULL;
+	rw->rw_readers = 1;
+	/* Readers may come in alongside us, unless a writer is waiting. */
+	if (rw->rw_writerswaiting == 0) {
+		wchan_wakeall(rw->rw_readwchan);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rw)
+{
+	return (rw->rw_writer == curthread);
+}
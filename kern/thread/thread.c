@@ -48,6 +48,7 @@
 #include <current.h>
 #include <synch.h>
 #include <addrspace.h>
+#include <vm.h>
 #include <mainbus.h>
 #include <vnode.h>
 
@@ -57,6 +58,9 @@
 /* Magic number used as a guard value on kernel thread stacks. */
 #define THREAD_STACK_MAGIC 0xbaadf00d
 
+/* Most exited threads (with stacks) kept for reuse on each cpu. */
+#define THREAD_CACHE_MAX 8
+
 /* Wait channel. */
 struct wchan {
 	const char *wc_name;		/* name for this channel */
@@ -111,6 +115,32 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/*
+ * (Re)initialize the fields of a thread that has no context yet. This
+ * is shared by thread_create and the thread cache; it does not touch
+ * t_name, t_stack, t_machdep, or t_listnode.
+ */
+static
+void
+thread_reset(struct thread *thread)
+{
+	thread->t_wchan_name = "NEW";
+	thread->t_state = S_READY;
+
+	/* Thread subsystem fields */
+	thread->t_context = NULL;
+	thread->t_cpu = NULL;
+	thread->t_proc = NULL;
+	thread->t_pinned = false;
+
+	/* Interrupt state fields */
+	thread->t_in_interrupt = false;
+	thread->t_curspl = IPL_HIGH;
+	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
+
+	/* If you add to struct thread, be sure to initialize here */
+}
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
@@ -133,23 +163,10 @@ thread_create(const char *name)
 		kfree(thread);
 		return NULL;
 	}
-	thread->t_wchan_name = "NEW";
-	thread->t_state = S_READY;
-
-	/* Thread subsystem fields */
+	thread->t_stack = NULL;
 	thread_machdep_init(&thread->t_machdep);
 	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
-	thread->t_context = NULL;
-	thread->t_cpu = NULL;
-	thread->t_proc = NULL;
-
-	/* Interrupt state fields */
-	thread->t_in_interrupt = false;
-	thread->t_curspl = IPL_HIGH;
-	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
-
-	/* If you add to struct thread, be sure to initialize here */
+	thread_reset(thread);
 
 	return thread;
 }
@@ -179,7 +196,10 @@ cpu_create(unsigned hardware_number)
 
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
+	threadlist_init(&c->c_threadcache);
+	spinlock_init(&c->c_threadcache_lock);
 	c->c_hardclocks = 0;
+	c->c_spinnodes_used = 0;
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
@@ -262,9 +282,190 @@ thread_destroy(struct thread *thread)
 	kfree(thread);
 }
 
+/*
+ * Thread cache.
+ *
+ * Rather than freeing every exited thread, exorcise() keeps up to
+ * THREAD_CACHE_MAX of them per cpu, complete with their stacks and
+ * stack guard bands, so thread_fork doesn't have to go to kmalloc
+ * for a new STACK_SIZE stack every time. Only the name is discarded.
+ * When thread_fork finds the cache empty and memory is plentiful, it
+ * refills it with a few extra threads, so a burst of forks mostly
+ * doesn't have to allocate one at a time.
+ *
+ * When free memory falls below THREAD_CACHE_LOWWATER pages, exited
+ * threads are freed rather than cached, and the caches on all cpus
+ * are emptied. But that's only worth doing if the VM system can reuse
+ * freed pages; dumbvm can't (free_kpages leaks), so there the caches
+ * keep their stacks, which at least get used again.
+ *
+ * Each cpu's cache is protected by its own c_threadcache_lock, so
+ * that another cpu can trim it.
+ */
+
+/* Pages of free memory below which cached threads are given back */
+#define THREAD_CACHE_LOWWATER 16
+
+/* Pages of free memory above which the cache is refilled */
+#define THREAD_CACHE_HIGHWATER 64
+
+/* Extra threads made when refilling */
+#define THREAD_CACHE_REFILL 2
+
+/*
+ * Return true if memory is short and freeing cached threads would
+ * help.
+ */
+static
+bool
+thread_cache_lowmem(void)
+{
+	return vm_kpages_reusable() &&
+		vm_freepages() < THREAD_CACHE_LOWWATER;
+}
+
+/*
+ * Empty the thread caches of all cpus.
+ */
+static
+void
+thread_cache_trim(void)
+{
+	struct threadlist victims;
+	struct thread *thread;
+	struct cpu *c;
+	unsigned i, num;
+
+	threadlist_init(&victims);
+	num = cpuarray_num(&allcpus);
+	for (i=0; i<num; i++) {
+		c = cpuarray_get(&allcpus, i);
+		spinlock_acquire(&c->c_threadcache_lock);
+		while ((thread = threadlist_remhead(&c->c_threadcache))
+		       != NULL) {
+			threadlist_addtail(&victims, thread);
+		}
+		spinlock_release(&c->c_threadcache_lock);
+	}
+
+	while ((thread = threadlist_remhead(&victims)) != NULL) {
+		thread_destroy(thread);
+	}
+	threadlist_cleanup(&victims);
+}
+
+/*
+ * Make a thread with a stack, for thread_fork or for the cache.
+ */
+static
+struct thread *
+thread_cache_new(const char *name)
+{
+	struct thread *thread;
+
+	thread = thread_create(name);
+	if (thread == NULL) {
+		return NULL;
+	}
+
+	thread->t_stack = kmalloc(STACK_SIZE);
+	if (thread->t_stack == NULL) {
+		thread_destroy(thread);
+		return NULL;
+	}
+	thread_checkstack_init(thread);
+	return thread;
+}
+
+/*
+ * Put a dead (or new) thread into the current cpu's cache, or destroy
+ * it if it can't be cached.
+ */
+static
+void
+thread_cache_put(struct thread *thread)
+{
+	struct cpu *c;
+
+	if (thread->t_stack == NULL || thread_cache_lowmem()) {
+		thread_destroy(thread);
+		return;
+	}
+
+	/* The stack is about to be reused; make sure it's still sane. */
+	thread_checkstack(thread);
+	KASSERT(thread->t_proc == NULL);
+
+	kfree(thread->t_name);
+	thread->t_name = NULL;
+	thread->t_wchan_name = "CACHED";
+
+	c = curcpu;
+	spinlock_acquire(&c->c_threadcache_lock);
+	if (c->c_threadcache.tl_count < THREAD_CACHE_MAX) {
+		threadlist_addhead(&c->c_threadcache, thread);
+		thread = NULL;
+	}
+	spinlock_release(&c->c_threadcache_lock);
+
+	if (thread != NULL) {
+		thread_destroy(thread);
+	}
+}
+
+/*
+ * Get a thread, with stack, ready for thread_fork to set up. Uses a
+ * cached thread if this cpu has one; otherwise makes a new one, and
+ * refills the cache if there's memory to spare.
+ */
+static
+struct thread *
+thread_cache_get(const char *name)
+{
+	struct thread *thread, *extra;
+	struct cpu *c;
+	unsigned i;
+
+	/*
+	 * If we migrate after reading curcpu we just use the other
+	 * cpu's cache; the lock makes that safe.
+	 */
+	c = curcpu;
+	spinlock_acquire(&c->c_threadcache_lock);
+	thread = threadlist_remhead(&c->c_threadcache);
+	spinlock_release(&c->c_threadcache_lock);
+
+	if (thread == NULL) {
+		thread = thread_cache_new(name);
+		if (thread == NULL) {
+			return NULL;
+		}
+
+		for (i=0; i<THREAD_CACHE_REFILL &&
+			     vm_freepages() > THREAD_CACHE_HIGHWATER; i++) {
+			extra = thread_cache_new("cached");
+			if (extra == NULL) {
+				break;
+			}
+			thread_cache_put(extra);
+		}
+		return thread;
+	}
+
+	thread_reset(thread);
+	thread_checkstack_init(thread);
+	thread->t_name = kstrdup(name);
+	if (thread->t_name == NULL) {
+		thread_destroy(thread);
+		return NULL;
+	}
+	return thread;
+}
+
 /*
  * Clean up zombies. (Zombies are threads that have exited but still
- * need to have thread_destroy called on them.)
+ * need to have thread_destroy called on them.) Zombies with stacks
+ * go into the thread cache when there's room.
  *
  * The list of zombies is per-cpu.
  */
@@ -277,7 +478,11 @@ exorcise(void)
 	while ((z = threadlist_remhead(&curcpu->c_zombies)) != NULL) {
 		KASSERT(z != curthread);
 		KASSERT(z->t_state == S_ZOMBIE);
-		thread_destroy(z);
+		thread_cache_put(z);
+	}
+
+	if (thread_cache_lowmem()) {
+		thread_cache_trim();
 	}
 }
 
@@ -465,20 +670,16 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 }
 
 /*
- * Create a new thread based on an existing one.
- *
- * The new thread has name NAME, and starts executing in function
- * ENTRYPOINT. DATA1 and DATA2 are passed to ENTRYPOINT.
- *
- * The new thread is created in the process P. If P is null, the
- * process is inherited from the caller. It will start on the same CPU
- * as the caller, unless the scheduler intervenes first.
+ * Common code for thread_fork and thread_fork_oncpu: create a new
+ * thread that will run on cpu C, and never leave it if PINNED is set.
  */
+static
 int
-thread_fork(const char *name,
-	    struct proc *proc,
-	    void (*entrypoint)(void *data1, unsigned long data2),
-	    void *data1, unsigned long data2)
+thread_dofork(const char *name,
+	      struct proc *proc,
+	      struct cpu *c, bool pinned,
+	      void (*entrypoint)(void *data1, unsigned long data2),
+	      void *data1, unsigned long data2)
 {
 	struct thread *newthread;
 	int result;
@@ -487,25 +688,19 @@ thread_fork(const char *name,
 	DEBUG(DB_THREADS,"Forking thread: %s\n",name);
 #endif // UW
 
-	newthread = thread_create(name);
+	/* Get a thread with a stack, from the cache if possible */
+	newthread = thread_cache_get(name);
 	if (newthread == NULL) {
 		return ENOMEM;
 	}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
-	}
-	thread_checkstack_init(newthread);
-
 	/*
 	 * Now we clone various fields from the parent thread.
 	 */
 
 	/* Thread subsystem fields */
-	newthread->t_cpu = curthread->t_cpu;
+	newthread->t_cpu = c;
+	newthread->t_pinned = pinned;
 
 	/* Attach the new thread to its process */
 	if (proc == NULL) {
@@ -528,12 +723,59 @@ thread_fork(const char *name,
 	/* Set up the switchframe so entrypoint() gets called */
 	switchframe_init(newthread, entrypoint, data1, data2);
 
-	/* Lock the current cpu's run queue and make the new thread runnable */
+	/* Lock the target cpu's run queue and make the new thread runnable */
 	thread_make_runnable(newthread, false);
 
 	return 0;
 }
 
+/*
+ * Create a new thread based on an existing one.
+ *
+ * The new thread has name NAME, and starts executing in function
+ * ENTRYPOINT. DATA1 and DATA2 are passed to ENTRYPOINT.
+ *
+ * The new thread is created in the process P. If P is null, the
+ * process is inherited from the caller. It will start on the same CPU
+ * as the caller, unless the scheduler intervenes first.
+ */
+int
+thread_fork(const char *name,
+	    struct proc *proc,
+	    void (*entrypoint)(void *data1, unsigned long data2),
+	    void *data1, unsigned long data2)
+{
+	return thread_dofork(name, proc, curthread->t_cpu, false,
+			     entrypoint, data1, data2);
+}
+
+/*
+ * Like thread_fork, but the new thread runs on cpu number CPUNUM and
+ * is never migrated away from it.
+ */
+int
+thread_fork_oncpu(const char *name,
+		  struct proc *proc,
+		  unsigned cpunum,
+		  void (*entrypoint)(void *data1, unsigned long data2),
+		  void *data1, unsigned long data2)
+{
+	struct cpu *c;
+
+	KASSERT(cpunum < cpuarray_num(&allcpus));
+	c = cpuarray_get(&allcpus, cpunum);
+	return thread_dofork(name, proc, c, true, entrypoint, data1, data2);
+}
+
+/*
+ * Return the number of cpus.
+ */
+unsigned
+thread_numcpus(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
 /*
  * High level, machine-independent context switch code.
  *
@@ -916,8 +1158,10 @@ thread_consider_migration(void)
 			 * the list and decrement to_send in order to
 			 * skip it. Then it goes back on our own run
 			 * queue below.
+			 *
+			 * Pinned threads stay put the same way.
 			 */
-			if (t == curthread) {
+			if (t == curthread || t->t_pinned) {
 				threadlist_addtail(&victims, t);
 				to_send--;
 				continue;
@@ -0,0 +1,438 @@
+/*
+ * Kernel work queues. See workqueue.h for the interface.
+ *
+ * Each workqueue has a struct wq_cpu per cpu, holding that cpu's
+ * queue of ready work, its list of delayed work (sorted by due time),
+ * and the wait channel its worker thread sleeps on. The worker is
+ * pinned to its cpu, so work added on a cpu runs there.
+ *
+ * The worker takes everything on its ready queue in one go and runs
+ * the whole batch without holding the queue lock, so a burst of work
+ * costs one lock round trip rather than one per item.
+ *
+ * Delayed work is moved to the ready queue by workqueue_hardclock,
+ * which runs on each cpu from hardclock() and so uses that cpu's
+ * c_hardclocks as its clock.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <thread.h>
+#include <current.h>
+#include <proc.h>
+#include <synch.h>
+#include <workqueue.h>
+
+struct wq_cpu {
+	struct workqueue *wc_wq;	/* workqueue we belong to */
+	struct spinlock wc_lock;	/* protects the fields below */
+	struct wchan *wc_wchan;		/* worker sleeps here */
+	struct work *wc_head;		/* ready work */
+	struct work *wc_tail;
+	unsigned wc_nready;		/* # of ready items */
+	struct work *wc_delayed;	/* delayed work, soonest first */
+	unsigned wc_depth;		/* # of ready and delayed items */
+	bool wc_dying;			/* worker should exit when idle */
+};
+
+struct workqueue {
+	char *wq_name;
+	unsigned wq_maxdepth;		/* most items on one cpu's queue */
+	unsigned wq_numcpus;
+	struct wq_cpu *wq_cpus;		/* one per cpu */
+	struct semaphore *wq_exitsem;	/* V'd by each exiting worker */
+	struct workqueue *wq_next;	/* on list of all workqueues */
+};
+
+/* All workqueues, for workqueue_hardclock. */
+static struct workqueue *allworkqueues;
+static struct spinlock allworkqueues_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Set up a work item.
+ */
+void
+work_init(struct work *wk,
+	  void (*func)(void *data1, unsigned long data2),
+	  void *data1, unsigned long data2)
+{
+	wk->wk_func = func;
+	wk->wk_data1 = data1;
+	wk->wk_data2 = data2;
+	wk->wk_owner = NULL;
+	wk->wk_next = NULL;
+	wk->wk_due = 0;
+}
+
+/*
+ * Put work on the end of the ready queue and wake the worker.
+ * Call with wc_lock held.
+ */
+static
+void
+wq_cpu_makeready(struct wq_cpu *wc, struct work *wk)
+{
+	KASSERT(spinlock_do_i_hold(&wc->wc_lock));
+
+	wk->wk_next = NULL;
+	if (wc->wc_tail == NULL) {
+		wc->wc_head = wk;
+	}
+	else {
+		wc->wc_tail->wk_next = wk;
+	}
+	wc->wc_tail = wk;
+	wc->wc_nready++;
+	wchan_wakeone(wc->wc_wchan);
+}
+
+/*
+ * Worker thread: run batches of ready work until told to exit.
+ */
+static
+void
+workqueue_worker(void *data1, unsigned long data2)
+{
+	struct wq_cpu *wc = data1;
+	struct work *batch, *wk, *next;
+	void (*func)(void *, unsigned long);
+	void *arg1;
+	unsigned long arg2;
+
+	(void)data2;
+
+	while (1) {
+		spinlock_acquire(&wc->wc_lock);
+		while (wc->wc_head == NULL && !wc->wc_dying) {
+			wchan_lock(wc->wc_wchan);
+			spinlock_release(&wc->wc_lock);
+			wchan_sleep(wc->wc_wchan);
+			spinlock_acquire(&wc->wc_lock);
+		}
+		if (wc->wc_head == NULL) {
+			/* Dying, and nothing left to do. */
+			spinlock_release(&wc->wc_lock);
+			break;
+		}
+
+		/* Take the whole ready queue as one batch. */
+		batch = wc->wc_head;
+		wc->wc_head = wc->wc_tail = NULL;
+		KASSERT(wc->wc_depth >= wc->wc_nready);
+		wc->wc_depth -= wc->wc_nready;
+		wc->wc_nready = 0;
+		spinlock_release(&wc->wc_lock);
+
+		for (wk = batch; wk != NULL; wk = next) {
+			/*
+			 * Once wk_owner is cleared the item can be
+			 * added again (possibly on another cpu), which
+			 * rewrites wk_next; so collect everything we
+			 * need from it first.
+			 */
+			next = wk->wk_next;
+			func = wk->wk_func;
+			arg1 = wk->wk_data1;
+			arg2 = wk->wk_data2;
+			wk->wk_owner = NULL;
+
+			func(arg1, arg2);
+		}
+	}
+
+	V(wc->wc_wq->wq_exitsem);
+}
+
+/*
+ * Tell the first NUM workers to exit, wait for them, and free WQ.
+ */
+static
+void
+workqueue_shutdown(struct workqueue *wq, unsigned num)
+{
+	struct wq_cpu *wc;
+	unsigned i;
+
+	for (i=0; i<num; i++) {
+		wc = &wq->wq_cpus[i];
+		spinlock_acquire(&wc->wc_lock);
+		KASSERT(wc->wc_delayed == NULL);
+		wc->wc_dying = true;
+		wchan_wakeall(wc->wc_wchan);
+		spinlock_release(&wc->wc_lock);
+	}
+	for (i=0; i<num; i++) {
+		P(wq->wq_exitsem);
+	}
+
+	for (i=0; i<wq->wq_numcpus; i++) {
+		wc = &wq->wq_cpus[i];
+		KASSERT(wc->wc_head == NULL);
+		KASSERT(wc->wc_depth == 0);
+		spinlock_cleanup(&wc->wc_lock);
+		wchan_destroy(wc->wc_wchan);
+	}
+	sem_destroy(wq->wq_exitsem);
+	kfree(wq->wq_cpus);
+	kfree(wq->wq_name);
+	kfree(wq);
+}
+
+/*
+ * Create a workqueue and start its worker threads.
+ */
+struct workqueue *
+workqueue_create(const char *name, unsigned maxdepth)
+{
+	struct workqueue *wq;
+	struct wq_cpu *wc;
+	unsigned i, j;
+	int result;
+
+	KASSERT(maxdepth > 0);
+
+	wq = kmalloc(sizeof(*wq));
+	if (wq == NULL) {
+		return NULL;
+	}
+	wq->wq_name = kstrdup(name);
+	if (wq->wq_name == NULL) {
+		kfree(wq);
+		return NULL;
+	}
+	wq->wq_maxdepth = maxdepth;
+	wq->wq_numcpus = thread_numcpus();
+	wq->wq_cpus = kmalloc(wq->wq_numcpus * sizeof(struct wq_cpu));
+	if (wq->wq_cpus == NULL) {
+		kfree(wq->wq_name);
+		kfree(wq);
+		return NULL;
+	}
+	wq->wq_exitsem = sem_create(wq->wq_name, 0);
+	if (wq->wq_exitsem == NULL) {
+		kfree(wq->wq_cpus);
+		kfree(wq->wq_name);
+		kfree(wq);
+		return NULL;
+	}
+
+	for (i=0; i<wq->wq_numcpus; i++) {
+		wc = &wq->wq_cpus[i];
+		wc->wc_wq = wq;
+		wc->wc_wchan = wchan_create(wq->wq_name);
+		if (wc->wc_wchan == NULL) {
+			for (j=0; j<i; j++) {
+				spinlock_cleanup(&wq->wq_cpus[j].wc_lock);
+				wchan_destroy(wq->wq_cpus[j].wc_wchan);
+			}
+			sem_destroy(wq->wq_exitsem);
+			kfree(wq->wq_cpus);
+			kfree(wq->wq_name);
+			kfree(wq);
+			return NULL;
+		}
+		spinlock_init(&wc->wc_lock);
+		wc->wc_head = wc->wc_tail = NULL;
+		wc->wc_nready = 0;
+		wc->wc_delayed = NULL;
+		wc->wc_depth = 0;
+		wc->wc_dying = false;
+	}
+
+	for (i=0; i<wq->wq_numcpus; i++) {
+		result = thread_fork_oncpu(wq->wq_name, kproc, i,
+					   workqueue_worker,
+					   &wq->wq_cpus[i], 0);
+		if (result) {
+			workqueue_shutdown(wq, i);
+			return NULL;
+		}
+	}
+
+	spinlock_acquire(&allworkqueues_lock);
+	wq->wq_next = allworkqueues;
+	allworkqueues = wq;
+	spinlock_release(&allworkqueues_lock);
+
+	return wq;
+}
+
+/*
+ * Destroy a workqueue.
+ */
+void
+workqueue_destroy(struct workqueue *wq)
+{
+	struct workqueue **p;
+
+	spinlock_acquire(&allworkqueues_lock);
+	for (p = &allworkqueues; *p != wq; p = &(*p)->wq_next) {
+		KASSERT(*p != NULL);
+	}
+	*p = wq->wq_next;
+	spinlock_release(&allworkqueues_lock);
+
+	workqueue_shutdown(wq, wq->wq_numcpus);
+}
+
+/*
+ * Common code for workqueue_add and workqueue_add_delayed.
+ */
+static
+int
+workqueue_doadd(struct workqueue *wq, struct work *wk,
+		bool delayed, unsigned ticks)
+{
+	struct wq_cpu *wc;
+	struct work **pp;
+	int spl;
+
+	/* Stay on this cpu while choosing its queue. */
+	spl = splhigh();
+	wc = &wq->wq_cpus[curcpu->c_number];
+
+	/* Claim the item; if someone else has it, it's already pending. */
+	if (!spinlock_ptr_cas(&wk->wk_owner, NULL, wc)) {
+		splx(spl);
+		return 0;
+	}
+
+	spinlock_acquire(&wc->wc_lock);
+	KASSERT(!wc->wc_dying);
+	if (wc->wc_depth >= wq->wq_maxdepth) {
+		spinlock_release(&wc->wc_lock);
+		wk->wk_owner = NULL;
+		splx(spl);
+		return EAGAIN;
+	}
+	wc->wc_depth++;
+
+	if (!delayed) {
+		wq_cpu_makeready(wc, wk);
+	}
+	else {
+		wk->wk_due = curcpu->c_hardclocks + ticks;
+		for (pp = &wc->wc_delayed; *pp != NULL; pp = &(*pp)->wk_next) {
+			if ((int)((*pp)->wk_due - wk->wk_due) > 0) {
+				break;
+			}
+		}
+		wk->wk_next = *pp;
+		*pp = wk;
+	}
+
+	spinlock_release(&wc->wc_lock);
+	splx(spl);
+	return 0;
+}
+
+int
+workqueue_add(struct workqueue *wq, struct work *wk)
+{
+	return workqueue_doadd(wq, wk, false, 0);
+}
+
+int
+workqueue_add_delayed(struct workqueue *wq, struct work *wk, unsigned ticks)
+{
+	if (ticks == 0) {
+		return workqueue_doadd(wq, wk, false, 0);
+	}
+	return workqueue_doadd(wq, wk, true, ticks);
+}
+
+/*
+ * Cancel pending work. The worker takes its whole ready queue at
+ * once, so work that's gone from both lists is either running or
+ * about to, and it's too late.
+ */
+bool
+workqueue_cancel(struct workqueue *wq, struct work *wk)
+{
+	struct wq_cpu *wc;
+	struct work **pp, *prev;
+
+	wc = wk->wk_owner;
+	if (wc == NULL) {
+		return false;
+	}
+	KASSERT(wc->wc_wq == wq);
+
+	spinlock_acquire(&wc->wc_lock);
+	if (wk->wk_owner != wc) {
+		/* Ran (and maybe was added again elsewhere) meanwhile. */
+		spinlock_release(&wc->wc_lock);
+		return false;
+	}
+
+	for (pp = &wc->wc_delayed; *pp != NULL; pp = &(*pp)->wk_next) {
+		if (*pp == wk) {
+			*pp = wk->wk_next;
+			goto found;
+		}
+	}
+
+	prev = NULL;
+	for (pp = &wc->wc_head; *pp != NULL; pp = &(*pp)->wk_next) {
+		if (*pp == wk) {
+			*pp = wk->wk_next;
+			if (wc->wc_tail == wk) {
+				wc->wc_tail = prev;
+			}
+			KASSERT(wc->wc_nready > 0);
+			wc->wc_nready--;
+			goto found;
+		}
+		prev = *pp;
+	}
+
+	/* In the worker's current batch. */
+	spinlock_release(&wc->wc_lock);
+	return false;
+
+ found:
+	KASSERT(wc->wc_depth > 0);
+	wc->wc_depth--;
+	wk->wk_next = NULL;
+	wk->wk_owner = NULL;
+	spinlock_release(&wc->wc_lock);
+	return true;
+}
+
+/*
+ * Move delayed work that has come due on this cpu to the ready
+ * queue. Called from hardclock().
+ */
+void
+workqueue_hardclock(void)
+{
+	struct workqueue *wq;
+	struct wq_cpu *wc;
+	struct work *wk;
+	unsigned now;
+
+	now = curcpu->c_hardclocks;
+
+	spinlock_acquire(&allworkqueues_lock);
+	for (wq = allworkqueues; wq != NULL; wq = wq->wq_next) {
+		wc = &wq->wq_cpus[curcpu->c_number];
+		if (wc->wc_delayed == NULL) {
+			/* Unlocked peek; worst case we're a tick late. */
+			continue;
+		}
+		spinlock_acquire(&wc->wc_lock);
+		while (wc->wc_delayed != NULL &&
+		       (int)(now - wc->wc_delayed->wk_due) >= 0) {
+			wk = wc->wc_delayed;
+			wc->wc_delayed = wk->wk_next;
+			wq_cpu_makeready(wc, wk);
+		}
+		spinlock_release(&wc->wc_lock);
+	}
+	spinlock_release(&allworkqueues_lock);
+}
@@ -0,0 +1,959 @@
+/*
+ * Buffer cache. See buf.h.
+ *
+ * Every buffer with an identity (device and block) is in the hash
+ * table and on one of two replacement lists, BL_RECENT (2Q's "A1in",
+ * a FIFO) or BL_FREQUENT ("Am", an LRU list); buffers without one are
+ * on BL_FREE. Lists run from most recent at the head to least recent
+ * at the tail. The numbers of blocks recently pushed off BL_RECENT
+ * are kept as "ghosts" in a ring with its own hash table ("A1out").
+ *
+ * Dirty buffers are also on the dirty list, so syncing doesn't have
+ * to look at clean ones. buffer_sync takes references to all of a
+ * device's dirty buffers at once and writes them sorted by block
+ * number, so the disk sweeps across once instead of seeking back and
+ * forth; the array it sorts them in is static, and bufcache_synclock
+ * lets one sync use it at a time.
+ *
+ * Read-ahead is done by worker threads on bufcache_rawq, each reading
+ * one block into the cache and dropping it, so the thread that asked
+ * carries on meanwhile. The requests come from a fixed pool, so
+ * asking never allocates memory; when the pool is used up further
+ * requests are dropped. A request holds no buffer reference until it
+ * runs, so buffer_drop also waits for any pending for its device.
+ *
+ * A buffer is busy while it is being read or written. Its contents
+ * belong to the I/O until then, so anyone wanting the buffer waits
+ * for it to be idle. Waiting for that, and for a buffer to become
+ * free for reuse, both happen on bufcache_wchan.
+ *
+ * Everything here is protected by bufcache_lock, except a buffer's
+ * contents, which are the caller's business.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <synch.h>
+#include <thread.h>
+#include <proc.h>
+#include <clock.h>
+#include <vfs.h>
+#include <workqueue.h>
+#include <device.h>
+#include <buf.h>
+
+/* Replacement lists */
+#define BL_FREE      0	/* no identity; ready for use */
+#define BL_RECENT    1	/* read in once */
+#define BL_FREQUENT  2	/* wanted again after being read */
+#define BL_NLISTS    3
+
+/* 2Q tuning, from the paper: a quarter in A1in, half as many ghosts. */
+#define BUFFER_RECENTMAX (BUFFER_MAXBUFS / 4)
+#define BUFFER_NGHOSTS   (BUFFER_MAXBUFS / 2)
+
+/* Hash table size; prime. */
+#define BUFHASH_SIZE 251
+
+struct buf {
+	struct device *b_dev;		/* device, or NULL if none */
+	daddr_t b_block;		/* block number on b_dev */
+	void *b_data;			/* BUFFER_SIZE bytes */
+	unsigned b_refcount;		/* # of users */
+	bool b_valid;			/* b_data holds the block */
+	bool b_dirty;			/* b_data needs writing */
+	bool b_busy;			/* I/O in progress */
+	unsigned b_list;		/* BL_* list we're on */
+	struct buf *b_hashnext;		/* hash chain */
+	struct buf *b_next;		/* replacement list */
+	struct buf *b_prev;
+	struct buf *b_dirtynext;	/* dirty list */
+	struct buf *b_dirtyprev;
+};
+
+struct bufra {
+	struct work ra_work;
+	struct device *ra_dev;		/* device, or NULL if unused */
+	daddr_t ra_block;
+	struct bufra *ra_next;		/* free list */
+};
+
+struct buflist {
+	struct buf *bl_head;
+	struct buf *bl_tail;
+	unsigned bl_count;
+};
+
+struct bufghost {
+	struct device *g_dev;		/* device, or NULL if unused */
+	daddr_t g_block;
+	struct bufghost *g_hashnext;
+};
+
+static struct spinlock bufcache_lock = SPINLOCK_INITIALIZER;
+static struct wchan *bufcache_wchan;
+static unsigned bufcache_waiters;	/* # sleeping on bufcache_wchan */
+static unsigned bufcache_nbufs;		/* # allocated so far */
+
+static struct buf *bufcache_hash[BUFHASH_SIZE];
+static struct buflist bufcache_lists[BL_NLISTS];
+static struct buf *bufcache_dirty;
+
+static struct lock *bufcache_synclock;
+static struct buf *bufcache_syncbufs[BUFFER_MAXBUFS];
+
+static struct workqueue *bufcache_rawq;
+static struct bufra bufcache_ra[BUFFER_MAXREADAHEAD];
+static struct bufra *bufcache_freera;
+
+static struct bufghost bufcache_ghosts[BUFFER_NGHOSTS];
+static struct bufghost *bufcache_ghosthash[BUFHASH_SIZE];
+static unsigned bufcache_nextghost;	/* oldest ghost; next to reuse */
+
+////////////////////////////////////////////////////////////
+// Lists and hashing
+
+static
+unsigned
+buf_hash(struct device *dev, daddr_t block)
+{
+	return (block ^ ((uintptr_t)dev >> 4)) % BUFHASH_SIZE;
+}
+
+static
+struct buf *
+buf_lookup(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+
+	for (b = bufcache_hash[buf_hash(dev, block)]; b != NULL;
+	     b = b->b_hashnext) {
+		if (b->b_dev == dev && b->b_block == block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+buf_hashinsert(struct buf *b)
+{
+	unsigned h = buf_hash(b->b_dev, b->b_block);
+
+	b->b_hashnext = bufcache_hash[h];
+	bufcache_hash[h] = b;
+}
+
+static
+void
+buf_hashremove(struct buf *b)
+{
+	struct buf **pp;
+
+	for (pp = &bufcache_hash[buf_hash(b->b_dev, b->b_block)];
+	     *pp != b; pp = &(*pp)->b_hashnext) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = b->b_hashnext;
+	b->b_hashnext = NULL;
+}
+
+static
+void
+buflist_remove(struct buf *b)
+{
+	struct buflist *bl = &bufcache_lists[b->b_list];
+
+	if (b->b_prev != NULL) {
+		b->b_prev->b_next = b->b_next;
+	}
+	else {
+		bl->bl_head = b->b_next;
+	}
+	if (b->b_next != NULL) {
+		b->b_next->b_prev = b->b_prev;
+	}
+	else {
+		bl->bl_tail = b->b_prev;
+	}
+	b->b_next = b->b_prev = NULL;
+	KASSERT(bl->bl_count > 0);
+	bl->bl_count--;
+}
+
+static
+void
+buflist_addhead(unsigned list, struct buf *b)
+{
+	struct buflist *bl = &bufcache_lists[list];
+
+	b->b_list = list;
+	b->b_prev = NULL;
+	b->b_next = bl->bl_head;
+	if (bl->bl_head != NULL) {
+		bl->bl_head->b_prev = b;
+	}
+	else {
+		bl->bl_tail = b;
+	}
+	bl->bl_head = b;
+	bl->bl_count++;
+}
+
+static
+void
+buf_setdirty(struct buf *b)
+{
+	if (b->b_dirty) {
+		return;
+	}
+	b->b_dirty = true;
+	b->b_dirtyprev = NULL;
+	b->b_dirtynext = bufcache_dirty;
+	if (bufcache_dirty != NULL) {
+		bufcache_dirty->b_dirtyprev = b;
+	}
+	bufcache_dirty = b;
+}
+
+static
+void
+buf_setclean(struct buf *b)
+{
+	if (!b->b_dirty) {
+		return;
+	}
+	b->b_dirty = false;
+	if (b->b_dirtyprev != NULL) {
+		b->b_dirtyprev->b_dirtynext = b->b_dirtynext;
+	}
+	else {
+		bufcache_dirty = b->b_dirtynext;
+	}
+	if (b->b_dirtynext != NULL) {
+		b->b_dirtynext->b_dirtyprev = b->b_dirtyprev;
+	}
+	b->b_dirtynext = b->b_dirtyprev = NULL;
+}
+
+////////////////////////////////////////////////////////////
+// Ghosts
+
+/*
+ * Remember that BLOCK of DEV was recently pushed out of BL_RECENT,
+ * forgetting the oldest such block if need be.
+ */
+static
+void
+ghost_add(struct device *dev, daddr_t block)
+{
+	struct bufghost *g, **gp;
+
+	g = &bufcache_ghosts[bufcache_nextghost];
+	bufcache_nextghost = (bufcache_nextghost + 1) % BUFFER_NGHOSTS;
+
+	if (g->g_dev != NULL) {
+		for (gp = &bufcache_ghosthash[buf_hash(g->g_dev, g->g_block)];
+		     *gp != g; gp = &(*gp)->g_hashnext) {
+			KASSERT(*gp != NULL);
+		}
+		*gp = g->g_hashnext;
+	}
+
+	g->g_dev = dev;
+	g->g_block = block;
+	gp = &bufcache_ghosthash[buf_hash(dev, block)];
+	g->g_hashnext = *gp;
+	*gp = g;
+}
+
+/*
+ * Check for (and forget) a ghost of BLOCK of DEV.
+ */
+static
+bool
+ghost_take(struct device *dev, daddr_t block)
+{
+	struct bufghost *g, **gp;
+
+	for (gp = &bufcache_ghosthash[buf_hash(dev, block)]; *gp != NULL;
+	     gp = &(*gp)->g_hashnext) {
+		g = *gp;
+		if (g->g_dev == dev && g->g_block == block) {
+			*gp = g->g_hashnext;
+			g->g_dev = NULL;
+			g->g_hashnext = NULL;
+			return true;
+		}
+	}
+	return false;
+}
+
+////////////////////////////////////////////////////////////
+// Buffers
+
+/*
+ * Sleep on bufcache_wchan until someone finishes I/O or releases a
+ * buffer. Call with bufcache_lock held.
+ */
+static
+void
+bufcache_wait(void)
+{
+	bufcache_waiters++;
+	wchan_lock(bufcache_wchan);
+	spinlock_release(&bufcache_lock);
+	wchan_sleep(bufcache_wchan);
+	spinlock_acquire(&bufcache_lock);
+	bufcache_waiters--;
+}
+
+static
+void
+bufcache_wakeup(void)
+{
+	if (bufcache_waiters > 0) {
+		wchan_wakeall(bufcache_wchan);
+	}
+}
+
+/*
+ * Wait until B has no I/O in progress.
+ */
+static
+void
+buf_waitidle(struct buf *b)
+{
+	while (b->b_busy) {
+		bufcache_wait();
+	}
+}
+
+static
+struct buf *
+buf_create(void)
+{
+	struct buf *b;
+
+	b = kmalloc(sizeof(*b));
+	if (b == NULL) {
+		return NULL;
+	}
+	b->b_data = kmalloc(BUFFER_SIZE);
+	if (b->b_data == NULL) {
+		kfree(b);
+		return NULL;
+	}
+	b->b_dev = NULL;
+	b->b_block = 0;
+	b->b_refcount = 0;
+	b->b_valid = false;
+	b->b_dirty = false;
+	b->b_busy = false;
+	b->b_hashnext = NULL;
+	b->b_dirtynext = b->b_dirtyprev = NULL;
+	return b;
+}
+
+/*
+ * Do I/O on a buffer, retrying on errors the way a disk driver
+ * ought to. Called with no locks held and B busy.
+ */
+static
+int
+buf_io(struct buf *b, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+	int tries = 0;
+
+	KASSERT(b->b_busy);
+
+ retry:
+	uio_kinit(&iov, &ku, b->b_data, BUFFER_SIZE,
+		  ((off_t)b->b_block) * BUFFER_SIZE, rw);
+	result = b->b_dev->d_io(b->b_dev, &ku);
+	if (result == EINVAL) {
+		/*
+		 * This means the sector we requested was out of range,
+		 * or the seek address we gave wasn't sector-aligned,
+		 * or a couple of other things that are our fault.
+		 */
+		panic("buffer: d_io returned EINVAL\n");
+	}
+	if (result == EIO) {
+		if (tries == 0) {
+			tries++;
+			kprintf("buffer: block %u I/O error, retrying\n",
+				b->b_block);
+			goto retry;
+		}
+		else if (tries < 10) {
+			tries++;
+			goto retry;
+		}
+		else {
+			kprintf("buffer: block %u I/O error, giving up after "
+				"%d retries\n", b->b_block, tries);
+		}
+	}
+	return result;
+}
+
+/*
+ * Find a buffer that can be reused: unreferenced and idle, from the
+ * tail of BL_RECENT if it is over its share and otherwise from the
+ * tail of BL_FREQUENT, falling back on the other list. Clean buffers
+ * are preferred; if there are none, a dirty one is returned, and must
+ * be written first. Returns NULL if everything is in use.
+ */
+static
+struct buf *
+buf_victim(void)
+{
+	struct buf *b, *dirty;
+	unsigned first, i, list;
+
+	first = (bufcache_lists[BL_RECENT].bl_count > BUFFER_RECENTMAX) ?
+		BL_RECENT : BL_FREQUENT;
+
+	dirty = NULL;
+	for (i=0; i<2; i++) {
+		list = (i == 0) ? first : (BL_RECENT + BL_FREQUENT - first);
+		for (b = bufcache_lists[list].bl_tail; b != NULL;
+		     b = b->b_prev) {
+			if (b->b_refcount > 0 || b->b_busy) {
+				continue;
+			}
+			if (!b->b_dirty) {
+				return b;
+			}
+			if (dirty == NULL) {
+				dirty = b;
+			}
+		}
+	}
+	return dirty;
+}
+
+/*
+ * Get a reference to the buffer for BLOCK of DEV, giving it that
+ * identity (but not reading it) if it isn't in the cache. Hands
+ * it back idle.
+ */
+static
+int
+buffer_find(struct device *dev, daddr_t block, struct buf **ret)
+{
+	struct buf *b;
+	bool cangrow = true;
+	int result;
+
+	spinlock_acquire(&bufcache_lock);
+	while (1) {
+		b = buf_lookup(dev, block);
+		if (b != NULL) {
+			/* Hit. Only hits on BL_FREQUENT count as use. */
+			if (b->b_list == BL_FREQUENT) {
+				buflist_remove(b);
+				buflist_addhead(BL_FREQUENT, b);
+			}
+			b->b_refcount++;
+			buf_waitidle(b);
+			break;
+		}
+
+		b = bufcache_lists[BL_FREE].bl_head;
+		if (b != NULL) {
+			/* Give it its identity. */
+			buflist_remove(b);
+			b->b_dev = dev;
+			b->b_block = block;
+			b->b_valid = false;
+			KASSERT(!b->b_dirty);
+			KASSERT(b->b_refcount == 0);
+			b->b_refcount = 1;
+			buf_hashinsert(b);
+			buflist_addhead(ghost_take(dev, block) ?
+					BL_FREQUENT : BL_RECENT, b);
+			break;
+		}
+
+		if (cangrow && bufcache_nbufs < BUFFER_MAXBUFS) {
+			/* Make a new one, without the lock. */
+			bufcache_nbufs++;
+			spinlock_release(&bufcache_lock);
+			b = buf_create();
+			spinlock_acquire(&bufcache_lock);
+			if (b == NULL) {
+				bufcache_nbufs--;
+				cangrow = false;
+			}
+			else {
+				buflist_addhead(BL_FREE, b);
+			}
+			/* Someone may have loaded our block meanwhile. */
+			continue;
+		}
+
+		b = buf_victim();
+		if (b == NULL) {
+			if (bufcache_nbufs == 0) {
+				spinlock_release(&bufcache_lock);
+				return ENOMEM;
+			}
+			bufcache_wait();
+			continue;
+		}
+
+		if (b->b_dirty) {
+			/* Write it out, then look again. */
+			b->b_refcount++;
+			spinlock_release(&bufcache_lock);
+			result = buffer_flush(b);
+			buffer_release(b);
+			if (result) {
+				return result;
+			}
+			spinlock_acquire(&bufcache_lock);
+			continue;
+		}
+
+		/* Throw it out. */
+		if (b->b_list == BL_RECENT) {
+			ghost_add(b->b_dev, b->b_block);
+		}
+		buf_hashremove(b);
+		buflist_remove(b);
+		b->b_dev = NULL;
+		buflist_addhead(BL_FREE, b);
+	}
+	spinlock_release(&bufcache_lock);
+
+	*ret = b;
+	return 0;
+}
+
+int
+buffer_read(struct device *dev, daddr_t block, struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	result = buffer_find(dev, block, &b);
+	if (result) {
+		return result;
+	}
+
+	spinlock_acquire(&bufcache_lock);
+	buf_waitidle(b);
+	if (!b->b_valid) {
+		b->b_busy = true;
+		spinlock_release(&bufcache_lock);
+
+		result = buf_io(b, UIO_READ);
+
+		spinlock_acquire(&bufcache_lock);
+		b->b_busy = false;
+		b->b_valid = (result == 0);
+		bufcache_wakeup();
+	}
+	spinlock_release(&bufcache_lock);
+
+	if (result) {
+		buffer_release(b);
+		return result;
+	}
+	*ret = b;
+	return 0;
+}
+
+int
+buffer_get(struct device *dev, daddr_t block, struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	result = buffer_find(dev, block, &b);
+	if (result) {
+		return result;
+	}
+
+	/*
+	 * The caller is about to fill it in; call it valid now so
+	 * nobody else reads the old contents in over the new. A read
+	 * already under way (read-ahead doesn't hold the biglock) has
+	 * to finish first, or it would land on top of the caller's data.
+	 */
+	spinlock_acquire(&bufcache_lock);
+	buf_waitidle(b);
+	b->b_valid = true;
+	spinlock_release(&bufcache_lock);
+
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Read-ahead work function.
+ */
+static
+void
+buffer_doreadahead(void *data1, unsigned long data2)
+{
+	struct bufra *ra = data1;
+	struct buf *b;
+
+	(void)data2;
+
+	if (buffer_read(ra->ra_dev, ra->ra_block, &b) == 0) {
+		buffer_release(b);
+	}
+
+	spinlock_acquire(&bufcache_lock);
+	ra->ra_dev = NULL;
+	ra->ra_next = bufcache_freera;
+	bufcache_freera = ra;
+	bufcache_wakeup();
+	spinlock_release(&bufcache_lock);
+}
+
+void
+buffer_readahead(struct device *dev, daddr_t block)
+{
+	struct bufra *ra;
+
+	spinlock_acquire(&bufcache_lock);
+	if (bufcache_rawq == NULL || bufcache_freera == NULL ||
+	    buf_lookup(dev, block) != NULL) {
+		spinlock_release(&bufcache_lock);
+		return;
+	}
+	ra = bufcache_freera;
+	bufcache_freera = ra->ra_next;
+	ra->ra_next = NULL;
+	ra->ra_dev = dev;
+	ra->ra_block = block;
+	spinlock_release(&bufcache_lock);
+
+	if (workqueue_add(bufcache_rawq, &ra->ra_work)) {
+		/* Queue full; never mind. */
+		spinlock_acquire(&bufcache_lock);
+		ra->ra_dev = NULL;
+		ra->ra_next = bufcache_freera;
+		bufcache_freera = ra;
+		bufcache_wakeup();
+		spinlock_release(&bufcache_lock);
+	}
+}
+
+void *
+buffer_map(struct buf *b)
+{
+	KASSERT(b->b_refcount > 0);
+	return b->b_data;
+}
+
+void
+buffer_mark_dirty(struct buf *b)
+{
+	spinlock_acquire(&bufcache_lock);
+	KASSERT(b->b_refcount > 0);
+	KASSERT(b->b_valid);
+	buf_setdirty(b);
+	spinlock_release(&bufcache_lock);
+}
+
+void
+buffer_release(struct buf *b)
+{
+	spinlock_acquire(&bufcache_lock);
+	KASSERT(b->b_refcount > 0);
+	b->b_refcount--;
+	if (b->b_refcount == 0) {
+		bufcache_wakeup();
+	}
+	spinlock_release(&bufcache_lock);
+}
+
+int
+buffer_flush(struct buf *b)
+{
+	int result;
+
+	spinlock_acquire(&bufcache_lock);
+	KASSERT(b->b_refcount > 0);
+	buf_waitidle(b);
+	if (!b->b_dirty) {
+		spinlock_release(&bufcache_lock);
+		return 0;
+	}
+	/* If it's changed while we write, it'll be dirty again. */
+	buf_setclean(b);
+	b->b_busy = true;
+	spinlock_release(&bufcache_lock);
+
+	result = buf_io(b, UIO_WRITE);
+
+	spinlock_acquire(&bufcache_lock);
+	b->b_busy = false;
+	if (result) {
+		buf_setdirty(b);
+	}
+	bufcache_wakeup();
+	spinlock_release(&bufcache_lock);
+
+	return result;
+}
+
+/*
+ * Write out the NUM blocks of DEV in BLOCKS that are cached and
+ * dirty, in ascending order.
+ */
+int
+buffer_flushblocks(struct device *dev, daddr_t *blocks, unsigned num)
+{
+	struct buf *b;
+	daddr_t tmp;
+	unsigned i, j;
+	int result, ret = 0;
+
+	/* Insertion sort; NUM is small. */
+	for (i=1; i<num; i++) {
+		tmp = blocks[i];
+		for (j=i; j>0 && blocks[j-1] > tmp; j--) {
+			blocks[j] = blocks[j-1];
+		}
+		blocks[j] = tmp;
+	}
+
+	for (i=0; i<num; i++) {
+		spinlock_acquire(&bufcache_lock);
+		b = buf_lookup(dev, blocks[i]);
+		if (b == NULL || !b->b_dirty) {
+			spinlock_release(&bufcache_lock);
+			continue;
+		}
+		b->b_refcount++;
+		spinlock_release(&bufcache_lock);
+
+		result = buffer_flush(b);
+		if (result && ret == 0) {
+			ret = result;
+		}
+		buffer_release(b);
+	}
+	return ret;
+}
+
+/*
+ * Throw away changes to a freed block. If it's in use or being
+ * written, leave it alone; it's harmless either way.
+ */
+void
+buffer_discard(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+
+	spinlock_acquire(&bufcache_lock);
+	b = buf_lookup(dev, block);
+	if (b != NULL && b->b_refcount == 0 && !b->b_busy) {
+		buf_setclean(b);
+	}
+	spinlock_release(&bufcache_lock);
+}
+
+int
+buffer_sync(struct device *dev)
+{
+	struct buf **bufs = bufcache_syncbufs;
+	struct buf *b, *tmp;
+	unsigned num, i, j;
+	int result, ret = 0;
+
+	lock_acquire(bufcache_synclock);
+
+	/* Grab everything dirty for DEV. */
+	num = 0;
+	spinlock_acquire(&bufcache_lock);
+	for (b = bufcache_dirty; b != NULL; b = b->b_dirtynext) {
+		if (b->b_dev == dev) {
+			KASSERT(num < BUFFER_MAXBUFS);
+			b->b_refcount++;
+			bufs[num++] = b;
+		}
+	}
+	spinlock_release(&bufcache_lock);
+
+	/*
+	 * Sort by block number. b_block can't change while we hold
+	 * references. Insertion sort, because the dirty list is
+	 * mostly in reverse order of dirtying and sequential writes
+	 * dirty blocks in order; reversing first makes that the good
+	 * case.
+	 */
+	for (i=0, j=num; i+1<j; i++, j--) {
+		tmp = bufs[i];
+		bufs[i] = bufs[j-1];
+		bufs[j-1] = tmp;
+	}
+	for (i=1; i<num; i++) {
+		tmp = bufs[i];
+		for (j=i; j>0 && bufs[j-1]->b_block > tmp->b_block; j--) {
+			bufs[j] = bufs[j-1];
+		}
+		bufs[j] = tmp;
+	}
+
+	for (i=0; i<num; i++) {
+		result = buffer_flush(bufs[i]);
+		if (result && ret == 0) {
+			ret = result;
+		}
+		buffer_release(bufs[i]);
+	}
+
+	lock_release(bufcache_synclock);
+
+	if (ret) {
+		return ret;
+	}
+
+	/*
+	 * Buffers someone else is writing are off the dirty list;
+	 * wait for those writes to finish too.
+	 */
+	spinlock_acquire(&bufcache_lock);
+ again:
+	for (i=0; i<BUFHASH_SIZE; i++) {
+		for (b = bufcache_hash[i]; b != NULL; b = b->b_hashnext) {
+			if (b->b_dev == dev && b->b_busy) {
+				bufcache_wait();
+				goto again;
+			}
+		}
+	}
+	spinlock_release(&bufcache_lock);
+	return 0;
+}
+
+void
+buffer_drop(struct device *dev)
+{
+	struct buf *b, *next;
+	struct bufghost *g;
+	unsigned i;
+
+	spinlock_acquire(&bufcache_lock);
+
+	/* Let read-aheads already asked for finish. */
+ again:
+	for (i=0; i<BUFFER_MAXREADAHEAD; i++) {
+		if (bufcache_ra[i].ra_dev == dev) {
+			bufcache_wait();
+			goto again;
+		}
+	}
+
+	for (i=0; i<BUFHASH_SIZE; i++) {
+		for (b = bufcache_hash[i]; b != NULL; b = next) {
+			next = b->b_hashnext;
+			if (b->b_dev != dev) {
+				continue;
+			}
+			KASSERT(b->b_refcount == 0);
+			KASSERT(!b->b_dirty);
+			KASSERT(!b->b_busy);
+			buf_hashremove(b);
+			buflist_remove(b);
+			b->b_dev = NULL;
+			b->b_valid = false;
+			buflist_addhead(BL_FREE, b);
+		}
+	}
+	for (i=0; i<BUFFER_NGHOSTS; i++) {
+		g = &bufcache_ghosts[i];
+		if (g->g_dev == dev) {
+			ghost_take(dev, g->g_block);
+		}
+	}
+	spinlock_release(&bufcache_lock);
+}
+
+/*
+ * The syncer: write back everything every SYNCER_INTERVAL seconds,
+ * so that delayed writes aren't delayed indefinitely.
+ */
+static
+void
+syncer_thread(void *data1, unsigned long data2)
+{
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		clocksleep(SYNCER_INTERVAL);
+		if (bufcache_dirty != NULL) {
+			/* Unlocked peek; at worst we wait another round. */
+			vfs_sync();
+		}
+	}
+}
+
+void
+buffer_bootstrap(void)
+{
+	unsigned i;
+	int result;
+
+	bufcache_wchan = wchan_create("bufcache");
+	if (bufcache_wchan == NULL) {
+		panic("buffer_bootstrap: Out of memory\n");
+	}
+	bufcache_synclock = lock_create("bufcache sync");
+	if (bufcache_synclock == NULL) {
+		panic("buffer_bootstrap: Out of memory\n");
+	}
+	for (i=0; i<BL_NLISTS; i++) {
+		bufcache_lists[i].bl_head = NULL;
+		bufcache_lists[i].bl_tail = NULL;
+		bufcache_lists[i].bl_count = 0;
+	}
+
+	result = thread_fork("syncer", kproc, syncer_thread, NULL, 0);
+	if (result) {
+		panic("buffer_bootstrap: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+}
+
+void
+buffer_readahead_bootstrap(void)
+{
+	struct workqueue *wq;
+	unsigned i;
+
+	for (i=0; i<BUFFER_MAXREADAHEAD; i++) {
+		work_init(&bufcache_ra[i].ra_work, buffer_doreadahead,
+			  &bufcache_ra[i], 0);
+		bufcache_ra[i].ra_dev = NULL;
+		bufcache_ra[i].ra_next = bufcache_freera;
+		bufcache_freera = &bufcache_ra[i];
+	}
+
+	wq = workqueue_create("readahead", BUFFER_MAXREADAHEAD);
+	if (wq == NULL) {
+		panic("buffer_readahead_bootstrap: "
+		      "Could not create workqueue\n");
+	}
+
+	spinlock_acquire(&bufcache_lock);
+	bufcache_rawq = wq;
+	spinlock_release(&bufcache_lock);
+}
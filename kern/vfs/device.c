@@ -36,6 +36,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/fcntl.h>
+#include <kern/poll.h>
 #include <stat.h>
 #include <lib.h>
 #include <uio.h>
@@ -43,6 +44,9 @@
 #include <vnode.h>
 #include <device.h>
 
+/* Disk statistics hooks; see device.h. */
+const struct diskstats_ops *dev_diskstats;
+
 /*
  * Called for each open().
  *
@@ -293,6 +297,23 @@ dev_namefile(struct vnode *v, struct uio *uio)
 	return 0;
 }
 
+/*
+ * For poll(). Devices that can make a reader or writer wait provide
+ * d_poll; the rest are always ready.
+ */
+static
+int
+dev_poll(struct vnode *v, int events, struct pollentry *pe, int *revents)
+{
+	struct device *d = v->vn_data;
+
+	if (d->d_poll == NULL) {
+		*revents = events & (POLLIN | POLLOUT);
+		return 0;
+	}
+	return d->d_poll(d, events, pe, revents);
+}
+
 /*
  * Operations that are completely meaningless on devices.
  */
@@ -430,6 +451,7 @@ static const struct vnode_ops dev_vnode_ops = {
 	dev_mmap,
 	dev_truncate,
 	dev_namefile,
+	dev_poll,
 	null_creat,
 	null_symlink,
 	null_mkdir,
@@ -0,0 +1,663 @@
+/*
+ * Anonymous pipes. See pipe.h.
+ *
+ * The buffer is a ring of PIPE_SIZE bytes. pp_head counts every
+ * byte ever written and pp_tail every byte ever read; both run
+ * freely and are taken mod PIPE_SIZE to index the buffer, so the
+ * amount of data in the pipe is always pp_head - pp_tail.
+ *
+ * Only the writer changes pp_head and only the reader changes
+ * pp_tail, so the reader and the writer share no lock: each
+ * publishes its count only after it's finished with the bytes the
+ * count covers, with a memory barrier in between. There can be more
+ * than one reader (or writer) after fork or dup2, and the pipe can't
+ * tell, so every read takes pp_readlock and every write pp_writelock
+ * to keep to one at a time on each side. Those locks are per side,
+ * so the reader and writer never wait for each other except when the
+ * pipe is empty or full.
+ *
+ * When it is, the reader (or writer) sets pp_readwaiting (or
+ * pp_writewaiting) and sleeps on its wchan. The other side checks
+ * the flag after each transfer and takes pp_lock to wake it only if
+ * it is set. The sleeper sets its flag and then checks the pipe
+ * again before sleeping, and the other side updates its count and
+ * then checks the flag. Because of the barriers, at least one of
+ * them sees what the other did, so a wakeup is never lost.
+ *
+ * poll() waits on pp_readpq (or pp_writepq) instead, which the other
+ * side wakes after each transfer in the same way.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/poll.h>
+#include <stat.h>
+#include <lib.h>
+#include <uio.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <synch.h>
+#include <vnode.h>
+#include <poll.h>
+#include <pipe.h>
+
+struct pipe {
+	struct vnode pp_readvn;		/* read end */
+	struct vnode pp_writevn;	/* write end */
+	char *pp_buf;			/* PIPE_SIZE bytes */
+
+	volatile unsigned pp_head;	/* bytes written; writer only */
+	volatile unsigned pp_tail;	/* bytes read; reader only */
+	volatile bool pp_readclosed;	/* read end is gone */
+	volatile bool pp_writeclosed;	/* write end is gone */
+	volatile bool pp_readwaiting;	/* reader is sleeping */
+	volatile bool pp_writewaiting;	/* writer is sleeping */
+
+	struct lock *pp_readlock;	/* one reader at a time */
+	struct lock *pp_writelock;	/* one writer at a time */
+
+	struct spinlock pp_lock;	/* for sleeping and waking */
+	struct wchan *pp_readwchan;	/* reader sleeps here */
+	struct wchan *pp_writewchan;	/* writer sleeps here */
+	struct pollq pp_readpq;		/* pollers of the read end */
+	struct pollq pp_writepq;	/* pollers of the write end */
+	unsigned pp_ends;		/* ends not yet reclaimed */
+};
+
+static const struct vnode_ops pipe_vnode_ops;
+
+/*
+ * Pipe buffers are a whole page each; keep freed ones for reuse
+ * rather than giving them back to the page allocator.
+ */
+static void *pipebuf_freelist;
+static struct spinlock pipebuf_freelist_lock = SPINLOCK_INITIALIZER;
+
+static
+char *
+pipebuf_get(void)
+{
+	void *buf;
+
+	spinlock_acquire(&pipebuf_freelist_lock);
+	buf = pipebuf_freelist;
+	if (buf != NULL) {
+		pipebuf_freelist = *(void **)buf;
+	}
+	spinlock_release(&pipebuf_freelist_lock);
+
+	if (buf == NULL) {
+		buf = kmalloc(PIPE_SIZE);
+	}
+	return buf;
+}
+
+static
+void
+pipebuf_put(char *buf)
+{
+	spinlock_acquire(&pipebuf_freelist_lock);
+	*(void **)buf = pipebuf_freelist;
+	pipebuf_freelist = buf;
+	spinlock_release(&pipebuf_freelist_lock);
+}
+
+////////////////////////////////////////////////////////////
+
+static
+void
+pipe_destroy(struct pipe *pp)
+{
+	pollq_cleanup(&pp->pp_writepq);
+	pollq_cleanup(&pp->pp_readpq);
+	wchan_destroy(pp->pp_writewchan);
+	wchan_destroy(pp->pp_readwchan);
+	spinlock_cleanup(&pp->pp_lock);
+	lock_destroy(pp->pp_writelock);
+	lock_destroy(pp->pp_readlock);
+	pipebuf_put(pp->pp_buf);
+	kfree(pp);
+}
+
+int
+pipe_create(struct vnode **readend, struct vnode **writeend)
+{
+	struct pipe *pp;
+
+	pp = kmalloc(sizeof(*pp));
+	if (pp == NULL) {
+		return ENOMEM;
+	}
+	pp->pp_buf = pipebuf_get();
+	if (pp->pp_buf == NULL) {
+		goto fail_pp;
+	}
+	pp->pp_readlock = lock_create("pipe read");
+	if (pp->pp_readlock == NULL) {
+		goto fail_buf;
+	}
+	pp->pp_writelock = lock_create("pipe write");
+	if (pp->pp_writelock == NULL) {
+		goto fail_readlock;
+	}
+	pp->pp_readwchan = wchan_create("pipe read");
+	if (pp->pp_readwchan == NULL) {
+		goto fail_writelock;
+	}
+	pp->pp_writewchan = wchan_create("pipe write");
+	if (pp->pp_writewchan == NULL) {
+		goto fail_readwchan;
+	}
+
+	spinlock_init(&pp->pp_lock);
+	pollq_init(&pp->pp_readpq);
+	pollq_init(&pp->pp_writepq);
+	pp->pp_head = pp->pp_tail = 0;
+	pp->pp_readclosed = pp->pp_writeclosed = false;
+	pp->pp_readwaiting = pp->pp_writewaiting = false;
+	pp->pp_ends = 2;
+
+	VOP_INIT(&pp->pp_readvn, &pipe_vnode_ops, NULL, pp);
+	VOP_INIT(&pp->pp_writevn, &pipe_vnode_ops, NULL, pp);
+
+	*readend = &pp->pp_readvn;
+	*writeend = &pp->pp_writevn;
+	return 0;
+
+ fail_readwchan:
+	wchan_destroy(pp->pp_readwchan);
+ fail_writelock:
+	lock_destroy(pp->pp_writelock);
+ fail_readlock:
+	lock_destroy(pp->pp_readlock);
+ fail_buf:
+	pipebuf_put(pp->pp_buf);
+ fail_pp:
+	kfree(pp);
+	return ENOMEM;
+}
+
+/*
+ * Sleep until there's data to read or the write end is gone.
+ */
+static
+void
+pipe_waitread(struct pipe *pp)
+{
+	spinlock_acquire(&pp->pp_lock);
+	pp->pp_readwaiting = true;
+	spinlock_membar();
+	while (pp->pp_head == pp->pp_tail && !pp->pp_writeclosed) {
+		wchan_lock(pp->pp_readwchan);
+		spinlock_release(&pp->pp_lock);
+		wchan_sleep(pp->pp_readwchan);
+		spinlock_acquire(&pp->pp_lock);
+	}
+	pp->pp_readwaiting = false;
+	spinlock_release(&pp->pp_lock);
+}
+
+/*
+ * Sleep until there's room to write or the read end is gone.
+ */
+static
+void
+pipe_waitwrite(struct pipe *pp)
+{
+	spinlock_acquire(&pp->pp_lock);
+	pp->pp_writewaiting = true;
+	spinlock_membar();
+	while (pp->pp_head - pp->pp_tail == PIPE_SIZE && !pp->pp_readclosed) {
+		wchan_lock(pp->pp_writewchan);
+		spinlock_release(&pp->pp_lock);
+		wchan_sleep(pp->pp_writewchan);
+		spinlock_acquire(&pp->pp_lock);
+	}
+	pp->pp_writewaiting = false;
+	spinlock_release(&pp->pp_lock);
+}
+
+/*
+ * Wake the other side if it's sleeping. Call after publishing a
+ * new pp_head or pp_tail.
+ */
+static
+void
+pipe_wake(struct pipe *pp, volatile bool *waiting, struct wchan *wc)
+{
+	spinlock_membar();
+	if (*waiting) {
+		spinlock_acquire(&pp->pp_lock);
+		wchan_wakeall(wc);
+		spinlock_release(&pp->pp_lock);
+	}
+}
+
+/*
+ * Move LEN bytes between the ring, starting at count POS, and UIO,
+ * in up to two pieces if it wraps around. Returns in *MOVED how many
+ * bytes actually went, even on error.
+ */
+static
+int
+pipe_uiomove(struct pipe *pp, unsigned pos, size_t len, struct uio *uio,
+	     size_t *moved)
+{
+	size_t first, resid;
+	unsigned off;
+	int result;
+
+	off = pos % PIPE_SIZE;
+	first = PIPE_SIZE - off;
+	if (first > len) {
+		first = len;
+	}
+
+	resid = uio->uio_resid;
+	result = uiomove(pp->pp_buf + off, first, uio);
+	if (result == 0 && len > first) {
+		result = uiomove(pp->pp_buf, len - first, uio);
+	}
+	*moved = resid - uio->uio_resid;
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Read: wait until there's something to read, then take as much as
+ * is there (up to what was asked for). Returns 0 bytes only at end
+ * of file.
+ */
+static
+int
+pipe_read(struct vnode *v, struct uio *uio)
+{
+	struct pipe *pp = v->vn_data;
+	unsigned head, tail;
+	size_t len, moved;
+	int result;
+
+	if (v != &pp->pp_readvn) {
+		return EBADF;
+	}
+
+	lock_acquire(pp->pp_readlock);
+	tail = pp->pp_tail;
+	while (pp->pp_head == tail) {
+		if (pp->pp_writeclosed) {
+			/*
+			 * The writer may have put data in just before
+			 * closing; look again now that we've seen it go.
+			 */
+			spinlock_membar();
+			if (pp->pp_head != tail) {
+				break;
+			}
+			lock_release(pp->pp_readlock);
+			return 0;
+		}
+		pipe_waitread(pp);
+	}
+
+	/* Don't look at the data until we've seen the count. */
+	head = pp->pp_head;
+	spinlock_membar();
+
+	len = head - tail;
+	if (len > uio->uio_resid) {
+		len = uio->uio_resid;
+	}
+	result = pipe_uiomove(pp, tail, len, uio, &moved);
+
+	/* Done with the data; hand the space back. */
+	spinlock_membar();
+	pp->pp_tail = tail + moved;
+	pipe_wake(pp, &pp->pp_writewaiting, pp->pp_writewchan);
+	pollq_wakeup(&pp->pp_writepq);
+
+	lock_release(pp->pp_readlock);
+	return result;
+}
+
+/*
+ * Write: put everything in, waiting for room as needed. Fails with
+ * EPIPE if the read end goes away.
+ */
+static
+int
+pipe_write(struct vnode *v, struct uio *uio)
+{
+	struct pipe *pp = v->vn_data;
+	unsigned head, tail;
+	size_t len, moved;
+	int result = 0;
+
+	if (v != &pp->pp_writevn) {
+		return EBADF;
+	}
+
+	lock_acquire(pp->pp_writelock);
+	head = pp->pp_head;
+	while (uio->uio_resid > 0) {
+		if (pp->pp_readclosed) {
+			result = EPIPE;
+			break;
+		}
+		tail = pp->pp_tail;
+		if (head - tail == PIPE_SIZE) {
+			pipe_waitwrite(pp);
+			continue;
+		}
+
+		/* Don't write into the space until we've seen the count. */
+		spinlock_membar();
+
+		len = PIPE_SIZE - (head - tail);
+		if (len > uio->uio_resid) {
+			len = uio->uio_resid;
+		}
+		result = pipe_uiomove(pp, head, len, uio, &moved);
+
+		/* Done with the space; hand the data over. */
+		spinlock_membar();
+		head += moved;
+		pp->pp_head = head;
+		pipe_wake(pp, &pp->pp_readwaiting, pp->pp_readwchan);
+		pollq_wakeup(&pp->pp_readpq);
+
+		if (result) {
+			break;
+		}
+	}
+	lock_release(pp->pp_writelock);
+	return result;
+}
+
+/*
+ * Reclaim: one end has no more references. Tell the other end, and
+ * free the pipe once both are gone.
+ */
+static
+int
+pipe_reclaim(struct vnode *v)
+{
+	struct pipe *pp = v->vn_data;
+	bool last;
+
+	spinlock_acquire(&pp->pp_lock);
+	if (v == &pp->pp_readvn) {
+		pp->pp_readclosed = true;
+		wchan_wakeall(pp->pp_writewchan);
+		pollq_wakeup(&pp->pp_writepq);
+	}
+	else {
+		pp->pp_writeclosed = true;
+		wchan_wakeall(pp->pp_readwchan);
+		pollq_wakeup(&pp->pp_readpq);
+	}
+	KASSERT(pp->pp_ends > 0);
+	pp->pp_ends--;
+	last = (pp->pp_ends == 0);
+	spinlock_release(&pp->pp_lock);
+
+	VOP_CLEANUP(v);
+	if (last) {
+		pipe_destroy(pp);
+	}
+	return 0;
+}
+
+static
+int
+pipe_open(struct vnode *v, int flags)
+{
+	/* Pipes have no names, so can't be opened this way. */
+	(void)v;
+	(void)flags;
+	return EINVAL;
+}
+
+static
+int
+pipe_close(struct vnode *v)
+{
+	(void)v;
+	return 0;
+}
+
+static
+int
+pipe_stat(struct vnode *v, struct stat *statbuf)
+{
+	struct pipe *pp = v->vn_data;
+
+	bzero(statbuf, sizeof(struct stat));
+	statbuf->st_mode = S_IFIFO | 0600;
+	statbuf->st_size = pp->pp_head - pp->pp_tail;
+	statbuf->st_blksize = PIPE_SIZE;
+	statbuf->st_nlink = 0;
+	return 0;
+}
+
+static
+int
+pipe_gettype(struct vnode *v, mode_t *ret)
+{
+	(void)v;
+	*ret = S_IFIFO;
+	return 0;
+}
+
+static
+int
+pipe_tryseek(struct vnode *v, off_t pos)
+{
+	(void)v;
+	(void)pos;
+	return ESPIPE;
+}
+
+static
+int
+pipe_fsync(struct vnode *v)
+{
+	/* Nothing to flush. */
+	(void)v;
+	return 0;
+}
+
+/*
+ * Poll: the read end is ready when there's data, and hung up once the
+ * write end is gone; the write end is ready when there's room, and in
+ * error once the read end is gone.
+ */
+static
+int
+pipe_poll(struct vnode *v, int events, struct pollentry *pe, int *revents)
+{
+	struct pipe *pp = v->vn_data;
+	int ready = 0;
+
+	if (v == &pp->pp_readvn) {
+		if (pe != NULL) {
+			pollq_add(&pp->pp_readpq, pe);
+		}
+		if (pp->pp_head != pp->pp_tail) {
+			ready |= events & POLLIN;
+		}
+		if (pp->pp_writeclosed) {
+			ready |= POLLHUP;
+		}
+	}
+	else {
+		if (pe != NULL) {
+			pollq_add(&pp->pp_writepq, pe);
+		}
+		if (pp->pp_readclosed) {
+			ready |= POLLERR;
+		}
+		else if (pp->pp_head - pp->pp_tail < PIPE_SIZE) {
+			ready |= events & POLLOUT;
+		}
+	}
+
+	*revents = ready;
+	return 0;
+}
+
+/*
+ * Operations that are meaningless on pipes.
+ */
+
+static
+int
+pipe_badio(struct vnode *v, struct uio *uio)
+{
+	(void)v;
+	(void)uio;
+	return EINVAL;
+}
+
+static
+int
+pipe_ioctl(struct vnode *v, int op, userptr_t data)
+{
+	(void)v;
+	(void)op;
+	(void)data;
+	return EIOCTL;
+}
+
+static
+int
+pipe_mmap(struct vnode *v)
+{
+	(void)v;
+	return EUNIMP;
+}
+
+static
+int
+pipe_truncate(struct vnode *v, off_t len)
+{
+	(void)v;
+	(void)len;
+	return EINVAL;
+}
+
+static
+int
+pipe_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
+	   struct vnode **result)
+{
+	(void)v;
+	(void)name;
+	(void)excl;
+	(void)mode;
+	(void)result;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_symlink(struct vnode *v, const char *contents, const char *name)
+{
+	(void)v;
+	(void)contents;
+	(void)name;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_mkdir(struct vnode *v, const char *name, mode_t mode)
+{
+	(void)v;
+	(void)name;
+	(void)mode;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_link(struct vnode *v, const char *name, struct vnode *file)
+{
+	(void)v;
+	(void)name;
+	(void)file;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_nameop(struct vnode *v, const char *name)
+{
+	(void)v;
+	(void)name;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_rename(struct vnode *v, const char *n1, struct vnode *v2, const char *n2)
+{
+	(void)v;
+	(void)n1;
+	(void)v2;
+	(void)n2;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_lookup(struct vnode *v, char *path, struct vnode **result)
+{
+	(void)v;
+	(void)path;
+	(void)result;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_lookparent(struct vnode *v, char *path, struct vnode **result,
+		char *buf, size_t len)
+{
+	(void)v;
+	(void)path;
+	(void)result;
+	(void)buf;
+	(void)len;
+	return ENOTDIR;
+}
+
+static const struct vnode_ops pipe_vnode_ops = {
+	VOP_MAGIC,
+
+	pipe_open,
+	pipe_close,
+	pipe_reclaim,
+	pipe_read,
+	pipe_badio,	/* readlink */
+	pipe_badio,	/* getdirentry */
+	pipe_write,
+	pipe_ioctl,
+	pipe_stat,
+	pipe_gettype,
+	pipe_tryseek,
+	pipe_fsync,
+	pipe_mmap,
+	pipe_truncate,
+	pipe_badio,	/* namefile */
+	pipe_poll,
+	pipe_creat,
+	pipe_symlink,
+	pipe_mkdir,
+	pipe_link,
+	pipe_nameop,	/* remove */
+	pipe_nameop,	/* rmdir */
+	pipe_rename,
+	pipe_lookup,
+	pipe_lookparent,
+};
@@ -43,6 +43,7 @@
 #include <fs.h>
 #include <vnode.h>
 #include <device.h>
+#include <buf.h>
 
 /*
  * Structure for a single named device.
@@ -87,6 +88,21 @@ DEFARRAY(knowndev, /*no inline*/);
 
 static struct knowndevarray *knowndevs;
 
+/*
+ * Lock for knowndevs. The list is read on every lookup of a device
+ * name but changes only when devices are added or filesystems are
+ * mounted or unmounted, so use a reader-writer lock. When both are
+ * needed, get vfs_biglock first.
+ *
+ * For now this buys little: every writer, and vfs_getroot, still runs
+ * under vfs_biglock, and so does all of vfs_lookup. (vfs_getroot
+ * can't simply drop it, because FSOP_GETROOT takes the biglock and
+ * would then be getting it after knowndevs_lock.) Only
+ * vfs_getdevname runs without the biglock. The lock is here so that
+ * readers can run at once when the biglock is broken up.
+ */
+static struct rwlock *knowndevs_lock;
+
 /* The big lock for all FS ops. Remove for filesystem assignment. */
 static struct lock *vfs_biglock;
 static unsigned vfs_biglock_depth;
@@ -103,12 +119,18 @@ vfs_bootstrap(void)
 		panic("vfs: Could not create knowndevs array\n");
 	}
 
+	knowndevs_lock = rwlock_create("knowndevs");
+	if (knowndevs_lock==NULL) {
+		panic("vfs: Could not create knowndevs lock\n");
+	}
+
 	vfs_biglock = lock_create("vfs_biglock");
 	if (vfs_biglock==NULL) {
 		panic("vfs: Could not create vfs big lock\n");
 	}
 	vfs_biglock_depth = 0;
 
+	buffer_bootstrap();
 	devnull_create();
 }
 
@@ -155,6 +177,7 @@ vfs_sync(void)
 	unsigned i, num;
 
 	vfs_biglock_acquire();
+	rwlock_acquire_read(knowndevs_lock);
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -164,6 +187,7 @@ vfs_sync(void)
 		}
 	}
 
+	rwlock_release_read(knowndevs_lock);
 	vfs_biglock_release();
 
 	return 0;
@@ -174,13 +198,17 @@ vfs_sync(void)
  * back an appropriate vnode.
  */
 int
-vfs_getroot(const char *devname, struct vnode **result)
+vfs_getroot(const char *devname, struct vnode **ret)
 {
 	struct knowndev *kd;
 	unsigned i, num;
+	int result;
 
 	KASSERT(vfs_biglock_do_i_hold());
 
+	rwlock_acquire_read(knowndevs_lock);
+	result = ENODEV;
+
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
 		kd = knowndevarray_get(knowndevs, i);
@@ -200,14 +228,16 @@ vfs_getroot(const char *devname, struct vnode **result)
 
 			if (!strcmp(kd->kd_name, devname) ||
 			    (volname!=NULL && !strcmp(volname, devname))) {
-				*result = FSOP_GETROOT(kd->kd_fs);
-				return 0;
+				*ret = FSOP_GETROOT(kd->kd_fs);
+				result = 0;
+				break;
 			}
 		}
 		else {
 			if (kd->kd_rawname!=NULL &&
 			    !strcmp(kd->kd_name, devname)) {
-				return ENXIO;
+				result = ENXIO;
+				break;
 			}
 		}
 
@@ -221,8 +251,9 @@ vfs_getroot(const char *devname, struct vnode **result)
 			KASSERT(kd->kd_rawname==NULL);
 			KASSERT(kd->kd_device != NULL);
 			VOP_INCREF(kd->kd_vnode);
-			*result = kd->kd_vnode;
-			return 0;
+			*ret = kd->kd_vnode;
+			result = 0;
+			break;
 		}
 
 		/*
@@ -232,8 +263,9 @@ vfs_getroot(const char *devname, struct vnode **result)
 		if (kd->kd_rawname!=NULL && !strcmp(kd->kd_rawname, devname)) {
 			KASSERT(kd->kd_device != NULL);
 			VOP_INCREF(kd->kd_vnode);
-			*result = kd->kd_vnode;
-			return 0;
+			*ret = kd->kd_vnode;
+			result = 0;
+			break;
 		}
 
 		/*
@@ -244,10 +276,12 @@ vfs_getroot(const char *devname, struct vnode **result)
 	}
 
 	/*
-	 * If we got here, the device specified by devname doesn't exist.
+	 * If we got all the way through, the device specified by
+	 * devname doesn't exist, and result is still ENODEV.
 	 */
 
-	return ENODEV;
+	rwlock_release_read(knowndevs_lock);
+	return result;
 }
 
 /*
@@ -257,11 +291,13 @@ const char *
 vfs_getdevname(struct fs *fs)
 {
 	struct knowndev *kd;
+	const char *name;
 	unsigned i, num;
 
 	KASSERT(fs != NULL);
 
-	KASSERT(vfs_biglock_do_i_hold());
+	rwlock_acquire_read(knowndevs_lock);
+	name = NULL;
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -274,11 +310,13 @@ vfs_getdevname(struct fs *fs)
 			 * the fs cannot go away, and the device can't
 			 * go away until the fs goes away.
 			 */
-			return kd->kd_name;
+			name = kd->kd_name;
+			break;
 		}
 	}
 
-	return NULL;
+	rwlock_release_read(knowndevs_lock);
+	return name;
 }
 
 /*
@@ -338,7 +376,7 @@ badnames(const char *n1, const char *n2, const char *n3)
 	unsigned i, num;
 	struct knowndev *kd;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(rwlock_do_i_hold_write(knowndevs_lock));
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -411,7 +449,10 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 		volname = FSOP_GETVOLNAME(fs);
 	}
 
+	rwlock_acquire_write(knowndevs_lock);
+
 	if (badnames(name, rawname, volname)) {
+		rwlock_release_write(knowndevs_lock);
 		vfs_biglock_release();
 		return EEXIST;
 	}
@@ -423,6 +464,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 		dev->d_devnumber = index+1;
 	}
 
+	rwlock_release_write(knowndevs_lock);
 	vfs_biglock_release();
 	return result;
 
@@ -481,6 +523,7 @@ findmount(const char *devname, struct knowndev **result)
 	bool found = false;
 
 	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(rwlock_do_i_hold_write(knowndevs_lock));
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; !found && i<num; i++) {
@@ -515,14 +558,17 @@ vfs_mount(const char *devname, void *data,
 	int result;
 
 	vfs_biglock_acquire();
+	rwlock_acquire_write(knowndevs_lock);
 
 	result = findmount(devname, &kd);
 	if (result) {
+		rwlock_release_write(knowndevs_lock);
 		vfs_biglock_release();
 		return result;
 	}
 
 	if (kd->kd_fs != NULL) {
+		rwlock_release_write(knowndevs_lock);
 		vfs_biglock_release();
 		return EBUSY;
 	}
@@ -531,6 +577,7 @@ vfs_mount(const char *devname, void *data,
 
 	result = mountfunc(data, kd->kd_device, &fs);
 	if (result) {
+		rwlock_release_write(knowndevs_lock);
 		vfs_biglock_release();
 		return result;
 	}
@@ -543,6 +590,7 @@ vfs_mount(const char *devname, void *data,
 	kprintf("vfs: Mounted %s: on %s\n",
 		volname ? volname : kd->kd_name, kd->kd_name);
 
+	rwlock_release_write(knowndevs_lock);
 	vfs_biglock_release();
 	return 0;
 }
@@ -558,6 +606,7 @@ vfs_unmount(const char *devname)
 	int result;
 
 	vfs_biglock_acquire();
+	rwlock_acquire_write(knowndevs_lock);
 
 	result = findmount(devname, &kd);
 	if (result) {
@@ -571,6 +620,9 @@ vfs_unmount(const char *devname)
 	KASSERT(kd->kd_rawname != NULL);
 	KASSERT(kd->kd_device != NULL);
 
+	/* Cached names hold references to its vnodes. */
+	vfs_namecache_purge(kd->kd_fs, false);
+
 	result = FSOP_SYNC(kd->kd_fs);
 	if (result) {
 		goto fail;
@@ -589,6 +641,7 @@ vfs_unmount(const char *devname)
 	KASSERT(result==0);
 
  fail:
+	rwlock_release_write(knowndevs_lock);
 	vfs_biglock_release();
 	return result;
 }
@@ -604,6 +657,7 @@ vfs_unmountall(void)
 	int result;
 
 	vfs_biglock_acquire();
+	rwlock_acquire_write(knowndevs_lock);
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -619,6 +673,8 @@ vfs_unmountall(void)
 
 		kprintf("vfs: Unmounting %s:\n", dev->kd_name);
 
+		vfs_namecache_purge(dev->kd_fs, false);
+
 		result = FSOP_SYNC(dev->kd_fs);
 		if (result) {
 			kprintf("vfs: Warning: sync failed for %s: %s, trying "
@@ -650,6 +706,7 @@ vfs_unmountall(void)
 		dev->kd_fs = NULL;
 	}
 
+	rwlock_release_write(knowndevs_lock);
 	vfs_biglock_release();
 
 	return 0;
@@ -42,6 +42,269 @@
 
 static struct vnode *bootfs_vnode = NULL;
 
+/*
+ * Name cache.
+ *
+ * Filesystems are handed whole paths to translate, so the cache maps
+ * (starting directory, path) to the vnode VOP_LOOKUP found, or to
+ * nothing if it said ENOENT (a negative entry). Entries hold
+ * references to both vnodes, so the pointers stay good; that means
+ * they have to be purged for a filesystem before it can unmount, and
+ * whenever a name goes away, so the file can be reclaimed.
+ *
+ * Since one path may pass through many directories, there's no
+ * telling which entries a change affects. So removing or renaming
+ * anything purges every entry for that filesystem, and creating
+ * anything purges its negative entries. That's cheap next to the
+ * lookups saved.
+ *
+ * Entries come from a fixed pool and are reused least recently used
+ * first. Longer paths aren't cached. Everything is protected by the
+ * vfs biglock.
+ */
+
+#define NC_MAXENTRIES 128	/* entries in the pool */
+#define NC_HASHSIZE   61	/* buckets; prime */
+#define NC_PATHMAX    47	/* longest path cached */
+
+struct ncentry {
+	struct vnode *nc_dir;		/* where lookup starts; NULL if free */
+	struct vnode *nc_vn;		/* what it found; NULL if ENOENT */
+	uint32_t nc_hash;
+	char nc_path[NC_PATHMAX+1];
+	struct ncentry *nc_hashnext;	/* hash chain, or free list */
+	struct ncentry *nc_lrunext;	/* LRU list, most recent first */
+	struct ncentry *nc_lruprev;
+};
+
+static struct ncentry nc_entries[NC_MAXENTRIES];
+static struct ncentry *nc_hash[NC_HASHSIZE];
+static struct ncentry *nc_free;
+static struct ncentry *nc_lruhead, *nc_lrutail;
+static bool nc_inited;
+
+/* Statistics */
+static unsigned nc_hits, nc_neghits, nc_misses, nc_evictions, nc_purged;
+
+static
+uint32_t
+nc_hashname(struct vnode *dir, const char *path)
+{
+	uint32_t h = (uint32_t)(uintptr_t)dir >> 4;
+
+	while (*path != 0) {
+		h = h*33 + (unsigned char)*path++;
+	}
+	return h;
+}
+
+static
+void
+nc_init(void)
+{
+	unsigned i;
+
+	for (i=0; i<NC_MAXENTRIES; i++) {
+		nc_entries[i].nc_dir = NULL;
+		nc_entries[i].nc_hashnext = nc_free;
+		nc_free = &nc_entries[i];
+	}
+	nc_inited = true;
+}
+
+static
+void
+nc_lruremove(struct ncentry *nc)
+{
+	if (nc->nc_lruprev != NULL) {
+		nc->nc_lruprev->nc_lrunext = nc->nc_lrunext;
+	}
+	else {
+		nc_lruhead = nc->nc_lrunext;
+	}
+	if (nc->nc_lrunext != NULL) {
+		nc->nc_lrunext->nc_lruprev = nc->nc_lruprev;
+	}
+	else {
+		nc_lrutail = nc->nc_lruprev;
+	}
+	nc->nc_lrunext = nc->nc_lruprev = NULL;
+}
+
+static
+void
+nc_lruaddhead(struct ncentry *nc)
+{
+	nc->nc_lruprev = NULL;
+	nc->nc_lrunext = nc_lruhead;
+	if (nc_lruhead != NULL) {
+		nc_lruhead->nc_lruprev = nc;
+	}
+	else {
+		nc_lrutail = nc;
+	}
+	nc_lruhead = nc;
+}
+
+/*
+ * Take an entry out of the cache and drop its references.
+ */
+static
+void
+nc_remove(struct ncentry *nc)
+{
+	struct ncentry **ncp;
+	struct vnode *dir, *vn;
+
+	for (ncp = &nc_hash[nc->nc_hash % NC_HASHSIZE]; *ncp != nc;
+	     ncp = &(*ncp)->nc_hashnext) {
+		KASSERT(*ncp != NULL);
+	}
+	*ncp = nc->nc_hashnext;
+	nc_lruremove(nc);
+
+	dir = nc->nc_dir;
+	vn = nc->nc_vn;
+	nc->nc_dir = nc->nc_vn = NULL;
+	nc->nc_hashnext = nc_free;
+	nc_free = nc;
+
+	/* These may reclaim, so do them once the entry is gone. */
+	VOP_DECREF(dir);
+	if (vn != NULL) {
+		VOP_DECREF(vn);
+	}
+}
+
+/*
+ * Look up PATH from DIR. If it's there, returns true and hands back
+ * the result of the lookup: 0 with a new reference in *RET, or ENOENT.
+ */
+static
+bool
+nc_find(struct vnode *dir, const char *path, struct vnode **ret, int *err)
+{
+	struct ncentry *nc;
+	uint32_t hash;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (strlen(path) > NC_PATHMAX) {
+		return false;
+	}
+
+	hash = nc_hashname(dir, path);
+	for (nc = nc_hash[hash % NC_HASHSIZE]; nc != NULL;
+	     nc = nc->nc_hashnext) {
+		if (nc->nc_hash == hash && nc->nc_dir == dir &&
+		    !strcmp(nc->nc_path, path)) {
+			break;
+		}
+	}
+	if (nc == NULL) {
+		nc_misses++;
+		return false;
+	}
+
+	nc_lruremove(nc);
+	nc_lruaddhead(nc);
+
+	if (nc->nc_vn == NULL) {
+		nc_neghits++;
+		*err = ENOENT;
+		return true;
+	}
+	nc_hits++;
+	VOP_INCREF(nc->nc_vn);
+	*ret = nc->nc_vn;
+	*err = 0;
+	return true;
+}
+
+/*
+ * Remember that looking up PATH from DIR found VN (or nothing, if VN
+ * is NULL).
+ */
+static
+void
+nc_enter(struct vnode *dir, const char *path, struct vnode *vn)
+{
+	struct ncentry *nc;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (strlen(path) > NC_PATHMAX) {
+		return;
+	}
+	if (!nc_inited) {
+		nc_init();
+	}
+
+	if (nc_free == NULL) {
+		/* Reuse the least recently used entry. */
+		KASSERT(nc_lrutail != NULL);
+		nc_remove(nc_lrutail);
+		nc_evictions++;
+	}
+	nc = nc_free;
+	nc_free = nc->nc_hashnext;
+
+	VOP_INCREF(dir);
+	nc->nc_dir = dir;
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+	nc->nc_vn = vn;
+	strcpy(nc->nc_path, path);
+	nc->nc_hash = nc_hashname(dir, path);
+	nc->nc_hashnext = nc_hash[nc->nc_hash % NC_HASHSIZE];
+	nc_hash[nc->nc_hash % NC_HASHSIZE] = nc;
+	nc_lruaddhead(nc);
+}
+
+/*
+ * Drop cached names on filesystem FS (or on everything, if FS is
+ * NULL): just the negative ones if NEGONLY is set.
+ */
+void
+vfs_namecache_purge(struct fs *fs, bool negonly)
+{
+	struct ncentry *nc, *next;
+
+	vfs_biglock_acquire();
+	for (nc = nc_lruhead; nc != NULL; nc = next) {
+		next = nc->nc_lrunext;
+		if (negonly && nc->nc_vn != NULL) {
+			continue;
+		}
+		if (fs != NULL && nc->nc_dir->vn_fs != fs &&
+		    (nc->nc_vn == NULL || nc->nc_vn->vn_fs != fs)) {
+			continue;
+		}
+		nc_remove(nc);
+		nc_purged++;
+	}
+	vfs_biglock_release();
+}
+
+void
+vfs_namecache_printstats(void)
+{
+	unsigned hits, neghits, misses, evictions, purged;
+
+	vfs_biglock_acquire();
+	hits = nc_hits;
+	neghits = nc_neghits;
+	misses = nc_misses;
+	evictions = nc_evictions;
+	purged = nc_purged;
+	vfs_biglock_release();
+
+	kprintf("Name cache: %u hits (%u positive, %u negative), "
+		"%u misses\n", hits + neghits, hits, neghits, misses);
+	kprintf("Name cache: %u evicted, %u purged\n", evictions, purged);
+}
+
 /*
  * Helper function for actually changing bootfs_vnode.
  */
@@ -265,6 +528,8 @@ int
 vfs_lookup(char *path, struct vnode **retval)
 {
 	struct vnode *startvn;
+	char key[NC_PATHMAX+1];
+	bool cacheable;
 	int result;
 
 	vfs_biglock_acquire();
@@ -281,8 +546,27 @@ vfs_lookup(char *path, struct vnode **retval)
 		return 0;
 	}
 
+	if (nc_find(startvn, path, retval, &result)) {
+		VOP_DECREF(startvn);
+		vfs_biglock_release();
+		return result;
+	}
+
+	/* VOP_LOOKUP may scribble on the path; save it for the cache. */
+	cacheable = strlen(path) <= NC_PATHMAX;
+	if (cacheable) {
+		strcpy(key, path);
+	}
+
 	result = VOP_LOOKUP(startvn, path, retval);
 
+	if (cacheable && result == 0) {
+		nc_enter(startvn, key, *retval);
+	}
+	else if (cacheable && result == ENOENT) {
+		nc_enter(startvn, key, NULL);
+	}
+
 	VOP_DECREF(startvn);
 	vfs_biglock_release();
 	return result;
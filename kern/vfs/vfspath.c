@@ -74,6 +74,9 @@ vfs_open(char *path, int openflags, mode_t mode, struct vnode **ret)
 		}
 
 		result = VOP_CREAT(dir, name, excl, mode, &vn);
+		if (result == 0) {
+			vfs_namecache_purge(dir->vn_fs, true);
+		}
 
 		VOP_DECREF(dir);
 	}
@@ -150,6 +153,9 @@ vfs_remove(char *path)
 	}
 
 	result = VOP_REMOVE(dir, name);
+	if (result == 0) {
+		vfs_namecache_purge(dir->vn_fs, false);
+	}
 	VOP_DECREF(dir);
 
 	return result;
@@ -183,6 +189,9 @@ vfs_rename(char *oldpath, char *newpath)
 	}
 
 	result = VOP_RENAME(olddir, oldname, newdir, newname);
+	if (result == 0) {
+		vfs_namecache_purge(olddir->vn_fs, false);
+	}
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(olddir);
@@ -217,6 +226,9 @@ vfs_link(char *oldpath, char *newpath)
 	}
 
 	result = VOP_LINK(newdir, newname, oldfile);
+	if (result == 0) {
+		vfs_namecache_purge(newdir->vn_fs, true);
+	}
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(oldfile);
@@ -244,6 +256,9 @@ vfs_symlink(const char *contents, char *path)
 	}
 
 	result = VOP_SYMLINK(newdir, newname, contents);
+	if (result == 0) {
+		vfs_namecache_purge(newdir->vn_fs, true);
+	}
 	VOP_DECREF(newdir);
 
 	return result;
@@ -290,6 +305,9 @@ vfs_mkdir(char *path, mode_t mode)
 	}
 
 	result = VOP_MKDIR(parent, name, mode);
+	if (result == 0) {
+		vfs_namecache_purge(parent->vn_fs, true);
+	}
 
 	VOP_DECREF(parent);
 
@@ -312,6 +330,9 @@ vfs_rmdir(char *path)
 	}
 
 	result = VOP_RMDIR(parent, name);
+	if (result == 0) {
+		vfs_namecache_purge(parent->vn_fs, false);
+	}
 
 	VOP_DECREF(parent);
 
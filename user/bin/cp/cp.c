@@ -28,6 +28,7 @@
  */
 
 #include <unistd.h>
+#include <errno.h>
 #include <err.h>
 
 /*
@@ -59,30 +60,46 @@ copy(const char *from, const char *to)
 	}
 
 	/*
-	 * As long as we get more than zero bytes, we haven't hit EOF.
-	 * Zero means EOF. Less than zero means an error occurred.
-	 * We may read less than we asked for, though, in various cases
-	 * for various reasons.
+	 * Have the kernel copy the data if it can, so it doesn't have
+	 * to come out to us and go back in again. Zero means EOF.
 	 */
-	while ((len = read(fromfd, buf, sizeof(buf)))>0) {
+	while ((len = copy_file_range(fromfd, NULL, tofd, NULL,
+				      64*1024, 0)) > 0) {
+		/* nothing */
+	}
+	if (len < 0 && errno != ENOSYS) {
+		err(1, "%s to %s", from, to);
+	}
+
+	if (len < 0) {
 		/*
-		 * Likewise, we may actually write less than we attempted
-		 * to. So loop until we're done.
+		 * The kernel can't do it; do it ourselves.
+		 *
+		 * As long as we get more than zero bytes, we haven't hit EOF.
+		 * Zero means EOF. Less than zero means an error occurred.
+		 * We may read less than we asked for, though, in various cases
+		 * for various reasons.
 		 */
-		wrtot = 0;
-		while (wrtot < len) {
-			wr = write(tofd, buf+wrtot, len-wrtot);
-			if (wr<0) {
-				err(1, "%s", to);
+		while ((len = read(fromfd, buf, sizeof(buf)))>0) {
+			/*
+			 * Likewise, we may actually write less than we attempted
+			 * to. So loop until we're done.
+			 */
+			wrtot = 0;
+			while (wrtot < len) {
+				wr = write(tofd, buf+wrtot, len-wrtot);
+				if (wr<0) {
+					err(1, "%s", to);
+				}
+				wrtot += wr;
 			}
-			wrtot += wr;
 		}
-	}
-	/*
-	 * If we got a read error, print it and exit.
-	 */
-	if (len<0) {
-		err(1, "%s", from);
+		/*
+		 * If we got a read error, print it and exit.
+		 */
+		if (len<0) {
+			err(1, "%s", from);
+		}
 	}
 
 	if (close(fromfd) < 0) {
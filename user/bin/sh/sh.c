@@ -354,6 +354,17 @@ docommand(char *buf)
 		__time(&startsecs, &startnsecs);
 	}
 
+#ifndef HOST
+	/*
+	 * Create the child with the program already loaded, rather
+	 * than copying our address space only to replace it.
+	 */
+	pid = spawn(args[0], args);
+	if (pid < 0) {
+		warn("%s", args[0]);
+		return _MKWAIT_EXIT(1);
+	}
+#else
 	pid = fork();
 	switch (pid) {
 		case -1:
@@ -375,6 +386,7 @@ docommand(char *buf)
 		default:
 			break;
 	}
+#endif
 
 	/* parent */
 	if (bg) {
@@ -38,7 +38,9 @@
  * about the kern/ headers.
  */
 #include <kern/fcntl.h>
+#include <kern/iovec.h>
 #include <kern/ioctl.h>
+#include <kern/poll.h>
 #include <kern/reboot.h>
 #include <kern/seek.h>
 #include <kern/time.h>
@@ -152,8 +154,20 @@ int symlink(const char *target, const char *linkname);
 int readlink(const char *path, char *buf, size_t buflen);
 int dup2(int filehandle, int newhandle);
 int pipe(int filehandles[2]);
+int poll(struct pollfd *fds, nfds_t nfds, int timeout);
+ssize_t pread(int filehandle, void *buf, size_t size, off_t pos);
+ssize_t pwrite(int filehandle, const void *buf, size_t size, off_t pos);
+ssize_t copy_file_range(int infd, off_t *inpos, int outfd, off_t *outpos,
+			size_t len, unsigned flags);
+ssize_t readv(int filehandle, const struct iovec *iov, int iovcnt);
+ssize_t writev(int filehandle, const struct iovec *iov, int iovcnt);
+ssize_t preadv(int filehandle, const struct iovec *iov, int iovcnt,
+	       off_t pos);
+ssize_t pwritev(int filehandle, const struct iovec *iov, int iovcnt,
+		off_t pos);
 time_t __time(time_t *seconds, unsigned long *nanoseconds);
 int __getcwd(char *buf, size_t buflen);
+pid_t spawn(const char *prog, char *const *args);	/* fork + execv */
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
 
@@ -0,0 +1,281 @@
+/*
+ * pipetest - test pipes.
+ *
+ * Checks that:
+ *    - data still in the pipe when the writer closes can be read,
+ *      and is followed by EOF;
+ *    - a writer blocks when the pipe is full, and carries on once
+ *      the reader makes room;
+ *    - a pipe works across fork, with its ends moved around by dup2,
+ *      and EOF comes only when every copy of the write end is closed.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <err.h>
+
+/* How long to give a writer to block, in milliseconds */
+#define DELAY_MS 500
+
+/* Bytes written past a full pipe */
+#define EXTRA 100
+
+/* Largest pipe size we can test */
+#define MAXPIPE 8192
+
+static char bigbuf[MAXPIPE + EXTRA];
+
+static
+unsigned long
+now_ms(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	secs = __time(&secs, &nsecs);
+	return secs * 1000 + nsecs / 1000000;
+}
+
+static
+void
+spin_ms(unsigned long ms)
+{
+	unsigned long start;
+
+	start = now_ms();
+	while (now_ms() - start < ms) {
+		/* nothing */
+	}
+}
+
+static
+void
+mkpipe(int fds[2])
+{
+	if (pipe(fds) < 0) {
+		err(1, "pipe");
+	}
+}
+
+static
+void
+reap(pid_t pid)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "child failed");
+	}
+}
+
+/*
+ * Read exactly LEN bytes into BUF.
+ */
+static
+void
+readall(int fd, char *buf, size_t len)
+{
+	size_t done;
+	ssize_t r;
+
+	for (done = 0; done < len; done += r) {
+		r = read(fd, buf + done, len - done);
+		if (r < 0) {
+			err(1, "read");
+		}
+		if (r == 0) {
+			errx(1, "unexpected EOF after %lu of %lu bytes",
+			     (unsigned long)done, (unsigned long)len);
+		}
+	}
+}
+
+static
+void
+expect_eof(int fd)
+{
+	char ch;
+	ssize_t r;
+
+	r = read(fd, &ch, 1);
+	if (r < 0) {
+		err(1, "read");
+	}
+	if (r != 0) {
+		errx(1, "read %ld bytes; expected EOF", (long)r);
+	}
+}
+
+static
+void
+test_eof(void)
+{
+	static const char msg[] = "still in the pipe";
+	char buf[sizeof(msg)];
+	int fds[2];
+
+	printf("EOF after buffered data...\n");
+	mkpipe(fds);
+	if (write(fds[1], msg, sizeof(msg)) != sizeof(msg)) {
+		err(1, "write");
+	}
+	close(fds[1]);
+
+	readall(fds[0], buf, sizeof(msg));
+	if (strcmp(buf, msg) != 0) {
+		errx(1, "read back the wrong data");
+	}
+	expect_eof(fds[0]);
+	expect_eof(fds[0]);
+	close(fds[0]);
+}
+
+static
+void
+test_full(void)
+{
+	struct stat st;
+	struct pollfd pfd;
+	int fds[2], status[2];
+	size_t size, i;
+	pid_t pid;
+	char ch;
+	int r;
+
+	printf("Writer blocks on a full pipe...\n");
+	mkpipe(fds);
+	mkpipe(status);
+
+	if (fstat(fds[0], &st) < 0) {
+		err(1, "fstat");
+	}
+	size = st.st_blksize;
+	if (size == 0 || size > MAXPIPE) {
+		errx(1, "pipe size %lu not supported", (unsigned long)size);
+	}
+	for (i=0; i<size + EXTRA; i++) {
+		bigbuf[i] = i % 251;
+	}
+
+	/*
+	 * The child writes a pipeful and then some, then says so on
+	 * the status pipe.
+	 */
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		close(status[0]);
+		r = write(fds[1], bigbuf, size + EXTRA);
+		if (r < 0 || (size_t)r != size + EXTRA) {
+			err(1, "child: write");
+		}
+		if (write(status[1], "d", 1) != 1) {
+			err(1, "child: write status");
+		}
+		_exit(0);
+	}
+	close(fds[1]);
+	close(status[1]);
+
+	/* Give it a while; it should still be stuck. */
+	spin_ms(DELAY_MS);
+	pfd.fd = status[0];
+	pfd.events = POLLIN;
+	r = poll(&pfd, 1, 0);
+	if (r < 0) {
+		err(1, "poll");
+	}
+	if (r != 0) {
+		errx(1, "writer finished without blocking on a full pipe");
+	}
+
+	/* Make just enough room, and it should finish. */
+	memset(bigbuf, 0, sizeof(bigbuf));
+	readall(fds[0], bigbuf, EXTRA);
+	if (read(status[0], &ch, 1) != 1) {
+		errx(1, "writer did not resume after a read");
+	}
+
+	readall(fds[0], bigbuf + EXTRA, size);
+	expect_eof(fds[0]);
+	for (i=0; i<size + EXTRA; i++) {
+		if (bigbuf[i] != (char)(i % 251)) {
+			errx(1, "wrong data at offset %lu",
+			     (unsigned long)i);
+		}
+	}
+
+	reap(pid);
+	close(fds[0]);
+	close(status[0]);
+}
+
+static
+void
+test_forkdup(void)
+{
+	static const char msg[] = "through stdout";
+	char buf[sizeof(msg)];
+	int fds[2];
+	int rfd;
+	pid_t pid;
+
+	printf("Pipe across fork and dup2...\n");
+	mkpipe(fds);
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		/* Write to the pipe as our stdout. */
+		if (dup2(fds[1], STDOUT_FILENO) < 0) {
+			err(1, "child: dup2");
+		}
+		close(fds[0]);
+		close(fds[1]);
+		if (write(STDOUT_FILENO, msg, sizeof(msg)) != sizeof(msg)) {
+			_exit(1);
+		}
+		_exit(0);
+	}
+
+	/* Read from a different descriptor than pipe() gave us. */
+	close(fds[1]);
+	rfd = fds[0] + 5;
+	if (dup2(fds[0], rfd) < 0) {
+		err(1, "dup2");
+	}
+	close(fds[0]);
+
+	readall(rfd, buf, sizeof(msg));
+	if (strcmp(buf, msg) != 0) {
+		errx(1, "read back the wrong data");
+	}
+	/* The child's stdout is the last write end; EOF once it exits. */
+	expect_eof(rfd);
+
+	reap(pid);
+	close(rfd);
+}
+
+int
+main(void)
+{
+	test_eof();
+	test_full();
+	test_forkdup();
+	printf("pipetest done.\n");
+	return 0;
+}
@@ -0,0 +1,248 @@
+/*
+ * polltest - test poll() on pipes.
+ *
+ * Checks that:
+ *    - poll with nothing ready times out, and not early;
+ *    - a poller sleeping on a pipe wakes up when another process
+ *      writes to it;
+ *    - an fd that isn't open comes back POLLNVAL;
+ *    - the read end comes back POLLHUP once the write end is closed,
+ *      both when it's already closed and when it's closed while the
+ *      poller sleeps.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <err.h>
+
+/* How long the child waits before doing something, in milliseconds */
+#define DELAY_MS 500
+
+static
+unsigned long
+now_ms(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	secs = __time(&secs, &nsecs);
+	return secs * 1000 + nsecs / 1000000;
+}
+
+static
+void
+spin_ms(unsigned long ms)
+{
+	unsigned long start;
+
+	start = now_ms();
+	while (now_ms() - start < ms) {
+		/* nothing */
+	}
+}
+
+static
+void
+mkpipe(int fds[2])
+{
+	if (pipe(fds) < 0) {
+		err(1, "pipe");
+	}
+}
+
+/*
+ * Fork a child that waits a bit, then writes a byte to WFD (if
+ * DOWRITE) and exits, closing WFD.
+ */
+static
+pid_t
+delayed_child(int rfd, int wfd, int dowrite)
+{
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		close(rfd);
+		spin_ms(DELAY_MS);
+		if (dowrite && write(wfd, "x", 1) != 1) {
+			err(1, "child: write");
+		}
+		_exit(0);
+	}
+	return pid;
+}
+
+static
+void
+reap(pid_t pid)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+}
+
+static
+void
+test_timeout(void)
+{
+	struct pollfd pfd;
+	int fds[2];
+	unsigned long start, elapsed;
+	int r;
+
+	printf("Timeout with nothing ready...\n");
+	mkpipe(fds);
+
+	pfd.fd = fds[0];
+	pfd.events = POLLIN;
+
+	r = poll(&pfd, 1, 0);
+	if (r != 0) {
+		errx(1, "poll with zero timeout returned %d", r);
+	}
+
+	start = now_ms();
+	r = poll(&pfd, 1, DELAY_MS);
+	elapsed = now_ms() - start;
+	if (r < 0) {
+		err(1, "poll");
+	}
+	if (r != 0 || pfd.revents != 0) {
+		errx(1, "poll returned %d, revents 0x%x; expected timeout",
+		     r, pfd.revents);
+	}
+	if (elapsed < DELAY_MS) {
+		errx(1, "poll timed out after %lu ms; asked for %d",
+		     elapsed, DELAY_MS);
+	}
+
+	close(fds[0]);
+	close(fds[1]);
+}
+
+static
+void
+test_wakeup(void)
+{
+	struct pollfd pfd;
+	int fds[2];
+	char ch;
+	pid_t pid;
+	int r;
+
+	printf("Wakeup from a pipe write...\n");
+	mkpipe(fds);
+	pid = delayed_child(fds[0], fds[1], 1);
+
+	pfd.fd = fds[0];
+	pfd.events = POLLIN;
+	r = poll(&pfd, 1, -1);
+	if (r < 0) {
+		err(1, "poll");
+	}
+	if (r != 1 || (pfd.revents & POLLIN) == 0) {
+		errx(1, "poll returned %d, revents 0x%x; expected POLLIN",
+		     r, pfd.revents);
+	}
+	if (read(fds[0], &ch, 1) != 1 || ch != 'x') {
+		errx(1, "read after poll didn't get the byte written");
+	}
+
+	reap(pid);
+	close(fds[0]);
+	close(fds[1]);
+}
+
+static
+void
+test_nval(void)
+{
+	struct pollfd pfd[2];
+	int fds[2];
+	int r;
+
+	printf("POLLNVAL...\n");
+	mkpipe(fds);
+	close(fds[1]);
+
+	/* fds[1] is closed now; a negative fd is ignored */
+	pfd[0].fd = fds[1];
+	pfd[0].events = POLLIN;
+	pfd[1].fd = -1;
+	pfd[1].events = POLLIN;
+	r = poll(pfd, 2, -1);
+	if (r < 0) {
+		err(1, "poll");
+	}
+	if (r != 1 || pfd[0].revents != POLLNVAL || pfd[1].revents != 0) {
+		errx(1, "poll returned %d, revents 0x%x 0x%x; "
+		     "expected POLLNVAL and 0",
+		     r, pfd[0].revents, pfd[1].revents);
+	}
+
+	close(fds[0]);
+}
+
+static
+void
+test_hup(void)
+{
+	struct pollfd pfd;
+	int fds[2];
+	pid_t pid;
+	int r;
+
+	printf("POLLHUP with the write end already closed...\n");
+	mkpipe(fds);
+	close(fds[1]);
+
+	pfd.fd = fds[0];
+	pfd.events = POLLIN;
+	r = poll(&pfd, 1, -1);
+	if (r < 0) {
+		err(1, "poll");
+	}
+	if (r != 1 || (pfd.revents & POLLHUP) == 0) {
+		errx(1, "poll returned %d, revents 0x%x; expected POLLHUP",
+		     r, pfd.revents);
+	}
+	close(fds[0]);
+
+	printf("POLLHUP with the write end closed while polling...\n");
+	mkpipe(fds);
+	pid = delayed_child(fds[0], fds[1], 0);
+	close(fds[1]);
+
+	pfd.fd = fds[0];
+	pfd.events = POLLIN;
+	r = poll(&pfd, 1, -1);
+	if (r < 0) {
+		err(1, "poll");
+	}
+	if (r != 1 || (pfd.revents & POLLHUP) == 0) {
+		errx(1, "poll returned %d, revents 0x%x; expected POLLHUP",
+		     r, pfd.revents);
+	}
+
+	reap(pid);
+	close(fds[0]);
+}
+
+int
+main(void)
+{
+	test_timeout();
+	test_wakeup();
+	test_nval();
+	test_hup();
+	printf("polltest done.\n");
+	return 0;
+}